@@ -0,0 +1,1227 @@
+#include "baseline.h"
+#include "config.h"
+#include "digest.h"
+#include "governor.h"
+#include "hashing.h"
+#include "linediff.h"
+#include "merkle.h"
+#include "metrics.h"
+#include "parser.h"
+#include "threadpool.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define BENCH_WRITE_CHUNK (64 * 1024)
+#define BENCH_MAX_DIRS (1 << 20)
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef enum
+{
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_LOG_UNIFORM,
+    SIZE_MIXED // 80% log-uniform up to 16 KiB, 18% up to 1 MiB, 2% up to 16 MiB
+} size_kind_t;
+
+typedef struct
+{
+    size_kind_t kind;
+    uint64_t    min;
+    uint64_t    max;
+    const char *spec;
+} size_dist_t;
+
+typedef struct
+{
+    size_t      files;
+    unsigned    depth;
+    unsigned    fanout;
+    size_dist_t sizes;
+    unsigned    hardlink_pct;
+    unsigned    symlink_pct;
+    unsigned    text_pct;
+    uint64_t    seed;
+    unsigned    iterations;
+    size_t      threads;
+    const char *root;
+    const char *json_path;
+    bool        keep;
+    bool        evict;
+} bench_options_t;
+
+typedef enum
+{
+    PATH_REGULAR,
+    PATH_TEXT,
+    PATH_HARDLINK,
+    PATH_SYMLINK
+} path_kind_t;
+
+typedef struct
+{
+    char       *path;
+    uint64_t    size;
+    size_t      dir;
+    path_kind_t kind;
+} bench_path_t;
+
+typedef struct
+{
+    char            root[PATH_MAX - 64]; // leaves room for the tree and state paths below it
+    char            tree[PATH_MAX];
+    char            baseline[PATH_MAX];
+    char            merkle[PATH_MAX];
+    char            lines[PATH_MAX];
+    char          **dirs;
+    unsigned       *dir_level;
+    size_t          dir_count;
+    bench_path_t   *paths; // every generated path: regular and text files, then hardlinks, then symlinks
+    size_t          path_count;
+    size_t          primary_count;
+    size_t         *text; // indices of the text files in paths
+    size_t          text_count;
+    config_entry_t *entries;
+    size_t          entry_count;
+    uint64_t        total_bytes;
+    char            content_hex[HASH_HEX_LEN + 1];
+    double          generate_seconds;
+} bench_tree_t;
+
+typedef struct
+{
+    const char *name;
+    size_t (*op_count)(const bench_tree_t *tree);
+    int (*run_op)(const bench_tree_t *tree, size_t index, size_t *files);
+} bench_phase_t;
+
+typedef struct
+{
+    const char *name;
+    const char *cache;
+    unsigned    passes;
+    size_t      ops;
+    size_t      files;
+    uint64_t    shared; // files settled by the inode memo from another path
+    uint64_t    bytes; // content actually read, from METRIC_BYTES_READ
+    size_t      failures;
+    uint64_t    wall_ns;
+    uint64_t    syscalls;
+    bool        have_syscalls;
+    long        peak_rss_kb;
+    uint64_t   *latency_ns;
+    size_t      latency_count;
+} phase_result_t;
+
+// A cold pass starts from empty state and, with --evict, an empty page cache. A page-cache pass also starts from empty
+// state, so every file is read again, but right after another pass has read the tree. A baseline pass keeps the state
+// of the pass before, so only what the baseline cannot vouch for is read.
+typedef enum
+{
+    CACHE_COLD,
+    CACHE_PAGES,
+    CACHE_BASELINE,
+    CACHE_STATE_COUNT
+} cache_state_t;
+
+static const char *const cache_names[CACHE_STATE_COUNT] = {"cold", "page_cache", "baseline"};
+
+typedef enum
+{
+    SYSCALLS_NONE,
+    SYSCALLS_PERF,   // raw_syscalls:sys_enter tracepoint, inherited by every thread started after it is opened
+    SYSCALLS_PROC_IO // syscr + syscw from /proc/self/io: read and write calls only
+} syscall_source_t;
+
+static syscall_source_t syscall_source = SYSCALLS_NONE;
+static int              syscall_fd = -1;
+
+// splitmix64: tiny, fast and fully determined by the seed, so a seed reproduces the same tree on any machine.
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+static uint64_t rng_below(uint64_t bound)
+{
+    return bound ? rng_next() % bound : 0;
+}
+
+static unsigned bit_length(uint64_t v)
+{
+    return v ? 64 - (unsigned)__builtin_clzll(v) : 0;
+}
+
+// Picks a bit length uniformly, then a value uniformly within it: log-uniform without libm.
+static uint64_t log_uniform(uint64_t lo, uint64_t hi)
+{
+    uint64_t lo1 = lo + 1;
+    uint64_t hi1 = hi + 1;
+    unsigned bits = bit_length(lo1) + (unsigned)rng_below(bit_length(hi1) - bit_length(lo1) + 1);
+    uint64_t floor = bits ? 1ULL << (bits - 1) : 0;
+    uint64_t ceil = bits >= 64 ? UINT64_MAX : (1ULL << bits) - 1;
+
+    if (floor < lo1)
+        floor = lo1;
+    if (ceil > hi1)
+        ceil = hi1;
+
+    return floor + rng_below(ceil - floor + 1) - 1;
+}
+
+static uint64_t sample_size(const size_dist_t *dist)
+{
+    uint64_t pick;
+
+    switch (dist->kind)
+    {
+        case SIZE_FIXED:
+            return dist->min;
+        case SIZE_UNIFORM:
+            return dist->min + rng_below(dist->max - dist->min + 1);
+        case SIZE_LOG_UNIFORM:
+            return log_uniform(dist->min, dist->max);
+        case SIZE_MIXED:
+            pick = rng_below(100);
+            if (pick < 80)
+                return log_uniform(0, 16 * 1024);
+            if (pick < 98)
+                return log_uniform(16 * 1024, 1024 * 1024);
+            return log_uniform(1024 * 1024, 16 * 1024 * 1024);
+        default:
+            return 0;
+    }
+}
+
+static int parse_size(const char *text, uint64_t *out)
+{
+    char              *end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text)
+        return -1;
+
+    switch (*end)
+    {
+        case 'G':
+            value *= 1024;
+            // fall through
+        case 'M':
+            value *= 1024;
+            // fall through
+        case 'K':
+            value *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+
+    if (*end != '\0' && *end != ':')
+        return -1;
+
+    *out = value;
+
+    return 0;
+}
+
+// "mixed", "fixed:SIZE", "uniform:MIN:MAX" or "log:MIN:MAX"; sizes take a K, M or G suffix.
+static int parse_size_dist(const char *spec, size_dist_t *dist)
+{
+    const char *args = strchr(spec, ':');
+    const char *second = args ? strchr(args + 1, ':') : NULL;
+
+    dist->spec = spec;
+    dist->min = 0;
+    dist->max = 0;
+
+    if (strcmp(spec, "mixed") == 0)
+    {
+        dist->kind = SIZE_MIXED;
+        return 0;
+    }
+
+    if (!args)
+        return -1;
+
+    if (strncmp(spec, "fixed:", 6) == 0)
+    {
+        dist->kind = SIZE_FIXED;
+        return second ? -1 : parse_size(args + 1, &dist->min);
+    }
+
+    if (strncmp(spec, "uniform:", 8) == 0)
+        dist->kind = SIZE_UNIFORM;
+    else if (strncmp(spec, "log:", 4) == 0)
+        dist->kind = SIZE_LOG_UNIFORM;
+    else
+        return -1;
+
+    if (!second || parse_size(args + 1, &dist->min) != 0 || parse_size(second + 1, &dist->max) != 0)
+        return -1;
+
+    return dist->min <= dist->max && dist->max < UINT64_MAX ? 0 : -1;
+}
+
+static double seconds_of(uint64_t ns)
+{
+    return (double)ns / (double)NSEC_PER_SEC;
+}
+
+// Text files are lines of lowercase words averaging 32 bytes, so hash_file_lines has real lines to split.
+static void fill_buffer(unsigned char *buf, size_t len, bool text)
+{
+    for (size_t i = 0; i < len; i += 8)
+    {
+        uint64_t word = rng_next();
+
+        for (size_t j = 0; j < 8 && i + j < len; j++, word >>= 8)
+        {
+            unsigned char b = (unsigned char)word;
+
+            if (!text)
+                buf[i + j] = b;
+            else if ((b & 63) < 52)
+                buf[i + j] = (unsigned char)('a' + (b & 63) % 26);
+            else if ((b & 63) < 62)
+                buf[i + j] = ' ';
+            else
+                buf[i + j] = '\n';
+        }
+    }
+}
+
+static int write_file(const char *path, uint64_t size, bool text, EVP_MD_CTX *content)
+{
+    static unsigned char buf[BENCH_WRITE_CHUNK];
+    int                  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        return -1;
+
+    while (size > 0)
+    {
+        size_t len = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+
+        fill_buffer(buf, len, text);
+        EVP_DigestUpdate(content, buf, len);
+
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t n = write(fd, buf + done, len - done);
+
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                close(fd);
+                return -1;
+            }
+            done += (size_t)n;
+        }
+
+        size -= len;
+    }
+
+    return close(fd);
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char  *path = safe_malloc(len);
+
+    snprintf(path, len, "%s/%s", dir, name);
+
+    return path;
+}
+
+static bench_path_t *add_path(bench_tree_t *tree, char *path, uint64_t size, size_t dir, path_kind_t kind)
+{
+    bench_path_t *entry = &tree->paths[tree->path_count++];
+
+    entry->path = path;
+    entry->size = size;
+    entry->dir = dir;
+    entry->kind = kind;
+
+    return entry;
+}
+
+static int make_dirs(bench_tree_t *tree, const bench_options_t *opts)
+{
+    size_t capacity = 1;
+    size_t level_size = 1;
+
+    for (unsigned level = 0; level < opts->depth; level++)
+    {
+        level_size *= opts->fanout;
+        capacity += level_size;
+        if (capacity > BENCH_MAX_DIRS)
+        {
+            fprintf(stderr, "heimdall-bench: depth %u with fanout %u exceeds %d directories\n", opts->depth, opts->fanout,
+                    BENCH_MAX_DIRS);
+            return -1;
+        }
+    }
+
+    tree->dirs = safe_malloc(capacity * sizeof(char *));
+    tree->dir_level = safe_malloc(capacity * sizeof(unsigned));
+    tree->dirs[0] = safe_strdup(tree->tree);
+    tree->dir_level[0] = 0;
+    tree->dir_count = 1;
+
+    if (mkdir(tree->tree, 0755) == -1)
+        return -1;
+
+    // Breadth first, so dirs[] lists every level before the next.
+    for (size_t i = 0; i < tree->dir_count; i++)
+    {
+        if (tree->dir_level[i] == opts->depth)
+            continue;
+
+        for (unsigned c = 0; c < opts->fanout; c++)
+        {
+            char name[16];
+
+            snprintf(name, sizeof(name), "d%02u", c);
+            tree->dirs[tree->dir_count] = join_path(tree->dirs[i], name);
+            tree->dir_level[tree->dir_count] = tree->dir_level[i] + 1;
+
+            if (mkdir(tree->dirs[tree->dir_count], 0755) == -1)
+                return -1;
+            tree->dir_count++;
+        }
+    }
+
+    return 0;
+}
+
+// Top-level directories become "d" entries and files directly under the root "f" entries, with line digests for
+// text files, which is how a configuration covering the same tree would be merged.
+static void make_entries(bench_tree_t *tree)
+{
+    tree->entries = safe_malloc((tree->dir_count + tree->path_count) * sizeof(config_entry_t));
+    tree->entry_count = 0;
+
+    for (size_t i = 1; i < tree->dir_count && tree->dir_level[i] == 1; i++)
+    {
+        config_entry_t *entry = &tree->entries[tree->entry_count++];
+
+        memset(entry, 0, sizeof(*entry));
+        entry->path = tree->dirs[i];
+        entry->hash_level = HASH_DIR_LVL;
+        entry->alert_level = ALERT_RED;
+    }
+
+    for (size_t i = 0; i < tree->path_count; i++)
+    {
+        if (tree->paths[i].dir != 0)
+            continue;
+
+        config_entry_t *entry = &tree->entries[tree->entry_count++];
+
+        memset(entry, 0, sizeof(*entry));
+        entry->path = tree->paths[i].path;
+        entry->hash_level = HASH_FILE_LVL;
+        entry->alert_level = ALERT_RED;
+        entry->lines = tree->paths[i].kind == PATH_TEXT;
+    }
+}
+
+static int generate_tree(bench_tree_t *tree, const bench_options_t *opts)
+{
+    size_t         hardlinks = opts->files * opts->hardlink_pct / 100;
+    size_t         symlinks = opts->files * opts->symlink_pct / 100;
+    unsigned char  digest[SHA256_DIGEST_LENGTH];
+    EVP_MD_CTX    *content = digest_acquire();
+    uint64_t       start = governor_clock_ns();
+
+    rng_state = opts->seed;
+
+    if (!content || make_dirs(tree, opts) != 0)
+    {
+        digest_release(content);
+        return -1;
+    }
+
+    tree->paths = safe_malloc((opts->files + hardlinks + symlinks) * sizeof(bench_path_t));
+    tree->text = safe_malloc((opts->files ? opts->files : 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < opts->files; i++)
+    {
+        char     name[32];
+        size_t   dir = (size_t)rng_below(tree->dir_count);
+        uint64_t size = sample_size(&opts->sizes);
+        bool     text = rng_below(100) < opts->text_pct;
+
+        snprintf(name, sizeof(name), text ? "t%06zu.txt" : "f%06zu", i);
+
+        bench_path_t *entry = add_path(tree, join_path(tree->dirs[dir], name), size, dir, text ? PATH_TEXT : PATH_REGULAR);
+
+        if (write_file(entry->path, size, text, content) != 0)
+        {
+            fprintf(stderr, "heimdall-bench: cannot write %s: %s\n", entry->path, strerror(errno));
+            digest_release(content);
+            return -1;
+        }
+
+        if (text)
+            tree->text[tree->text_count++] = tree->path_count - 1;
+        tree->total_bytes += size;
+    }
+
+    tree->primary_count = tree->path_count;
+
+    for (size_t i = 0; i < hardlinks && tree->primary_count > 0; i++)
+    {
+        char                name[32];
+        size_t              dir = (size_t)rng_below(tree->dir_count);
+        const bench_path_t *target = &tree->paths[rng_below(tree->primary_count)];
+
+        snprintf(name, sizeof(name), "h%06zu", i);
+
+        bench_path_t *entry = add_path(tree, join_path(tree->dirs[dir], name), target->size, dir, PATH_HARDLINK);
+
+        if (link(target->path, entry->path) == -1)
+        {
+            fprintf(stderr, "heimdall-bench: cannot link %s: %s\n", entry->path, strerror(errno));
+            digest_release(content);
+            return -1;
+        }
+        tree->total_bytes += entry->size;
+    }
+
+    for (size_t i = 0; i < symlinks && tree->primary_count > 0; i++)
+    {
+        char                name[32];
+        size_t              dir = (size_t)rng_below(tree->dir_count);
+        const bench_path_t *target = &tree->paths[rng_below(tree->primary_count)];
+
+        snprintf(name, sizeof(name), "s%06zu", i);
+
+        bench_path_t *entry = add_path(tree, join_path(tree->dirs[dir], name), target->size, dir, PATH_SYMLINK);
+
+        if (symlink(target->path, entry->path) == -1)
+        {
+            fprintf(stderr, "heimdall-bench: cannot symlink %s: %s\n", entry->path, strerror(errno));
+            digest_release(content);
+            return -1;
+        }
+        tree->total_bytes += entry->size;
+    }
+
+    EVP_DigestFinal_ex(content, digest, NULL);
+    digest_release(content);
+    binary_to_hex(digest, SHA256_DIGEST_LENGTH, tree->content_hex);
+
+    make_entries(tree);
+
+    if (opts->evict)
+        sync();
+
+    tree->generate_seconds = seconds_of(governor_clock_ns() - start);
+
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+
+    if (remove(path) == -1 && errno != ENOENT)
+        fprintf(stderr, "heimdall-bench: cannot remove %s: %s\n", path, strerror(errno));
+
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Drops the page cache of every generated file; dirty pages were written back by the sync() after generation.
+static void evict_tree(const bench_tree_t *tree)
+{
+    for (size_t i = 0; i < tree->primary_count; i++)
+    {
+        int fd = open(tree->paths[i].path, O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Drops the baseline, Merkle store and line vectors, so every file is read and hashed.
+static void reset_state(const bench_tree_t *tree, bool evict)
+{
+    baseline_close();
+    merkle_close();
+    unlink(tree->baseline);
+    unlink(tree->merkle);
+    remove_tree(tree->lines);
+
+    baseline_open(tree->baseline);
+    merkle_open(tree->merkle);
+
+    if (evict)
+        evict_tree(tree);
+}
+
+static int tracepoint_id(const char *name)
+{
+    static const char *const roots[] = {"/sys/kernel/tracing/events", "/sys/kernel/debug/tracing/events"};
+
+    for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++)
+    {
+        char  path[PATH_MAX];
+        FILE *fp;
+        int   id;
+
+        snprintf(path, sizeof(path), "%s/%s/id", roots[i], name);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+
+        if (fscanf(fp, "%d", &id) != 1)
+            id = -1;
+        fclose(fp);
+
+        if (id >= 0)
+            return id;
+    }
+
+    return -1;
+}
+
+// Must run before the hashing workers start: an inherited counter only follows threads created after it.
+static void syscalls_open(void)
+{
+    struct perf_event_attr attr;
+    int                    id = tracepoint_id("raw_syscalls/sys_enter");
+
+    if (id >= 0)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = (uint64_t)id;
+        attr.inherit = 1;
+
+        syscall_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (syscall_fd != -1)
+        {
+            syscall_source = SYSCALLS_PERF;
+            return;
+        }
+    }
+
+    if (access("/proc/self/io", R_OK) == 0)
+        syscall_source = SYSCALLS_PROC_IO;
+}
+
+static bool syscalls_read(uint64_t *count)
+{
+    FILE              *fp;
+    char               line[128];
+    unsigned long long value;
+    uint64_t           total = 0;
+
+    switch (syscall_source)
+    {
+        case SYSCALLS_PERF:
+            return read(syscall_fd, count, sizeof(*count)) == (ssize_t)sizeof(*count);
+        case SYSCALLS_PROC_IO:
+            fp = fopen("/proc/self/io", "r");
+            if (!fp)
+                return false;
+            while (fgets(line, sizeof(line), fp))
+            {
+                if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1)
+                    total += value;
+            }
+            fclose(fp);
+            *count = total;
+            return true;
+        case SYSCALLS_NONE:
+        default:
+            return false;
+    }
+}
+
+static const char *syscalls_name(void)
+{
+    switch (syscall_source)
+    {
+        case SYSCALLS_PERF:
+            return "perf:raw_syscalls:sys_enter";
+        case SYSCALLS_PROC_IO:
+            return "proc:syscr+syscw";
+        case SYSCALLS_NONE:
+        default:
+            return "none";
+    }
+}
+
+// /proc/self/io only counts read and write calls, so its figures are not reported as system calls.
+static const char *syscalls_label(void)
+{
+    return syscall_source == SYSCALLS_PROC_IO ? "read_write_calls" : "syscalls";
+}
+
+// Writing 5 to clear_refs resets the high-water mark, so VmHWM afterwards is the peak of the phase alone.
+static void rss_reset_peak(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return;
+    if (write(fd, "5", 1) != 1)
+        fprintf(stderr, "heimdall-bench: cannot reset peak RSS: %s\n", strerror(errno));
+    close(fd);
+}
+
+static long rss_peak_kb(void)
+{
+    FILE         *fp = fopen("/proc/self/status", "r");
+    char          line[128];
+    long          kb = -1;
+    struct rusage usage;
+
+    if (fp)
+    {
+        while (fgets(line, sizeof(line), fp))
+        {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+        }
+        fclose(fp);
+    }
+
+    if (kb < 0 && getrusage(RUSAGE_SELF, &usage) == 0)
+        kb = usage.ru_maxrss;
+
+    return kb;
+}
+
+static size_t file_op_count(const bench_tree_t *tree)
+{
+    return tree->path_count;
+}
+
+static int file_op(const bench_tree_t *tree, size_t index, size_t *files)
+{
+    char hex[HASH_HEX_LEN + 1];
+
+    *files += 1;
+
+    return sha256_file(tree->paths[index].path, hex);
+}
+
+static size_t single_op_count(const bench_tree_t *tree)
+{
+    (void)tree;
+
+    return 1;
+}
+
+static int dir_op(const bench_tree_t *tree, size_t index, size_t *files)
+{
+    char hex[HASH_HEX_LEN + 1];
+
+    (void)index;
+    *files += tree->path_count;
+
+    return sha256_dir(tree->tree, hex);
+}
+
+static size_t lines_op_count(const bench_tree_t *tree)
+{
+    return tree->text_count;
+}
+
+static int lines_op(const bench_tree_t *tree, size_t index, size_t *files)
+{
+    const bench_path_t *entry = &tree->paths[tree->text[index]];
+
+    *files += 1;
+    hash_file_lines(entry->path);
+
+    return 0;
+}
+
+static int check_op(const bench_tree_t *tree, size_t index, size_t *files)
+{
+    (void)index;
+    *files += tree->path_count;
+    integrity_check_entries(tree->entries, NULL, tree->entry_count, false);
+
+    return 0;
+}
+
+static const bench_phase_t phases[] = {
+    {"sha256_file", file_op_count, file_op},
+    {"sha256_dir", single_op_count, dir_op},
+    {"hash_file_lines", lines_op_count, lines_op},
+    {"integrity_check", single_op_count, check_op},
+};
+
+#define PHASE_COUNT (sizeof(phases) / sizeof(phases[0]))
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_phase(const bench_phase_t *phase, cache_state_t cache, const bench_tree_t *tree,
+                      const bench_options_t *opts, phase_result_t *result)
+{
+    size_t   ops = phase->op_count(tree);
+    size_t   samples = ops * opts->iterations;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    bool     counted = true;
+
+    memset(result, 0, sizeof(*result));
+    result->name = phase->name;
+    result->cache = cache_names[cache];
+    result->passes = opts->iterations;
+    result->latency_ns = safe_malloc((samples ? samples : 1) * sizeof(uint64_t));
+
+    rss_reset_peak();
+
+    for (unsigned pass = 0; pass < opts->iterations; pass++)
+    {
+        if (cache != CACHE_BASELINE)
+            reset_state(tree, cache == CACHE_COLD && opts->evict);
+
+        counted = syscalls_read(&before) && counted;
+        result->shared -= metrics_total(METRIC_FILES_SHARED);
+        result->bytes -= metrics_total(METRIC_BYTES_READ);
+
+        for (size_t i = 0; i < ops; i++)
+        {
+            uint64_t start = governor_clock_ns();
+
+            if (phase->run_op(tree, i, &result->files) != 0)
+                result->failures++;
+
+            uint64_t elapsed = governor_clock_ns() - start;
+
+            result->latency_ns[result->latency_count++] = elapsed;
+            result->wall_ns += elapsed;
+        }
+
+        counted = syscalls_read(&after) && counted;
+        result->syscalls += after - before;
+        result->shared += metrics_total(METRIC_FILES_SHARED);
+        result->bytes += metrics_total(METRIC_BYTES_READ);
+    }
+
+    qsort(result->latency_ns, result->latency_count, sizeof(uint64_t), compare_u64);
+    result->ops = samples;
+    result->have_syscalls = counted;
+    result->peak_rss_kb = rss_peak_kb();
+}
+
+// Nearest-rank percentile of a sorted sample.
+static uint64_t percentile(const uint64_t *sorted, size_t count, unsigned pct)
+{
+    size_t rank = (count * pct + 99) / 100;
+
+    return count ? sorted[rank ? rank - 1 : 0] : 0;
+}
+
+static double per_second(double amount, uint64_t ns)
+{
+    return ns ? amount / seconds_of(ns) : 0.0;
+}
+
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void print_phase(FILE *out, const phase_result_t *result, bool last)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < result->latency_count; i++)
+        sum += result->latency_ns[i];
+
+    fprintf(out, "    {\"name\": \"%s\", \"cache\": \"%s\", \"passes\": %u, \"ops\": %zu, \"files\": %zu, ", result->name,
+            result->cache, result->passes, result->ops, result->files);
+    fprintf(out, "\"files_shared\": %" PRIu64 ", ", result->shared);
+    fprintf(out, "\"bytes_read\": %" PRIu64 ", \"failures\": %zu, \"seconds\": %.6f, ", result->bytes, result->failures,
+            seconds_of(result->wall_ns));
+    fprintf(out, "\"files_per_sec\": %.1f, \"read_mb_per_sec\": %.2f, ",
+            per_second((double)result->files, result->wall_ns), per_second((double)result->bytes / 1e6, result->wall_ns));
+
+    if (result->have_syscalls)
+        fprintf(out, "\"%s\": %" PRIu64 ", \"%s_per_file\": %.2f, ", syscalls_label(), result->syscalls,
+                syscalls_label(), result->files ? (double)result->syscalls / (double)result->files : 0.0);
+    else
+        fprintf(out, "\"syscalls\": null, \"syscalls_per_file\": null, ");
+
+    fprintf(out, "\"peak_rss_kb\": %ld, ", result->peak_rss_kb);
+    fprintf(out,
+            "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}%s\n",
+            result->latency_count ? (double)sum / (double)result->latency_count / 1e3 : 0.0,
+            (double)percentile(result->latency_ns, result->latency_count, 50) / 1e3,
+            (double)percentile(result->latency_ns, result->latency_count, 90) / 1e3,
+            (double)percentile(result->latency_ns, result->latency_count, 99) / 1e3,
+            (double)percentile(result->latency_ns, result->latency_count, 100) / 1e3, last ? "" : ",");
+}
+
+static void print_report(FILE *out, const bench_tree_t *tree, const bench_options_t *opts, const phase_result_t *results,
+                         size_t count)
+{
+    struct rusage usage;
+    bool          sanitized = false;
+
+#if defined(__SANITIZE_ADDRESS__)
+    sanitized = true;
+#endif
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\n  \"benchmark\": \"heimdall-bench\",\n  \"version\": \"%s\",\n  \"sanitized\": %s,\n", HEIMDALL_VERSION,
+            sanitized ? "true" : "false");
+    fprintf(out, "  \"config\": {\"threads\": %zu, \"digest_format\": %d, \"fast_prefilter\": %d, \"batch_files\": %d, ",
+            threadpool_size(), FIM_DIGEST_FORMAT, FIM_FAST_PREFILTER, HASH_BATCH_FILES);
+    fprintf(out, "\"batch_max_file_size\": %d, \"pread_block_size\": %d, \"mmap_min_size\": %d},\n",
+            HASH_BATCH_MAX_FILE_SIZE, IO_PREAD_BLOCK_SIZE, IO_MMAP_MIN_SIZE);
+
+    fprintf(out, "  \"tree\": {\"root\": ");
+    json_string(out, tree->tree);
+    fprintf(out, ", \"seed\": %" PRIu64 ", \"sizes\": ", opts->seed);
+    json_string(out, opts->sizes.spec);
+    fprintf(out, ", \"depth\": %u, \"fanout\": %u, \"directories\": %zu, ", opts->depth, opts->fanout, tree->dir_count);
+    fprintf(out, "\"files\": %zu, \"text_files\": %zu, \"hardlinks\": %zu, \"symlinks\": %zu, ", tree->primary_count,
+            tree->text_count, (size_t)(opts->files * opts->hardlink_pct / 100),
+            (size_t)(opts->files * opts->symlink_pct / 100));
+    fprintf(out, "\"bytes\": %" PRIu64 ", \"content_sha256\": \"%s\", \"generate_seconds\": %.3f},\n", tree->total_bytes,
+            tree->content_hex, tree->generate_seconds);
+
+    fprintf(out, "  \"syscall_source\": \"%s\",\n  \"evict\": %s,\n  \"phases\": [\n", syscalls_name(),
+            opts->evict ? "true" : "false");
+    for (size_t i = 0; i < count; i++)
+        print_phase(out, &results[i], i + 1 == count);
+    fprintf(out, "  ],\n  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+}
+
+static void print_summary(const phase_result_t *results, size_t count)
+{
+    fprintf(stderr, "%-16s %-10s %8s %12s %10s %8s %10s %10s %10s\n", "phase", "cache", "ops", "files/s", "read MB/s",
+            "shared", syscall_source == SYSCALLS_PROC_IO ? "rw/file" : "sys/file", "p50 us", "p99 us");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const phase_result_t *r = &results[i];
+
+        fprintf(stderr, "%-16s %-10s %8zu %12.1f %10.2f %8" PRIu64 " %10.2f %10.1f %10.1f\n", r->name, r->cache, r->ops,
+                per_second((double)r->files, r->wall_ns), per_second((double)r->bytes / 1e6, r->wall_ns), r->shared,
+                r->have_syscalls && r->files ? (double)r->syscalls / (double)r->files : 0.0,
+                (double)percentile(r->latency_ns, r->latency_count, 50) / 1e3,
+                (double)percentile(r->latency_ns, r->latency_count, 99) / 1e3);
+    }
+}
+
+static void free_tree(bench_tree_t *tree)
+{
+    for (size_t i = 0; i < tree->path_count; i++)
+        free(tree->paths[i].path);
+    for (size_t i = 0; i < tree->dir_count; i++)
+        free(tree->dirs[i]);
+
+    free(tree->paths);
+    free(tree->text);
+    free(tree->dirs);
+    free(tree->dir_level);
+    free(tree->entries);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: heimdall-bench [options]\n"
+            "  --files N        regular files to generate (1000)\n"
+            "  --depth N        directory levels below the root (3)\n"
+            "  --fanout N       subdirectories per directory (4)\n"
+            "  --sizes SPEC     mixed | fixed:S | uniform:MIN:MAX | log:MIN:MAX, K/M/G suffixes (mixed)\n"
+            "  --hardlinks PCT  extra hardlinks, as a percentage of --files (5)\n"
+            "  --symlinks PCT   extra symlinks to files, as a percentage of --files (5)\n"
+            "  --text PCT       share of files generated as text for hash_file_lines (10)\n"
+            "  --seed N         generator seed (1)\n"
+            "  --iterations N   passes per phase and cache state (3)\n"
+            "  --threads N      hashing threads, 0 = one per CPU (%d)\n"
+            "  --root DIR       directory to create the tree in (a new directory under /tmp)\n"
+            "  --json FILE      write the report to FILE instead of stdout\n"
+            "  --evict          drop generated files from the page cache before every cold pass\n"
+            "  --keep           leave the tree on disk\n",
+            FIM_HASH_THREADS);
+}
+
+static int parse_unsigned(const char *text, unsigned long long max, unsigned long long *out)
+{
+    char *end;
+
+    errno = 0;
+    *out = strtoull(text, &end, 10);
+
+    return errno == 0 && end != text && *end == '\0' && *out <= max ? 0 : -1;
+}
+
+static int parse_options(int argc, char **argv, bench_options_t *opts)
+{
+    static const struct option long_options[] = {
+        {"files", required_argument, NULL, 'n'},     {"depth", required_argument, NULL, 'd'},
+        {"fanout", required_argument, NULL, 'f'},    {"sizes", required_argument, NULL, 's'},
+        {"hardlinks", required_argument, NULL, 'H'}, {"symlinks", required_argument, NULL, 'L'},
+        {"text", required_argument, NULL, 't'},      {"seed", required_argument, NULL, 'S'},
+        {"iterations", required_argument, NULL, 'i'}, {"threads", required_argument, NULL, 'j'},
+        {"root", required_argument, NULL, 'r'},      {"json", required_argument, NULL, 'o'},
+        {"evict", no_argument, NULL, 'e'},           {"keep", no_argument, NULL, 'k'},
+        {"help", no_argument, NULL, 'h'},            {NULL, 0, NULL, 0},
+    };
+    unsigned long long value = 0;
+    int                index = 0;
+    int                c;
+
+    opts->files = 1000;
+    opts->depth = 3;
+    opts->fanout = 4;
+    opts->hardlink_pct = 5;
+    opts->symlink_pct = 5;
+    opts->text_pct = 10;
+    opts->seed = 1;
+    opts->iterations = 3;
+    opts->threads = FIM_HASH_THREADS;
+    opts->root = NULL;
+    opts->json_path = NULL;
+    opts->keep = false;
+    opts->evict = false;
+    parse_size_dist("mixed", &opts->sizes);
+
+    while ((c = getopt_long(argc, argv, "h", long_options, &index)) != -1)
+    {
+        int rc = 0;
+
+        switch (c)
+        {
+            case 'n':
+                rc = parse_unsigned(optarg, SIZE_MAX / 4, &value);
+                opts->files = (size_t)value;
+                break;
+            case 'd':
+                rc = parse_unsigned(optarg, 64, &value);
+                opts->depth = (unsigned)value;
+                break;
+            case 'f':
+                rc = parse_unsigned(optarg, 100, &value);
+                opts->fanout = (unsigned)value;
+                break;
+            case 's':
+                rc = parse_size_dist(optarg, &opts->sizes);
+                break;
+            case 'H':
+                rc = parse_unsigned(optarg, 100, &value);
+                opts->hardlink_pct = (unsigned)value;
+                break;
+            case 'L':
+                rc = parse_unsigned(optarg, 100, &value);
+                opts->symlink_pct = (unsigned)value;
+                break;
+            case 't':
+                rc = parse_unsigned(optarg, 100, &value);
+                opts->text_pct = (unsigned)value;
+                break;
+            case 'S':
+                rc = parse_unsigned(optarg, UINT64_MAX, &value);
+                opts->seed = (uint64_t)value;
+                break;
+            case 'i':
+                rc = parse_unsigned(optarg, 1000000, &value);
+                opts->iterations = (unsigned)value;
+                rc = rc == 0 && value > 0 ? 0 : -1;
+                break;
+            case 'j':
+                rc = parse_unsigned(optarg, 4096, &value);
+                opts->threads = (size_t)value;
+                break;
+            case 'r':
+                opts->root = optarg;
+                break;
+            case 'o':
+                opts->json_path = optarg;
+                break;
+            case 'e':
+                opts->evict = true;
+                break;
+            case 'k':
+                opts->keep = true;
+                break;
+            case 'h':
+            default:
+                usage();
+                return -1;
+        }
+
+        if (rc != 0)
+        {
+            fprintf(stderr, "heimdall-bench: invalid value for --%s: %s\n", long_options[index].name, optarg);
+            return -1;
+        }
+    }
+
+    if (optind != argc)
+    {
+        usage();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int make_root(bench_tree_t *tree, const bench_options_t *opts)
+{
+    if (opts->root)
+    {
+        if (strlen(opts->root) >= sizeof(tree->root))
+        {
+            fprintf(stderr, "heimdall-bench: root path too long: %s\n", opts->root);
+            return -1;
+        }
+
+        snprintf(tree->root, sizeof(tree->root), "%s", opts->root);
+        if (mkdir(tree->root, 0700) == -1)
+        {
+            fprintf(stderr, "heimdall-bench: cannot create %s: %s\n", tree->root, strerror(errno));
+            return -1;
+        }
+    }
+    else
+    {
+        snprintf(tree->root, sizeof(tree->root), "/tmp/heimdall-bench.XXXXXX");
+        if (!mkdtemp(tree->root))
+        {
+            fprintf(stderr, "heimdall-bench: cannot create a directory under /tmp: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    snprintf(tree->tree, sizeof(tree->tree), "%s/tree", tree->root);
+    snprintf(tree->baseline, sizeof(tree->baseline), "%s/state/baseline", tree->root);
+    snprintf(tree->merkle, sizeof(tree->merkle), "%s/state/merkle", tree->root);
+    snprintf(tree->lines, sizeof(tree->lines), "%s/state/lines", tree->root);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options_t opts;
+    bench_tree_t    tree;
+    phase_result_t  results[PHASE_COUNT * CACHE_STATE_COUNT];
+    size_t          result_count = 0;
+    FILE           *out = stdout;
+    int             status = EXIT_FAILURE;
+
+    if (parse_options(argc, argv, &opts) != 0)
+        return EXIT_FAILURE;
+
+    memset(&tree, 0, sizeof(tree));
+
+    // Heimdall logs a line per hashed file; only warnings and errors reach syslog while benchmarking.
+    openlog("heimdall-bench", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    if (make_root(&tree, &opts) != 0)
+        return EXIT_FAILURE;
+
+    fprintf(stderr, "heimdall-bench: generating %zu files under %s\n", opts.files, tree.tree);
+    if (generate_tree(&tree, &opts) != 0)
+        goto out;
+
+    line_store_open(tree.lines);
+    syscalls_open();
+    threadpool_init(opts.threads);
+
+    for (size_t i = 0; i < PHASE_COUNT; i++)
+    {
+        for (cache_state_t cache = CACHE_COLD; cache < CACHE_STATE_COUNT; cache++)
+            run_phase(&phases[i], cache, &tree, &opts, &results[result_count++]);
+    }
+
+    if (opts.json_path && !(out = fopen(opts.json_path, "w")))
+    {
+        fprintf(stderr, "heimdall-bench: cannot write %s: %s\n", opts.json_path, strerror(errno));
+        out = stdout;
+    }
+
+    print_report(out, &tree, &opts, results, result_count);
+    print_summary(results, result_count);
+    status = EXIT_SUCCESS;
+
+    if (out != stdout)
+        fclose(out);
+    for (size_t i = 0; i < result_count; i++)
+        free(results[i].latency_ns);
+
+out:
+    threadpool_shutdown();
+    baseline_close();
+    merkle_close();
+    digest_shutdown();
+    if (syscall_fd != -1)
+        close(syscall_fd);
+
+    if (!opts.keep)
+        remove_tree(tree.root);
+    else
+        fprintf(stderr, "heimdall-bench: kept %s\n", tree.root);
+
+    free_tree(&tree);
+    closelog();
+
+    return status;
+}
@@ -0,0 +1,19 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block_t;
+
+typedef struct
+{
+    arena_block_t *head;
+} arena_t;
+
+void  arena_init(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *s, size_t len);
+char *arena_join(arena_t *arena, const char *dir_path, const char *name);
+void  arena_free(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,34 @@
+#ifndef BASELINE_H
+#define BASELINE_H
+
+#include "hashing.h"
+#include <stdbool.h>
+#include <sys/stat.h>
+
+typedef enum
+{
+    BASELINE_MISS,  // No usable record for the path
+    BASELINE_STALE, // Stat tuple changed or a full re-hash is due; the stored digests are returned for comparison
+    BASELINE_MATCH  // Stat tuple unchanged; the stored content digest is current
+} baseline_match_t;
+
+int  baseline_open(const char *path);
+int  baseline_sync(void);
+void baseline_close(void);
+void baseline_begin_cycle(void);
+void baseline_end_sweep(void);
+bool baseline_full_rehash(void);
+bool baseline_audit_cycle(void);
+
+baseline_match_t baseline_lookup(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH],
+                                 unsigned char fast[FAST_DIGEST_LENGTH]);
+void             baseline_update(const char *path, const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH],
+                                 const unsigned char fast[FAST_DIGEST_LENGTH]);
+baseline_match_t baseline_lookup_tree(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH]);
+void             baseline_update_tree(const char *path, const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH]);
+baseline_match_t baseline_lookup_append(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH],
+                                        append_point_t *point);
+void             baseline_update_append(const char *path, const struct stat *st,
+                                        const unsigned char sha256[SHA256_DIGEST_LENGTH], const append_point_t *point);
+
+#endif // BASELINE_H
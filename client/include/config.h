@@ -6,14 +6,75 @@
 #define LOG_IDENT "Heimdall"
 #define LOG_FACILITY LOG_DAEMON
 #define LOG_FILE "/var/log/heimdall.log"
+#define LOG_RING_RECORDS 4096 // power of two; records beyond it are dropped and counted
+#define LOG_RECORD_MAX 1024
+#define LOG_RING_FULL_RETRIES 64 // yields a warning or error waits for room before it is dropped
 
 #define HEIMDALL_PIDFILE "/var/run/heimdall.pid"
 #define HEIMDALL_WORKDIR "/"
 #define HEIMDALL_UMASK 0
 
-#define FIM_INTERVAL_SEC 120
+#define FIM_INTERVAL_SEC 120 // baseline cycle length; full re-hashes and audits are counted in cycles
+#define FIM_RED_INTERVAL_SEC 10
+#define FIM_YELLOW_INTERVAL_SEC 120
+#define FIM_GREEN_INTERVAL_SEC 3600
+#define FIM_WATCH_MODE 1
+#define FIM_WATCH_SWEEP_FACTOR 15 // watch mode stretches scheduled checks and cycles by this factor
+#define FIM_WATCH_DEBOUNCE_MS 50
+#define FIM_FULL_REHASH_CYCLES 30
+#define FIM_HASH_THREADS 0 // 0 = one worker per online CPU
+#define FIM_DIGEST_FORMAT 1  // 1 = SHA-256(path, metadata, content); 2 = SHA-256(path, metadata, SHA-256(content))
+#define FIM_FAST_PREFILTER 0 // 1 = confirm changes with XXH3-128 before paying for SHA-256; needs digest format 2
+#define FIM_PREFILTER_AUDIT_CYCLES 120
+#define FIM_TREE_HASH_MIN_SIZE (1024LL * 1024 * 1024) // entries flagged 't' tree-hash files of at least this size
+#define FIM_TREE_HASH_CHUNK_SIZE (16 * 1024 * 1024)
+#define FIM_APPEND_MIN_SIZE (1024 * 1024) // entries flagged 'a' resume hashing of grown files of at least this size
+#define FIM_APPEND_BLOCK_SIZE 4096       // resume points sit at multiples of this and fingerprint the block before
+
+#define BASELINE_PATH "/var/lib/heimdall/baseline"
+#define MERKLE_PATH "/var/lib/heimdall/merkle"
+#define LINE_STORE_DIR "/var/lib/heimdall/lines"
+
+#define LINE_DIFF_MAX_EDITS 1024
+
+#define IO_FORCE_BACKEND IO_BACKEND_AUTO
+#define IO_PREAD_BLOCK_SIZE (1024 * 1024)
+#define IO_MMAP_MIN_SIZE (1024 * 1024)
+#define IO_DIRECT_MIN_SIZE (256LL * 1024 * 1024)
+#define IO_DIRECT_ALIGN 4096
+#define IO_URING 1              // 1 = stat and read small-file batches through io_uring where the kernel has it
+#define IO_URING_ENTRIES 256    // submission queue depth of each hashing thread's ring
+#define IO_BATCH_SLOT_SIZE (HASH_BATCH_MAX_FILE_SIZE + 4096) // per-file read buffer; fuller files are read again
+#define IO_CACHE_NEUTRAL 0 // 1 = drop the pages our reads bring into the page cache, leaving already cached ones
+#define IO_CACHE_NEUTRAL_DIRECT_MIN_SIZE (16 * 1024 * 1024) // cache-neutral mode reads uncached files this big with O_DIRECT
+#define DEVICE_SCHEDULING 1             // 1 = limit concurrent reads per block device, by its type and queue depth
+#define DEVICE_ROTATIONAL_STREAMS 1     // read tasks running at once on a spinning disk
+#define DEVICE_VIRTUAL_MIN_REQUESTS 128 // a virtio or dm disk this deep is not taken for spinning, whatever it reports
+
+#define SHA256_BATCH_FORCE SHA256_BATCH_AUTO
+#define HASH_BATCH_FILES 64
+#define HASH_BATCH_MAX_FILE_SIZE (16 * 1024)
+#define HASH_STREAM_PARTITION 1024 // entries of a multiset directory hashed per partition task
+#define HASH_DIR_FD_BUDGET 256     // directories held open at once; past it, entries are opened by path
+#define INODE_MEMO_CONTENT_MAX (1024 * 1024)           // digest format 1 shares contents up to this size per inode
+#define INODE_MEMO_CONTENT_BUDGET (64LL * 1024 * 1024) // content copies held at once during a check
+
+// Budgets for low-impact scanning; 0 leaves a budget unlimited. The byte rate backs off while reads are slower than
+// the target latency per MiB, and a check past its CPU cap halves the workers' duty cycle.
+#define GOVERNOR_BYTES_PER_SEC 0
+#define GOVERNOR_FILES_PER_SEC 0
+#define GOVERNOR_TARGET_LATENCY_MS 20
+#define GOVERNOR_CPU_MS_PER_CHECK 0
+#define GOVERNOR_IDLE_PRIORITY 0 // 1 = hashing workers run under SCHED_IDLE with idle I/O priority
+
+// Prometheus exposition: written after every check to the textfile (for node_exporter's textfile collector) and
+// served on the Unix socket; "" turns either off. Files slower than METRICS_SLOW_FILE_MS are logged, 0 = never.
+#define METRICS_TEXTFILE_PATH ""
+#define METRICS_SOCKET_PATH "/run/heimdall/metrics.sock"
+#define METRICS_SLOW_FILE_MS 1000
 
 #define CONFIG_PATH "/etc/heimdall.conf"
+#define EXCLUDE_MAX_DFA_STATES 4096
 
 #define HASH_HEX_LEN (SHA256_DIGEST_LENGTH * 2)
 
@@ -0,0 +1,14 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include "threadpool.h"
+#include <sys/types.h>
+
+// Content reads are admitted per block device. A rotational disk runs DEVICE_ROTATIONAL_STREAMS read tasks at a time,
+// started in inode order so the head sweeps across the disk instead of seeking between files; other disks run up to
+// their queue depth, as do virtio and device-mapper disks with a deep queue, which claim to be rotational whatever backs
+// them. Filesystems without a block device behind them (tmpfs, network and FUSE mounts) are not limited.
+// Held tasks wait in their device's queue rather than in a worker, so a busy disk never stalls reads from another.
+void device_submit(dev_t dev, ino_t ino, task_fn_t fn, void *arg);
+
+#endif // DEVICE_H
@@ -0,0 +1,31 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 chaining value after a whole number of blocks, enough to continue hashing from that offset.
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length; // bytes absorbed, a multiple of SHA256_CBLOCK
+} sha256_midstate_t;
+
+typedef struct sha256_stream sha256_stream_t;
+
+const EVP_MD *digest_sha256(void);
+EVP_MD_CTX   *digest_acquire(void);
+void          digest_release(EVP_MD_CTX *ctx);
+int           digest_sha256_buffer(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH]);
+int           digest_shake128_buffer(const void *data, size_t len, unsigned char *out, size_t out_len);
+void          digest_shutdown(void);
+
+sha256_stream_t *sha256_stream_new(const sha256_midstate_t *resume);
+void             sha256_stream_update(sha256_stream_t *stream, const void *data, size_t len);
+bool             sha256_stream_midstate(const sha256_stream_t *stream, sha256_midstate_t *out);
+void             sha256_stream_final(sha256_stream_t *stream, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+#endif // DIGEST_H
@@ -0,0 +1,38 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include "arena.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    const char   *name;
+    unsigned char type; // DT_* from the directory entry; DT_UNKNOWN and DT_LNK need an fstatat to classify
+} dir_entry_t;
+
+// Entries sorted by name; every name lives in the listing's arena.
+typedef struct
+{
+    arena_t      arena;
+    dir_entry_t *entries;
+    size_t       count;
+    size_t       capacity;
+} dir_listing_t;
+
+// Successive unsorted slices of a directory in readdir order, for directories too large to list whole.
+typedef struct
+{
+    int   fd;
+    void *handle; // DIR * where getdents64 is unavailable
+    bool  done;
+} dir_stream_t;
+
+int  dir_open_at(int dir_fd, const char *name);
+int  dir_list(int dir_fd, dir_listing_t *listing);
+void dir_listing_free(dir_listing_t *listing);
+int  dir_stream_open(dir_stream_t *stream, int dir_fd);
+int  dir_stream_next(dir_stream_t *stream, dir_listing_t *listing, size_t limit);
+void dir_stream_close(dir_stream_t *stream);
+
+#endif // DIRSCAN_H
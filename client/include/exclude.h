@@ -0,0 +1,13 @@
+#ifndef EXCLUDE_H
+#define EXCLUDE_H
+
+#include <stdbool.h>
+
+// fnmatch(3) patterns with flags 0, so '*' and '?' also match '/'.
+void exclude_clear(void);
+void exclude_add(const char *pattern);
+void exclude_compile(void);
+bool path_excluded(const char *path);
+bool subtree_excluded(const char *dir_path);
+
+#endif // EXCLUDE_H
@@ -0,0 +1,17 @@
+#ifndef FASTHASH_H
+#define FASTHASH_H
+
+#include <stddef.h>
+
+#define FAST_DIGEST_LENGTH 16
+#define FAST_HEX_LEN       (FAST_DIGEST_LENGTH * 2)
+
+typedef struct fasthash fasthash_t;
+
+fasthash_t *fasthash_new(void);
+void        fasthash_update(fasthash_t *hash, const void *data, size_t len);
+void        fasthash_final(fasthash_t *hash, unsigned char digest[FAST_DIGEST_LENGTH]);
+void        fasthash_free(fasthash_t *hash);
+void        fasthash_buffer(const void *data, size_t len, unsigned char digest[FAST_DIGEST_LENGTH]);
+
+#endif // FASTHASH_H
@@ -0,0 +1,15 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Budgets for low-impact scanning; all of them are off unless configured in config.h.
+uint64_t governor_clock_ns(void);
+void     governor_enter_worker(void);
+void     governor_begin_check(void);
+void     governor_end_check(void);
+void     governor_admit_file(void);
+void     governor_account_read(size_t bytes, uint64_t service_ns);
+
+#endif // GOVERNOR_H
@@ -2,6 +2,8 @@
 #define HASHING_H
 
 #include "config.h"
+#include "digest.h"
+#include "fasthash.h"
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <stdbool.h>
@@ -17,20 +19,40 @@ typedef enum
     HASH_LINE_LVL  // Per-line hashing
 } hash_level_t;
 
+typedef struct config_entry config_entry_t;
+
+// Where hashing a file that only grows can pick up again: the SHA-256 midstate at a FIM_APPEND_BLOCK_SIZE boundary and
+// the XXH3-128 of the block just before it, which must still read the same for the midstate to be trusted.
+typedef struct
+{
+    sha256_midstate_t midstate;
+    unsigned char     fingerprint[FAST_DIGEST_LENGTH];
+} append_point_t;
+
 typedef struct
 {
-    char  *path;
-    off_t  size;
-    time_t mtime;
-    char   sha256[65];
+    const char    *path;
+    dev_t          dev;
+    ino_t          ino;
+    off_t          size;
+    time_t         mtime;
+    long           mtime_nsec;
+    time_t         ctime;
+    long           ctime_nsec;
+    unsigned char  sha256[SHA256_DIGEST_LENGTH]; // the digest recorded for the file, of the kind the flags below say
+    unsigned char  xxh128[FAST_DIGEST_LENGTH];   // XXH3-128 of the content, valid when has_fast
+    bool           has_fast;
+    bool           tree;       // sha256 is the chunk-tree digest of a large file
+    bool           content;    // sha256 is the content digest alone; otherwise a format-1 file digest or a tree digest
+    bool           has_append; // append holds a resume point for sha256
+    append_point_t append;
 } entry_t;
 
-void        integrity_check(void);
+void        integrity_check_entries(const config_entry_t *entries, const bool selected[], size_t count, bool trust_cache);
 int         sha256_file(const char *path, char out_hex[HASH_HEX_LEN + 1]);
 int         sha256_dir(const char *dir_path, char out_hex[HASH_HEX_LEN + 1]);
 void        hash_file_lines(const char *path);
-int         binary_to_hex(const unsigned char *digest, unsigned int len, char out_hex[HASH_HEX_LEN + 1]);
-bool        is_excluded(const char *path, const char *patterns[], size_t pattern_count);
-EVP_MD_CTX *init_evp_context(const EVP_MD *type);
+int         binary_to_hex(const unsigned char *digest, unsigned int len, char *out_hex);
+int         hex_to_binary(const char *hex, unsigned char *digest, unsigned int len);
 
 #endif // HASHING_H
@@ -0,0 +1,24 @@
+#ifndef INODEMEMO_H
+#define INODEMEMO_H
+
+#include "fasthash.h"
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Content digests of the inodes read during one integrity check, keyed by dev/inode/size/mtime/ctime, so a file
+// reached through several paths or entries is only read once. Lookups and stores outside a check do nothing.
+void inode_memo_begin(void);
+void inode_memo_end(void);
+bool inode_memo_lookup(const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH], unsigned char fast[FAST_DIGEST_LENGTH]);
+bool inode_memo_acquire(const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH], unsigned char fast[FAST_DIGEST_LENGTH]);
+void inode_memo_store(const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH], const unsigned char fast[FAST_DIGEST_LENGTH]);
+void inode_memo_release(const struct stat *st);
+
+// Digest format 1 shares small contents themselves instead; see inodememo.c.
+bool inode_memo_lookup_content(const struct stat *st, unsigned char **data, size_t *len);
+bool inode_memo_acquire_content(const struct stat *st, unsigned char **data, size_t *len);
+void inode_memo_store_content(const struct stat *st, const unsigned char *data, size_t len);
+
+#endif // INODEMEMO_H
@@ -0,0 +1,41 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef enum
+{
+    IO_BACKEND_AUTO,  // Pick per file by size
+    IO_BACKEND_STDIO, // fread into a stack buffer
+    IO_BACKEND_PREAD, // Large pread blocks into a per-thread buffer
+    IO_BACKEND_MMAP,  // Read-only mapping with MADV_SEQUENTIAL
+    IO_BACKEND_DIRECT // O_DIRECT into an aligned per-thread buffer
+} io_backend_t;
+
+typedef void (*io_consume_fn)(const unsigned char *buf, size_t len, void *arg);
+
+// One small file of a batch. Its content stays valid until the calling thread reads its next batch.
+typedef struct
+{
+    const char          *name; // relative to the batch's directory
+    const char          *path; // for messages
+    const struct stat   *st;
+    const unsigned char *data;
+    size_t               len;
+    bool                 ok;
+} io_batch_file_t;
+
+io_backend_t io_select_backend(const struct stat *st);
+const char  *io_backend_name(io_backend_t backend);
+int          io_read_file(const char *path, const struct stat *st, io_consume_fn consume, void *arg);
+int          io_read_file_at(int dir_fd, const char *name, const char *path, const struct stat *st, io_consume_fn consume,
+                             void *arg);
+int          io_open_file_at(int dir_fd, const char *name);
+int          io_read_range(int fd, off_t offset, size_t length, io_consume_fn consume, void *arg);
+void         io_stat_batch_at(int dir_fd, const char *const names[], size_t count, struct stat st[], int errors[]);
+void         io_read_batch_at(int dir_fd, io_batch_file_t files[], size_t count);
+
+#endif // IO_BACKEND_H
@@ -0,0 +1,26 @@
+#ifndef LINEDIFF_H
+#define LINEDIFF_H
+
+#include "hashing.h"
+#include "io_backend.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+    unsigned char (*digests)[SHA256_DIGEST_LENGTH];
+    size_t        count;
+    size_t        capacity;
+    struct stat   st; // stat tuple the vector was built from
+} line_vector_t;
+
+int  line_store_open(const char *dir);
+int  line_vector_build(const char *path, const struct stat *st, line_vector_t *out, io_consume_fn tee, void *tee_arg);
+int  line_vector_load(const char *path, line_vector_t *out);
+int  line_vector_save(const char *path, const line_vector_t *lines);
+void line_vector_free(line_vector_t *lines);
+bool line_vector_equal(const line_vector_t *a, const line_vector_t *b);
+void line_diff_report(const char *path, const line_vector_t *old, const line_vector_t *cur);
+
+#endif // LINEDIFF_H
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <syslog.h>
 
@@ -11,5 +12,6 @@
 void log_init(const char *ident, int option, int facility);
 void log_message(int priority, const char *fmt, ...);
 void log_close(void);
+uint64_t log_dropped_count(void);
 
 #endif // LOGGING_H
@@ -0,0 +1,22 @@
+#ifndef LTHASH_H
+#define LTHASH_H
+
+#include <openssl/sha.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LTHASH_LANES 1024 // 16-bit lanes, 2 KiB of state
+
+// LtHash16 multiset digest: each element is expanded to LTHASH_LANES lanes that are added modulo 2^16, so elements
+// fold in any order and sums over disjoint partitions merge by adding them.
+typedef struct
+{
+    uint16_t lanes[LTHASH_LANES];
+} lthash_t;
+
+void lthash_init(lthash_t *hash);
+int  lthash_add(lthash_t *hash, const void *element, size_t len);
+void lthash_merge(lthash_t *into, const lthash_t *from);
+int  lthash_digest(const lthash_t *hash, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+#endif // LTHASH_H
@@ -0,0 +1,24 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "hashing.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    const char   *name;
+    bool          is_dir;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+} merkle_child_t;
+
+int  merkle_open(const char *path);
+int  merkle_sync(void);
+void merkle_close(void);
+bool merkle_lookup(const char *dir_path, unsigned char digest[SHA256_DIGEST_LENGTH]);
+void merkle_update(const char *dir_path, const merkle_child_t *children, size_t count, const unsigned char digest[SHA256_DIGEST_LENGTH]);
+void merkle_update_multiset(const char *dir_path, const unsigned char digest[SHA256_DIGEST_LENGTH]);
+void merkle_invalidate(const char *path);
+void merkle_invalidate_all(void);
+
+#endif // MERKLE_H
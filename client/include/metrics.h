@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum
+{
+    METRIC_FILES_VISITED,
+    METRIC_FILES_UNCHANGED, // digest reused from the baseline without a read
+    METRIC_FILES_SHARED,    // digest, or in digest format 1 content, taken from another path to the same inode
+    METRIC_FILES_EXCLUDED,
+    METRIC_FILE_ERRORS,
+    METRIC_SLOW_FILES,
+    METRIC_BYTES_READ,
+    METRIC_STAT_CALLS,
+    METRIC_OPEN_CALLS,
+    METRIC_READ_CALLS,
+    METRIC_GETDENTS_CALLS,
+    METRIC_MMAP_CALLS,
+    METRIC_URING_ENTER_CALLS,
+    METRIC_URING_OPS,            // stat, open, read, fadvise and close operations completed through io_uring
+    METRIC_CACHE_FILLED_BYTES,   // brought into the page cache by our reads; counted in cache-neutral mode
+    METRIC_CACHE_RELEASED_BYTES, // of those, handed back with POSIX_FADV_DONTNEED
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum
+{
+    METRIC_FILE_HASH_LATENCY, // open to digest, for files whose content was read
+    METRIC_QUEUE_WAIT,        // submit to start of every pool task
+    METRIC_ENTRY_DURATION,    // one config entry within a check
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+// Counters and histograms are charged to the scope of the config entry the calling thread works for; pool tasks run
+// in the scope they were submitted from. Work outside any entry lands in an unlabelled scope.
+typedef struct metrics_scope metrics_scope_t;
+
+int              metrics_init(void);
+void             metrics_close(void);
+metrics_scope_t *metrics_scope_for(const char *entry_path);
+metrics_scope_t *metrics_current(void);
+metrics_scope_t *metrics_enter(metrics_scope_t *scope);
+void             metrics_leave(metrics_scope_t *previous);
+void             metrics_count(metric_counter_t counter, uint64_t amount);
+void             metrics_record(metric_histogram_t histogram, uint64_t ns);
+void             metrics_file_hashed(const char *path, uint64_t bytes, uint64_t ns);
+void             metrics_begin_check(void);
+void             metrics_end_check(void);
+uint64_t         metrics_total(metric_counter_t counter);
+void             metrics_render(FILE *out);
+
+#endif // METRICS_H
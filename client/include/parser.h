@@ -3,16 +3,35 @@
 
 #include "alert.h"
 #include "hashing.h"
-#include <limits.h>
+#include "pathmap.h"
+#include <stdbool.h>
 #include <stddef.h>
 
-typedef struct
+typedef struct config_entry
 {
-    char          path[PATH_MAX];
+    const char   *path; // interned in the plan's path index
     hash_level_t  hash_level;
     alert_level_t alert_level;
+    bool          lines;    // per-line digests are kept too, built from the same read as the file digest
+    unsigned int  interval; // seconds between scheduled checks, 0 for the alert level's default
+    bool          tree;     // files of at least FIM_TREE_HASH_MIN_SIZE are hashed as a parallel chunk tree
+    bool          multiset; // directories are digested as an LtHash of their entries, streamed in readdir order
+    bool          append;   // files of at least FIM_APPEND_MIN_SIZE that only grew hash just their new bytes
 } config_entry_t;
 
-config_entry_t *parse_config(size_t *count_out);
+typedef struct
+{
+    config_entry_t *entries;
+    size_t          count;
+    size_t          capacity;
+    size_t          merged; // config lines folded into an existing entry
+    pathmap_t      *files;
+    pathmap_t      *dirs;
+} config_plan_t;
+
+const config_plan_t *config_plan(void);
+bool                 config_refresh(void);
+void                 config_request_reload(void);
+void                 config_release(void);
 
 #endif // PARSER_H
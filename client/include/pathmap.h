@@ -0,0 +1,19 @@
+#ifndef PATHMAP_H
+#define PATHMAP_H
+
+#include <stddef.h>
+
+typedef struct pathmap pathmap_t;
+
+typedef void (*pathmap_visit_fn)(const char *key, void *value, void *arg);
+typedef void (*pathmap_free_fn)(void *value);
+
+pathmap_t  *pathmap_new(void);
+void        pathmap_free(pathmap_t *map, pathmap_free_fn free_value);
+void       *pathmap_find(const pathmap_t *map, const char *key);
+const char *pathmap_put(pathmap_t *map, const char *key, void *value);
+void       *pathmap_remove(pathmap_t *map, const char *key);
+size_t      pathmap_size(const pathmap_t *map);
+void        pathmap_foreach(const pathmap_t *map, pathmap_visit_fn visit, void *arg);
+
+#endif // PATHMAP_H
@@ -0,0 +1,15 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "parser.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Entry periods are multiplied by scale, so watch mode can keep its scheduled checks as a slower safety net.
+void   scheduler_reset(const config_entry_t *entries, size_t count, unsigned int scale);
+size_t scheduler_collect(bool due[], size_t count, bool *cycle_due);
+void   scheduler_rearm_all(bool due[], size_t count);
+int    scheduler_timeout_ms(void);
+void   scheduler_close(void);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,20 @@
+#ifndef SHA256_BATCH_H
+#define SHA256_BATCH_H
+
+#include <openssl/sha.h>
+#include <stddef.h>
+
+typedef enum
+{
+    SHA256_BATCH_AUTO,   // Pick the fastest implementation the CPU supports
+    SHA256_BATCH_EVP,    // One cached EVP context per buffer (uses SHA-NI when OpenSSL finds it)
+    SHA256_BATCH_AVX2,   // 8 buffers per pass in 256-bit lanes
+    SHA256_BATCH_AVX512  // 16 buffers per pass in 512-bit lanes
+} sha256_batch_impl_t;
+
+sha256_batch_impl_t sha256_batch_impl(void);
+const char         *sha256_batch_impl_name(sha256_batch_impl_t impl);
+void                sha256_batch(const unsigned char *const data[], const size_t len[], size_t count,
+                                 unsigned char digests[][SHA256_DIGEST_LENGTH]);
+
+#endif // SHA256_BATCH_H
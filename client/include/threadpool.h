@@ -0,0 +1,30 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*task_fn_t)(void *arg);
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    size_t          pending;
+} task_group_t;
+
+int    threadpool_init(size_t thread_count);
+void   threadpool_shutdown(void);
+void   threadpool_submit(task_fn_t fn, void *arg);
+bool   threadpool_is_worker(void);
+size_t threadpool_size(void);
+
+void task_group_init(task_group_t *group);
+void task_group_destroy(task_group_t *group);
+void task_group_add(task_group_t *group, size_t count);
+void task_group_done(task_group_t *group);
+void task_group_wait(task_group_t *group);
+void task_group_throttle(task_group_t *group, size_t limit);
+
+#endif // THREADPOOL_H
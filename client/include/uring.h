@@ -0,0 +1,28 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct statx;
+
+// A minimal io_uring driven through the raw system calls: operations are queued, then uring_run() submits them all and
+// waits for every completion in one io_uring_enter. A ring belongs to one thread.
+typedef struct uring uring_t;
+
+typedef void (*uring_complete_fn)(uint64_t user_data, int result, void *arg);
+
+#define URING_READ_NOWAIT 0x1 // stop short, or fail with -EAGAIN, at the first page not in the page cache
+#define URING_READ_DROP 0x2   // then drop the file's pages from the page cache, from the one holding offset onward
+#define URING_READ_CLOSE 0x4  // then close the fd
+
+uring_t *uring_create(unsigned entries, void *buffer, size_t buffer_size);
+void     uring_destroy(uring_t *ring);
+void     uring_prep_openat(uring_t *ring, int dir_fd, const char *name, int flags, uint64_t user_data);
+void     uring_prep_statx(uring_t *ring, int dir_fd, const char *name, struct statx *out, uint64_t user_data);
+void     uring_prep_read(uring_t *ring, int fd, void *buf, unsigned len, uint64_t offset, unsigned flags,
+                         uint64_t user_data);
+void     uring_prep_close(uring_t *ring, int fd);
+int      uring_run(uring_t *ring, uring_complete_fn complete, void *arg);
+
+#endif // URING_H
@@ -7,11 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 
-DIR   *open_directory(const char *directory_path);
 FILE  *open_file(const char *filename);
 void  *safe_malloc(size_t size);
 void  *safe_realloc(void *ptr, size_t new_size);
 char  *safe_strdup(const char *s);
-char **get_all_entries(const char *dir_path, size_t *entry_count);
+FILE  *open_atomic(const char *path, char *tmp_path, size_t tmp_size);
+int    commit_atomic(FILE *fp, const char *tmp_path, const char *path);
 
 #endif // FILE_UTILS_H
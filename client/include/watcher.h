@@ -0,0 +1,13 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "parser.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+int    watcher_init(const config_entry_t *entries, size_t count);
+int    watcher_fd(void);
+size_t watcher_drain(bool dirty[], size_t count);
+void   watcher_close(void);
+
+#endif // WATCHER_H
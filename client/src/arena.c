@@ -0,0 +1,85 @@
+#include "arena.h"
+#include "utils.h"
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 8192
+
+// Allocations are carved from the newest block; blocks are only released all at once by arena_free().
+struct arena_block
+{
+    arena_block_t *next;
+    size_t         used;
+    size_t         size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+void arena_init(arena_t *arena)
+{
+    arena->head = NULL;
+}
+
+static void *bump(arena_t *arena, size_t size, size_t align)
+{
+    arena_block_t *block = arena->head;
+    size_t         offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+
+    if (!block || offset > block->size || block->size - offset < size)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+        block = safe_malloc(sizeof(arena_block_t) + capacity);
+        block->next = arena->head;
+        block->size = capacity;
+        arena->head = block;
+        offset = 0;
+    }
+
+    block->used = offset + size;
+
+    return block->data + offset;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    return bump(arena, size, alignof(max_align_t));
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t len)
+{
+    char *copy = bump(arena, len + 1, 1);
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+// Builds "dir_path/name" the same way the recursive scan always has, including doubled slashes after a trailing one.
+char *arena_join(arena_t *arena, const char *dir_path, const char *name)
+{
+    size_t dir_len = strlen(dir_path);
+    size_t name_len = strlen(name);
+    char  *path = bump(arena, dir_len + name_len + 2, 1);
+
+    memcpy(path, dir_path, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+
+    return path;
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_block_t *block = arena->head;
+
+    while (block)
+    {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head = NULL;
+}
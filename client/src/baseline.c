@@ -0,0 +1,987 @@
+#include "baseline.h"
+#include "config.h"
+#include "logging.h"
+#include "pathmap.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BASELINE_MAGIC      "heimdall-baseline 6"
+#define BASELINE_V5_MAGIC   "heimdall-baseline 5" // same layout, without RECORD_CONTENT
+#define BASELINE_V4_MAGIC   "heimdall-baseline 4" // same layout, without digest_format; its digests are format 2
+#define BASELINE_TEXT_MAGIC "heimdall-baseline 2" // format-2 digests
+#define BASELINE_BYTE_ORDER 0x01020304u
+#define BASELINE_RESTART    16 // paths per front-coding run; a lookup decodes at most this many
+
+#define RECORD_FAST    0x1u
+#define RECORD_TREE    0x2u
+#define RECORD_APPEND  0x4u
+#define RECORD_CONTENT 0x8u // sha256 is the content digest alone, not a format-1 file digest
+
+// The store is mapped read-only and used in place. Records are sorted by path hash, and a table indexed by the top
+// bucket_bits of the hash gives each bucket's first record, so a lookup touches one bucket of about two records. Paths
+// live in a pool sorted by name, each one stored as the length it shares with its predecessor plus the remaining bytes;
+// every BASELINE_RESTART-th path is stored whole and its offset kept in the restart table. Resume points of files
+// hashed in append mode sit in their own section so the records of everything else stay small.
+typedef struct
+{
+    char     magic[24];
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint32_t bucket_bits;
+    uint32_t restart_interval;
+    uint64_t record_count;
+    uint64_t table_offset;    // uint32_t[(1 << bucket_bits) + 1]
+    uint64_t records_offset;  // baseline_record_t[record_count]
+    uint64_t appends_offset;  // baseline_append_t[append_count]
+    uint64_t append_count;
+    uint64_t restarts_offset; // uint32_t[ceil(record_count / restart_interval)]
+    uint64_t pool_offset;
+    uint64_t pool_size;
+    uint32_t digest_format; // FIM_DIGEST_FORMAT of the digests in plain records
+    uint32_t reserved;
+} baseline_header_t;
+
+typedef struct
+{
+    uint64_t      path_hash;
+    uint64_t      dev;
+    uint64_t      ino;
+    int64_t       size;
+    int64_t       mtime;
+    int64_t       ctime;
+    uint32_t      mtime_nsec;
+    uint32_t      ctime_nsec;
+    uint32_t      path_index; // position in the name-sorted pool
+    uint32_t      flags;
+    uint32_t      append_index; // into the append section, with RECORD_APPEND
+    uint32_t      reserved;
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+    unsigned char fast[FAST_DIGEST_LENGTH];
+} baseline_record_t;
+
+typedef struct
+{
+    uint32_t      state[8];
+    uint64_t      length;
+    unsigned char fingerprint[FAST_DIGEST_LENGTH];
+} baseline_append_t;
+
+typedef struct
+{
+    unsigned char           *base;
+    size_t                   size;
+    const baseline_header_t *header;
+    const uint32_t          *table;
+    const baseline_record_t *records;
+    const baseline_append_t *appends;
+    const uint32_t          *restarts;
+    const unsigned char     *pool;
+    size_t                   count;
+    size_t                   append_count;
+    size_t                   restart_count;
+} baseline_map_t;
+
+// Walks the pool in name order.
+typedef struct
+{
+    size_t index;
+    size_t offset;
+    size_t length;
+    char   path[PATH_MAX];
+} pool_cursor_t;
+
+static baseline_map_t  mapped = {0};
+static pathmap_t      *entries = NULL; // records changed since the store was mapped
+static char            store_path[PATH_MAX] = {0};
+static unsigned long   cycle = 0;
+static bool            full_rehash = false;
+static bool            audit = false;
+static bool            dirty = false;
+static pthread_mutex_t baseline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t path_hash(const char *path)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+
+    // FNV-1a leaves its top bits poorly mixed, and buckets are chosen by them.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static size_t bucket_of(uint64_t hash, uint32_t bits)
+{
+    return bits == 0 ? 0 : (size_t)(hash >> (64 - bits));
+}
+
+static bool read_varint(const unsigned char *pool, size_t size, size_t *offset, size_t *value)
+{
+    size_t result = 0;
+
+    for (unsigned shift = 0; shift < 28 && *offset < size; shift += 7)
+    {
+        unsigned char byte = pool[(*offset)++];
+
+        result |= (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool cursor_next(const baseline_map_t *map, pool_cursor_t *cursor)
+{
+    size_t shared, suffix;
+
+    if (cursor->index >= map->count ||
+        !read_varint(map->pool, map->header->pool_size, &cursor->offset, &shared) ||
+        !read_varint(map->pool, map->header->pool_size, &cursor->offset, &suffix) ||
+        shared > cursor->length || suffix >= sizeof(cursor->path) - shared ||
+        suffix > map->header->pool_size - cursor->offset)
+        return false;
+
+    memcpy(cursor->path + shared, map->pool + cursor->offset, suffix);
+    cursor->offset += suffix;
+    cursor->length = shared + suffix;
+    cursor->path[cursor->length] = '\0';
+    cursor->index++;
+
+    return true;
+}
+
+static bool cursor_seek(const baseline_map_t *map, pool_cursor_t *cursor, size_t index)
+{
+    size_t restart = index / BASELINE_RESTART;
+
+    if (index >= map->count || restart >= map->restart_count || map->restarts[restart] > map->header->pool_size)
+        return false;
+
+    cursor->index = restart * BASELINE_RESTART;
+    cursor->offset = map->restarts[restart];
+    cursor->length = 0;
+
+    while (cursor->index <= index)
+        if (!cursor_next(map, cursor))
+            return false;
+
+    return true;
+}
+
+static const baseline_record_t *find_mapped(const char *path)
+{
+    uint64_t      hash;
+    size_t        bucket, end;
+    pool_cursor_t cursor;
+
+    if (mapped.count == 0)
+        return NULL;
+
+    hash = path_hash(path);
+    bucket = bucket_of(hash, mapped.header->bucket_bits);
+    end = mapped.table[bucket + 1] < mapped.count ? mapped.table[bucket + 1] : mapped.count;
+
+    for (size_t i = mapped.table[bucket]; i < end && mapped.records[i].path_hash <= hash; i++)
+    {
+        if (mapped.records[i].path_hash == hash && cursor_seek(&mapped, &cursor, mapped.records[i].path_index) &&
+            strcmp(cursor.path, path) == 0)
+            return &mapped.records[i];
+    }
+
+    return NULL;
+}
+
+static void record_to_entry(const baseline_map_t *map, const baseline_record_t *record, entry_t *entry)
+{
+    entry->dev = (dev_t)record->dev;
+    entry->ino = (ino_t)record->ino;
+    entry->size = (off_t)record->size;
+    entry->mtime = (time_t)record->mtime;
+    entry->mtime_nsec = record->mtime_nsec;
+    entry->ctime = (time_t)record->ctime;
+    entry->ctime_nsec = record->ctime_nsec;
+    memcpy(entry->sha256, record->sha256, SHA256_DIGEST_LENGTH);
+    memcpy(entry->xxh128, record->fast, FAST_DIGEST_LENGTH);
+    entry->has_fast = record->flags & RECORD_FAST;
+    entry->tree = record->flags & RECORD_TREE;
+    entry->content = (record->flags & RECORD_CONTENT) || (FIM_DIGEST_FORMAT == 2 && !entry->tree);
+    entry->has_append = (record->flags & RECORD_APPEND) && record->append_index < map->append_count;
+
+    if (entry->has_append)
+    {
+        const baseline_append_t *append = &map->appends[record->append_index];
+
+        memcpy(entry->append.midstate.state, append->state, sizeof(append->state));
+        entry->append.midstate.length = append->length;
+        memcpy(entry->append.fingerprint, append->fingerprint, FAST_DIGEST_LENGTH);
+    }
+}
+
+static void entry_to_record(const entry_t *entry, baseline_record_t *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->dev = (uint64_t)entry->dev;
+    record->ino = (uint64_t)entry->ino;
+    record->size = (int64_t)entry->size;
+    record->mtime = (int64_t)entry->mtime;
+    record->mtime_nsec = (uint32_t)entry->mtime_nsec;
+    record->ctime = (int64_t)entry->ctime;
+    record->ctime_nsec = (uint32_t)entry->ctime_nsec;
+    memcpy(record->sha256, entry->sha256, SHA256_DIGEST_LENGTH);
+    memcpy(record->fast, entry->xxh128, FAST_DIGEST_LENGTH);
+    record->flags = (entry->has_fast ? RECORD_FAST : 0) | (entry->tree ? RECORD_TREE : 0) |
+                    (entry->content ? RECORD_CONTENT : 0);
+}
+
+static void point_to_append(const append_point_t *point, baseline_append_t *append)
+{
+    memset(append, 0, sizeof(*append));
+    memcpy(append->state, point->midstate.state, sizeof(append->state));
+    append->length = point->midstate.length;
+    memcpy(append->fingerprint, point->fingerprint, FAST_DIGEST_LENGTH);
+}
+
+// Copies the current record for path, whether changed this run or still only in the mapped store.
+static bool find_entry(const char *path, entry_t *out)
+{
+    const entry_t *entry = entries ? pathmap_find(entries, path) : NULL;
+
+    if (entry)
+    {
+        *out = *entry;
+        return true;
+    }
+
+    const baseline_record_t *record = find_mapped(path);
+    if (!record)
+        return false;
+
+    record_to_entry(&mapped, record, out);
+    return true;
+}
+
+static entry_t *insert_entry(const char *path)
+{
+    entry_t *entry;
+
+    if (!entries)
+        entries = pathmap_new();
+
+    entry = pathmap_find(entries, path);
+    if (entry)
+        return entry;
+
+    entry = safe_malloc(sizeof(entry_t));
+    memset(entry, 0, sizeof(entry_t));
+    entry->path = pathmap_put(entries, path, entry);
+
+    return entry;
+}
+
+static void fill_entry(entry_t *entry, const struct stat *st)
+{
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->ctime = st->st_ctim.tv_sec;
+    entry->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static bool entry_matches(const entry_t *entry, const struct stat *st)
+{
+    return entry->dev == st->st_dev &&
+           entry->ino == st->st_ino &&
+           entry->size == st->st_size &&
+           entry->mtime == st->st_mtim.tv_sec &&
+           entry->mtime_nsec == st->st_mtim.tv_nsec &&
+           entry->ctime == st->st_ctim.tv_sec &&
+           entry->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+static void unmap_store(baseline_map_t *map)
+{
+    if (map->base)
+        munmap(map->base, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+static bool section_fits(uint64_t offset, uint64_t count, size_t item, size_t file_size)
+{
+    return offset <= file_size && count <= (file_size - offset) / item;
+}
+
+// Checks only the header and section bounds, so opening costs the same for any number of records.
+static int map_store(int fd, const char *path, baseline_map_t *map)
+{
+    struct stat              st;
+    const baseline_header_t *header;
+    void                    *base;
+
+    if (fstat(fd, &st) == -1)
+        return -1;
+
+    if ((size_t)st.st_size < sizeof(baseline_header_t))
+    {
+        log_message(LOG_WARNING, "Ignoring baseline %s with unknown format", path);
+        return -1;
+    }
+
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        log_message(LOG_WARNING, "Failed to map baseline %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    header = base;
+    uint64_t buckets = (uint64_t)1 << (header->bucket_bits < 32 ? header->bucket_bits : 0);
+    bool     v4 = strncmp(header->magic, BASELINE_V4_MAGIC, sizeof(header->magic)) == 0;
+    bool     v5 = strncmp(header->magic, BASELINE_V5_MAGIC, sizeof(header->magic)) == 0;
+
+    if ((!v4 && !v5 && strncmp(header->magic, BASELINE_MAGIC, sizeof(header->magic)) != 0) ||
+        header->byte_order != BASELINE_BYTE_ORDER || header->record_size != sizeof(baseline_record_t) ||
+        header->bucket_bits >= 32 || header->restart_interval != BASELINE_RESTART ||
+        header->record_count > UINT32_MAX || header->records_offset % _Alignof(baseline_record_t) != 0 ||
+        header->appends_offset % _Alignof(baseline_append_t) != 0 ||
+        !section_fits(header->table_offset, buckets + 1, sizeof(uint32_t), (size_t)st.st_size) ||
+        !section_fits(header->records_offset, header->record_count, sizeof(baseline_record_t), (size_t)st.st_size) ||
+        !section_fits(header->appends_offset, header->append_count, sizeof(baseline_append_t), (size_t)st.st_size) ||
+        !section_fits(header->restarts_offset, (header->record_count + BASELINE_RESTART - 1) / BASELINE_RESTART,
+                      sizeof(uint32_t), (size_t)st.st_size) ||
+        !section_fits(header->pool_offset, header->pool_size, 1, (size_t)st.st_size))
+    {
+        log_message(LOG_WARNING, "Ignoring baseline %s with unknown format", path);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+
+    // Plain records hold file digests in format 1 and content digests in format 2, which cannot be turned into each
+    // other, so a store of the other format is rebuilt by re-hashing.
+    uint32_t format = v4 ? 2 : header->digest_format;
+
+    if (format != FIM_DIGEST_FORMAT)
+    {
+        log_message(LOG_NOTICE, "Baseline %s holds format-%u digests, not format %d; rebuilding it", path, format,
+                    FIM_DIGEST_FORMAT);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+
+    // Every non-tree record of a format-2 store holds a content digest. A format-1 store from before RECORD_CONTENT
+    // cannot tell the content digests of append-mode files without a resume point from file digests.
+    if (v5 && format == 1)
+    {
+        log_message(LOG_NOTICE, "Baseline %s does not mark its content digests; rebuilding it", path);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+
+    // Lookups land on scattered pages; read-ahead would only pull in neighbours nobody asked for.
+    madvise(base, (size_t)st.st_size, MADV_RANDOM);
+
+    map->base = base;
+    map->size = (size_t)st.st_size;
+    map->header = header;
+    map->table = (const uint32_t *)(map->base + header->table_offset);
+    map->records = (const baseline_record_t *)(map->base + header->records_offset);
+    map->appends = (const baseline_append_t *)(map->base + header->appends_offset);
+    map->restarts = (const uint32_t *)(map->base + header->restarts_offset);
+    map->pool = map->base + header->pool_offset;
+    map->count = header->record_count;
+    map->append_count = header->append_count;
+    map->restart_count = (header->record_count + BASELINE_RESTART - 1) / BASELINE_RESTART;
+
+    return 0;
+}
+
+static int parse_line(char *line)
+{
+    unsigned long long dev, ino;
+    long long          size, mtime, ctime;
+    long               mtime_nsec, ctime_nsec;
+    char               hex[HASH_HEX_LEN + 1];
+    char               fast_hex[FAST_HEX_LEN + 1];
+    unsigned char      digest[SHA256_DIGEST_LENGTH];
+    int                offset;
+
+    if (sscanf(line, "%llu %llu %lld %lld.%ld %lld.%ld %64s %32s %n",
+               &dev, &ino, &size, &mtime, &mtime_nsec, &ctime, &ctime_nsec, hex, fast_hex, &offset) != 9)
+        return -1;
+
+    char *path = line + offset;
+    path[strcspn(path, "\n")] = '\0';
+
+    if (path[0] != '/' || strlen(hex) != HASH_HEX_LEN || hex_to_binary(hex, digest, SHA256_DIGEST_LENGTH) != 0)
+        return -1;
+
+    entry_t *entry = insert_entry(path);
+
+    // "-" marks a record written while the fast pre-filter was off, "tree" one holding a chunk-tree digest.
+    entry->tree = strcmp(fast_hex, "tree") == 0;
+    entry->content = !entry->tree;
+    entry->has_fast = strlen(fast_hex) == FAST_HEX_LEN && hex_to_binary(fast_hex, entry->xxh128, FAST_DIGEST_LENGTH) == 0;
+
+    entry->dev = (dev_t)dev;
+    entry->ino = (ino_t)ino;
+    entry->size = (off_t)size;
+    entry->mtime = (time_t)mtime;
+    entry->mtime_nsec = mtime_nsec;
+    entry->ctime = (time_t)ctime;
+    entry->ctime_nsec = ctime_nsec;
+    memcpy(entry->sha256, digest, SHA256_DIGEST_LENGTH);
+
+    return 0;
+}
+
+// Reads a store left by an earlier release into the change set, so the next sync rewrites it in the mapped format.
+static void load_text(FILE *fp, const char *path)
+{
+    char   *line = NULL;
+    size_t  len = 0;
+    size_t  line_no = 1;
+
+    while (getline(&line, &len, fp) != -1)
+    {
+        line_no++;
+        if (parse_line(line) != 0)
+            log_message(LOG_WARNING, "Malformed baseline record at %s:%zu", path, line_no);
+    }
+
+    free(line);
+    dirty = entries != NULL;
+
+    log_message(LOG_INFO, "Converting %zu baseline records from %s", entries ? pathmap_size(entries) : 0, path);
+}
+
+int baseline_open(const char *path)
+{
+    char  magic[sizeof(BASELINE_TEXT_MAGIC)];
+    FILE *fp;
+
+    snprintf(store_path, sizeof(store_path), "%s", path);
+
+    fp = fopen(path, "r");
+    if (!fp)
+    {
+        if (errno != ENOENT)
+            log_message(LOG_WARNING, "Failed to open baseline %s: %s", path, strerror(errno));
+        else
+            log_message(LOG_INFO, "No baseline found at %s. Starting from scratch.", path);
+
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&baseline_mutex);
+
+    unmap_store(&mapped);
+
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        memcmp(magic, BASELINE_TEXT_MAGIC "\n", sizeof(magic)) == 0)
+    {
+        if (FIM_DIGEST_FORMAT == 2)
+            load_text(fp, path);
+        else
+            log_message(LOG_NOTICE, "Baseline %s holds format-2 digests, not format %d; rebuilding it", path,
+                        FIM_DIGEST_FORMAT);
+    }
+    else if (map_store(fileno(fp), path, &mapped) == 0)
+        log_message(LOG_INFO, "Mapped %zu baseline records from %s", mapped.count, path);
+
+    pthread_mutex_unlock(&baseline_mutex);
+
+    fclose(fp);
+
+    return 0;
+}
+
+// One slot of the merged store: a record taken from the mapping or from the change set, and the name it sorts by.
+typedef struct
+{
+    const char              *path;
+    const baseline_record_t *record;
+    const entry_t           *entry;
+} merge_item_t;
+
+typedef struct
+{
+    merge_item_t *items;
+    size_t        count;
+} change_list_t;
+
+static void collect_change(const char *path, void *value, void *arg)
+{
+    change_list_t *changes = arg;
+
+    if (strchr(path, '\n'))
+        return;
+
+    changes->items[changes->count].path = path;
+    changes->items[changes->count].record = NULL;
+    changes->items[changes->count++].entry = value;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(((const merge_item_t *)a)->path, ((const merge_item_t *)b)->path);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const baseline_record_t *x = a;
+    const baseline_record_t *y = b;
+
+    if (x->path_hash != y->path_hash)
+        return x->path_hash < y->path_hash ? -1 : 1;
+
+    return x->path_index < y->path_index ? -1 : x->path_index > y->path_index;
+}
+
+typedef struct
+{
+    unsigned char     *pool;
+    size_t             pool_size;
+    size_t             pool_capacity;
+    uint32_t          *restarts;
+    size_t             restart_count;
+    baseline_record_t *records;
+    size_t             count;
+    baseline_append_t *appends;
+    size_t             append_count;
+    char               previous[PATH_MAX];
+    size_t             previous_len;
+} store_builder_t;
+
+static void pool_append(store_builder_t *builder, const void *data, size_t len)
+{
+    if (builder->pool_size + len > builder->pool_capacity)
+    {
+        builder->pool_capacity = (builder->pool_size + len) * 2;
+        builder->pool = safe_realloc(builder->pool, builder->pool_capacity);
+    }
+
+    memcpy(builder->pool + builder->pool_size, data, len);
+    builder->pool_size += len;
+}
+
+static void pool_append_varint(store_builder_t *builder, size_t value)
+{
+    unsigned char bytes[5];
+    size_t        len = 0;
+
+    do
+    {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            bytes[len] |= 0x80;
+        len++;
+    } while (value);
+
+    pool_append(builder, bytes, len);
+}
+
+// Paths must arrive in name order.
+static void builder_add(store_builder_t *builder, const char *path, const baseline_record_t *record,
+                        const baseline_append_t *append)
+{
+    size_t len = strlen(path);
+    size_t shared = 0;
+
+    if (builder->count % BASELINE_RESTART == 0)
+        builder->restarts[builder->restart_count++] = (uint32_t)builder->pool_size;
+    else
+        while (shared < len && shared < builder->previous_len && path[shared] == builder->previous[shared])
+            shared++;
+
+    pool_append_varint(builder, shared);
+    pool_append_varint(builder, len - shared);
+    pool_append(builder, path + shared, len - shared);
+
+    memcpy(builder->previous, path, len + 1);
+    builder->previous_len = len;
+
+    builder->records[builder->count] = *record;
+    builder->records[builder->count].path_hash = path_hash(path);
+    builder->records[builder->count].path_index = (uint32_t)builder->count;
+    builder->records[builder->count].flags &= ~RECORD_APPEND;
+    builder->records[builder->count].append_index = 0;
+
+    if (append)
+    {
+        builder->records[builder->count].flags |= RECORD_APPEND;
+        builder->records[builder->count].append_index = (uint32_t)builder->append_count;
+        builder->appends[builder->append_count++] = *append;
+    }
+
+    builder->count++;
+}
+
+static int write_store(FILE *fp, store_builder_t *builder)
+{
+    baseline_header_t header = {0};
+    uint32_t          bits = 0;
+    uint32_t         *table;
+    size_t            buckets;
+    static const char padding[8] = {0};
+
+    // About two records per bucket.
+    while (bits < 31 && ((size_t)2 << bits) < builder->count)
+        bits++;
+    buckets = (size_t)1 << bits;
+
+    qsort(builder->records, builder->count, sizeof(baseline_record_t), compare_records);
+
+    table = safe_malloc((buckets + 1) * sizeof(uint32_t));
+    for (size_t b = 0, i = 0; b <= buckets; b++)
+    {
+        while (i < builder->count && bucket_of(builder->records[i].path_hash, bits) < b)
+            i++;
+        table[b] = (uint32_t)i;
+    }
+
+    snprintf(header.magic, sizeof(header.magic), "%s", BASELINE_MAGIC);
+    header.byte_order = BASELINE_BYTE_ORDER;
+    header.record_size = sizeof(baseline_record_t);
+    header.bucket_bits = bits;
+    header.restart_interval = BASELINE_RESTART;
+    header.record_count = builder->count;
+    header.table_offset = sizeof(header);
+    header.records_offset = (header.table_offset + (buckets + 1) * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    header.appends_offset = header.records_offset + builder->count * sizeof(baseline_record_t);
+    header.append_count = builder->append_count;
+    header.restarts_offset = header.appends_offset + builder->append_count * sizeof(baseline_append_t);
+    header.pool_offset = header.restarts_offset + builder->restart_count * sizeof(uint32_t);
+    header.pool_size = builder->pool_size;
+    header.digest_format = FIM_DIGEST_FORMAT;
+
+    size_t pad = header.records_offset - header.table_offset - (buckets + 1) * sizeof(uint32_t);
+    bool   ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(table, sizeof(uint32_t), buckets + 1, fp) == buckets + 1 &&
+              fwrite(padding, 1, pad, fp) == pad &&
+              fwrite(builder->records, sizeof(baseline_record_t), builder->count, fp) == builder->count &&
+              fwrite(builder->appends, sizeof(baseline_append_t), builder->append_count, fp) == builder->append_count &&
+              fwrite(builder->restarts, sizeof(uint32_t), builder->restart_count, fp) == builder->restart_count &&
+              fwrite(builder->pool, 1, builder->pool_size, fp) == builder->pool_size;
+
+    free(table);
+
+    return ok ? 0 : -1;
+}
+
+// Merges the mapped store with the records changed since, both walked in name order, into a new store that replaces
+// the old one by rename and is then mapped in its place.
+static int rebuild_store(FILE *fp)
+{
+    store_builder_t builder = {0};
+    change_list_t   changes = {0};
+    pool_cursor_t   cursor = {0};
+    uint32_t       *by_name = NULL;
+    size_t          total = mapped.count + (entries ? pathmap_size(entries) : 0);
+    size_t          next = 0;
+    bool            have_mapped;
+    int             rc;
+
+    if (entries)
+    {
+        changes.items = safe_malloc(pathmap_size(entries) * sizeof(merge_item_t));
+        pathmap_foreach(entries, collect_change, &changes);
+        qsort(changes.items, changes.count, sizeof(merge_item_t), compare_items);
+    }
+
+    if (mapped.count)
+    {
+        by_name = safe_malloc(mapped.count * sizeof(uint32_t));
+        for (size_t i = 0; i < mapped.count; i++)
+            by_name[mapped.records[i].path_index < mapped.count ? mapped.records[i].path_index : 0] = (uint32_t)i;
+    }
+
+    builder.records = safe_malloc((total ? total : 1) * sizeof(baseline_record_t));
+    builder.appends = safe_malloc((total ? total : 1) * sizeof(baseline_append_t));
+    builder.restarts = safe_malloc(((total + BASELINE_RESTART - 1) / BASELINE_RESTART + 1) * sizeof(uint32_t));
+
+    have_mapped = cursor_next(&mapped, &cursor);
+    while (have_mapped || next < changes.count)
+    {
+        int               cmp = !have_mapped ? 1 : next == changes.count ? -1 : strcmp(cursor.path, changes.items[next].path);
+        baseline_record_t record;
+        baseline_append_t append;
+
+        if (cmp < 0)
+        {
+            const baseline_record_t *old = &mapped.records[by_name[cursor.index - 1]];
+            bool                     has_append = (old->flags & RECORD_APPEND) && old->append_index < mapped.append_count;
+
+            builder_add(&builder, cursor.path, old, has_append ? &mapped.appends[old->append_index] : NULL);
+        }
+        else
+        {
+            const entry_t *entry = changes.items[next].entry;
+
+            entry_to_record(entry, &record);
+            if (entry->has_append)
+                point_to_append(&entry->append, &append);
+            builder_add(&builder, changes.items[next].path, &record, entry->has_append ? &append : NULL);
+            next++;
+        }
+
+        if (cmp <= 0)
+            have_mapped = cursor_next(&mapped, &cursor);
+    }
+
+    rc = write_store(fp, &builder);
+
+    free(builder.pool);
+    free(builder.restarts);
+    free(builder.records);
+    free(builder.appends);
+    free(by_name);
+    free(changes.items);
+
+    return rc;
+}
+
+int baseline_sync(void)
+{
+    char  tmp_path[PATH_MAX + 8];
+    FILE *fp;
+    int   rc = -1;
+
+    if (store_path[0] == '\0' || !dirty)
+        return 0;
+
+    fp = open_atomic(store_path, tmp_path, sizeof(tmp_path));
+    if (!fp)
+        return -1;
+
+    pthread_mutex_lock(&baseline_mutex);
+
+    if (rebuild_store(fp) != 0)
+    {
+        log_message(LOG_ERR, "Failed to write %s: %s", tmp_path, strerror(errno));
+        fclose(fp);
+        unlink(tmp_path);
+    }
+    else if (commit_atomic(fp, tmp_path, store_path) == 0)
+    {
+        baseline_map_t map = {0};
+        int            fd = open(store_path, O_RDONLY | O_CLOEXEC);
+
+        // Until the new store is mapped, the old mapping and the change set keep answering lookups.
+        if (fd != -1 && map_store(fd, store_path, &map) == 0)
+        {
+            unmap_store(&mapped);
+            mapped = map;
+            pathmap_free(entries, free);
+            entries = NULL;
+            dirty = false;
+            rc = 0;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+
+    pthread_mutex_unlock(&baseline_mutex);
+
+    return rc;
+}
+
+void baseline_close(void)
+{
+    pthread_mutex_lock(&baseline_mutex);
+
+    unmap_store(&mapped);
+    pathmap_free(entries, free);
+    entries = NULL;
+    dirty = false;
+    store_path[0] = '\0';
+
+    pthread_mutex_unlock(&baseline_mutex);
+}
+
+void baseline_begin_cycle(void)
+{
+    cycle++;
+    audit = FIM_FAST_PREFILTER && FIM_PREFILTER_AUDIT_CYCLES > 0 && cycle % FIM_PREFILTER_AUDIT_CYCLES == 0;
+    full_rehash = audit || (FIM_FULL_REHASH_CYCLES > 0 && cycle % FIM_FULL_REHASH_CYCLES == 0);
+
+    if (audit)
+        log_message(LOG_INFO, "Cycle %lu: auditing all content with SHA-256", cycle);
+    else if (full_rehash)
+        log_message(LOG_INFO, "Cycle %lu: forcing full content re-hash", cycle);
+}
+
+// A full re-hash or audit covers the sweep that opened the cycle; later checks in the same cycle are incremental.
+void baseline_end_sweep(void)
+{
+    full_rehash = false;
+    audit = false;
+}
+
+bool baseline_full_rehash(void)
+{
+    return full_rehash;
+}
+
+bool baseline_audit_cycle(void)
+{
+    return audit;
+}
+
+// A stale record is only returned when it carries a fast digest the caller can compare against. In format 1 plain
+// records hold file digests, so a content digest recorded in append mode does not match.
+baseline_match_t baseline_lookup(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH],
+                                 unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    baseline_match_t match = BASELINE_MISS;
+    entry_t          entry;
+
+    pthread_mutex_lock(&baseline_mutex);
+
+    if (find_entry(path, &entry) && !entry.tree && entry.content == (FIM_DIGEST_FORMAT == 2))
+    {
+        memcpy(sha256, entry.sha256, SHA256_DIGEST_LENGTH);
+
+        if (!full_rehash && entry_matches(&entry, st))
+        {
+            match = BASELINE_MATCH;
+        }
+        else if (entry.has_fast)
+        {
+            memcpy(fast, entry.xxh128, FAST_DIGEST_LENGTH);
+            match = BASELINE_STALE;
+        }
+    }
+
+    pthread_mutex_unlock(&baseline_mutex);
+
+    return match;
+}
+
+void baseline_update(const char *path, const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH],
+                     const unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    pthread_mutex_lock(&baseline_mutex);
+
+    entry_t *entry = insert_entry(path);
+    fill_entry(entry, st);
+    memcpy(entry->sha256, sha256, SHA256_DIGEST_LENGTH);
+    entry->has_fast = fast != NULL;
+    if (fast)
+        memcpy(entry->xxh128, fast, FAST_DIGEST_LENGTH);
+    entry->tree = false;
+    entry->content = FIM_DIGEST_FORMAT == 2;
+    entry->has_append = false;
+    dirty = true;
+
+    pthread_mutex_unlock(&baseline_mutex);
+}
+
+// Tree and plain digests of one path never stand in for each other; switching modes re-hashes the file.
+baseline_match_t baseline_lookup_tree(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH])
+{
+    baseline_match_t match = BASELINE_MISS;
+    entry_t          entry;
+
+    pthread_mutex_lock(&baseline_mutex);
+
+    if (find_entry(path, &entry) && entry.tree && !full_rehash && entry_matches(&entry, st))
+    {
+        memcpy(sha256, entry.sha256, SHA256_DIGEST_LENGTH);
+        match = BASELINE_MATCH;
+    }
+
+    pthread_mutex_unlock(&baseline_mutex);
+
+    return match;
+}
+
+void baseline_update_tree(const char *path, const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH])
+{
+    pthread_mutex_lock(&baseline_mutex);
+
+    entry_t *entry = insert_entry(path);
+    fill_entry(entry, st);
+    memcpy(entry->sha256, sha256, SHA256_DIGEST_LENGTH);
+    entry->has_fast = false;
+    entry->tree = true;
+    entry->content = false;
+    entry->has_append = false;
+    dirty = true;
+
+    pthread_mutex_unlock(&baseline_mutex);
+}
+
+// Append-mode records hold content digests, so only a record marked as one can match, whether or not it has a resume
+// point. A stale one is only returned, with its resume point, while the path still names the same inode; the caller
+// checks the point against the content.
+baseline_match_t baseline_lookup_append(const char *path, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH],
+                                        append_point_t *point)
+{
+    baseline_match_t match = BASELINE_MISS;
+    entry_t          entry;
+
+    pthread_mutex_lock(&baseline_mutex);
+
+    if (find_entry(path, &entry) && entry.content)
+    {
+        memcpy(sha256, entry.sha256, SHA256_DIGEST_LENGTH);
+
+        if (!full_rehash && entry_matches(&entry, st))
+        {
+            match = BASELINE_MATCH;
+        }
+        else if (!full_rehash && entry.has_append && entry.dev == st->st_dev && entry.ino == st->st_ino)
+        {
+            *point = entry.append;
+            match = BASELINE_STALE;
+        }
+    }
+
+    pthread_mutex_unlock(&baseline_mutex);
+
+    return match;
+}
+
+void baseline_update_append(const char *path, const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH],
+                            const append_point_t *point)
+{
+    pthread_mutex_lock(&baseline_mutex);
+
+    entry_t *entry = insert_entry(path);
+    fill_entry(entry, st);
+    memcpy(entry->sha256, sha256, SHA256_DIGEST_LENGTH);
+    entry->has_fast = false;
+    entry->tree = false;
+    entry->content = true;
+    entry->has_append = point != NULL;
+    if (point)
+        entry->append = *point;
+    dirty = true;
+
+    pthread_mutex_unlock(&baseline_mutex);
+}
@@ -23,8 +23,9 @@ static pid_t safe_fork(void)
         exit(EXIT_FAILURE);
     }
 
+    // The parent leaves without running exit handlers; the child owns the log writer and stdio state from here on.
     if (pid > 0)
-        exit(EXIT_SUCCESS);
+        _exit(EXIT_SUCCESS);
 
     return pid;
 }
@@ -0,0 +1,283 @@
+#include "device.h"
+#include "config.h"
+#include "logging.h"
+#include "metrics.h"
+#include "utils.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+typedef struct device device_t;
+
+typedef struct
+{
+    device_t        *device;
+    task_fn_t        fn;
+    void            *arg;
+    ino_t            ino;
+    metrics_scope_t *scope; // the submitter's; a held task is started from whichever task finishes before it
+} device_task_t;
+
+struct device
+{
+    device_t       *next;
+    dev_t           dev;
+    size_t          limit; // read tasks running at once; 0 = not limited
+    size_t          running;
+    device_task_t **held; // min-heap on inode
+    size_t          held_count;
+    size_t          held_capacity;
+};
+
+// Devices are few and never forgotten, so a list searched under one lock is enough.
+static pthread_mutex_t device_mutex = PTHREAD_MUTEX_INITIALIZER;
+static device_t       *devices = NULL;
+
+#ifdef __linux__
+
+// Joins a sysfs directory and a relative name; a path that does not fit is treated as absent.
+static bool sysfs_path(char *out, size_t size, const char *dir, const char *name)
+{
+    int n = snprintf(out, size, "%s/%s", dir, name);
+
+    return n >= 0 && (size_t)n < size;
+}
+
+// Partitions have no request queue or driver of their own; theirs are the whole disk's, one level up in sysfs.
+static bool disk_dir(dev_t dev, char *dir, size_t size)
+{
+    char base[64];
+    char partition[PATH_MAX];
+
+    snprintf(base, sizeof(base), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    if (access(base, F_OK) != 0 || !sysfs_path(partition, sizeof(partition), base, "partition"))
+        return false;
+
+    return sysfs_path(dir, size, base, access(partition, F_OK) == 0 ? ".." : ".");
+}
+
+static bool read_sysfs_value(const char *dir, const char *name, long *value)
+{
+    char  path[PATH_MAX];
+    FILE *file;
+    bool  ok;
+
+    if (!sysfs_path(path, sizeof(path), dir, name))
+        return false;
+
+    file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    ok = fscanf(file, "%ld", value) == 1;
+    fclose(file);
+
+    return ok;
+}
+
+// Virtio and device-mapper disks report rotational=1 by default whatever backs them, so the flag says nothing there.
+static bool virtual_disk(const char *dir)
+{
+    char        path[PATH_MAX];
+    char        driver[PATH_MAX];
+    const char *name;
+    ssize_t     len;
+
+    if (sysfs_path(path, sizeof(path), dir, "dm") && access(path, F_OK) == 0)
+        return true;
+
+    if (!sysfs_path(path, sizeof(path), dir, "device/driver"))
+        return false;
+
+    len = readlink(path, driver, sizeof(driver) - 1);
+    if (len <= 0)
+        return false;
+    driver[len] = '\0';
+
+    name = strrchr(driver, '/');
+    name = name ? name + 1 : driver;
+
+    return strncmp(name, "virtio", 6) == 0;
+}
+
+static size_t probe_limit(dev_t dev)
+{
+    char dir[PATH_MAX];
+    long requests;
+    long value;
+
+    if (!disk_dir(dev, dir, sizeof(dir)))
+        return 0;
+
+    // Bio-based devices have no request queue depth and take whatever is sent.
+    if (!read_sysfs_value(dir, "queue/nr_requests", &requests) || requests <= 0)
+        requests = 0;
+
+    if (read_sysfs_value(dir, "queue/rotational", &value) && value == 1 &&
+        !(requests >= DEVICE_VIRTUAL_MIN_REQUESTS && virtual_disk(dir)))
+    {
+        log_message(LOG_INFO, "Device %u:%u is rotational: reading %d file(s) at a time in inode order", major(dev),
+                    minor(dev), DEVICE_ROTATIONAL_STREAMS);
+        return DEVICE_ROTATIONAL_STREAMS;
+    }
+
+    if (requests == 0)
+        return 0;
+
+    log_message(LOG_INFO, "Device %u:%u: reading up to %ld files at a time", major(dev), minor(dev), requests);
+
+    return (size_t)requests;
+}
+
+#else
+
+static size_t probe_limit(dev_t dev)
+{
+    (void)dev;
+
+    return 0;
+}
+
+#endif
+
+static device_t *find_device(dev_t dev)
+{
+    device_t *device;
+
+    for (device = devices; device; device = device->next)
+    {
+        if (device->dev == dev)
+            return device;
+    }
+
+    device = safe_malloc(sizeof(device_t));
+    memset(device, 0, sizeof(device_t));
+    device->dev = dev;
+    device->limit = probe_limit(dev);
+    device->next = devices;
+    devices = device;
+
+    return device;
+}
+
+static void hold(device_t *device, device_task_t *task)
+{
+    size_t i = device->held_count++;
+
+    if (device->held_count > device->held_capacity)
+    {
+        device->held_capacity = device->held_capacity ? device->held_capacity * 2 : 64;
+        device->held = safe_realloc(device->held, device->held_capacity * sizeof(device_task_t *));
+    }
+
+    for (; i > 0 && device->held[(i - 1) / 2]->ino > task->ino; i = (i - 1) / 2)
+        device->held[i] = device->held[(i - 1) / 2];
+
+    device->held[i] = task;
+}
+
+static device_task_t *unhold(device_t *device)
+{
+    device_task_t *first = device->held[0];
+    device_task_t *last = device->held[--device->held_count];
+    size_t         i = 0;
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= device->held_count)
+            break;
+        if (child + 1 < device->held_count && device->held[child + 1]->ino < device->held[child]->ino)
+            child++;
+        if (last->ino <= device->held[child]->ino)
+            break;
+
+        device->held[i] = device->held[child];
+        i = child;
+    }
+
+    if (device->held_count > 0)
+        device->held[i] = last;
+
+    return first;
+}
+
+static void run_device_task(void *arg);
+
+static void start_task(device_task_t *task)
+{
+    metrics_scope_t *saved = metrics_enter(task->scope);
+
+    threadpool_submit(run_device_task, task);
+    metrics_leave(saved);
+}
+
+// The finishing task hands its slot straight to the lowest held inode, if any.
+static void run_device_task(void *arg)
+{
+    device_task_t *task = arg;
+    device_t      *device = task->device;
+    device_task_t *next = NULL;
+
+    task->fn(task->arg);
+    free(task);
+
+    pthread_mutex_lock(&device_mutex);
+    if (device->held_count > 0)
+        next = unhold(device);
+    else
+        device->running--;
+    pthread_mutex_unlock(&device_mutex);
+
+    if (next)
+        start_task(next);
+}
+
+void device_submit(dev_t dev, ino_t ino, task_fn_t fn, void *arg)
+{
+    device_task_t *task;
+    device_t      *device;
+    bool           start;
+
+    if (!DEVICE_SCHEDULING)
+    {
+        threadpool_submit(fn, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&device_mutex);
+    device = find_device(dev);
+
+    if (device->limit == 0)
+    {
+        pthread_mutex_unlock(&device_mutex);
+        threadpool_submit(fn, arg);
+        return;
+    }
+
+    task = safe_malloc(sizeof(device_task_t));
+    task->device = device;
+    task->fn = fn;
+    task->arg = arg;
+    task->ino = ino;
+    task->scope = metrics_current();
+
+    start = device->running < device->limit;
+    if (start)
+        device->running++;
+    else
+        hold(device, task);
+    pthread_mutex_unlock(&device_mutex);
+
+    if (start)
+        threadpool_submit(run_device_task, task);
+}
@@ -0,0 +1,251 @@
+// The SHA256_* functions are deprecated in OpenSSL 3 but remain the only way to read and restore a midstate.
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "digest.h"
+#include "logging.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIGEST_CACHE_SIZE 4
+
+// Released contexts are kept per thread and re-initialized in place, so the provider context behind each one is
+// allocated once per thread instead of once per file or line.
+typedef struct
+{
+    EVP_MD_CTX *contexts[DIGEST_CACHE_SIZE];
+    size_t      count;
+} digest_cache_t;
+
+static pthread_key_t  cache_key;
+static pthread_once_t digest_once = PTHREAD_ONCE_INIT;
+static EVP_MD        *sha256_md = NULL;
+static EVP_MD        *shake128_md = NULL;
+
+static void free_cache(void *arg)
+{
+    digest_cache_t *cache = arg;
+
+    for (size_t i = 0; i < cache->count; i++)
+        EVP_MD_CTX_free(cache->contexts[i]);
+
+    free(cache);
+}
+
+static void digest_init(void)
+{
+    pthread_key_create(&cache_key, free_cache);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // EVP_sha256() would repeat the provider lookup on every EVP_DigestInit_ex.
+    sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+    if (!sha256_md)
+        log_message(LOG_WARNING, "Failed to fetch SHA256 from the default provider; using implicit lookups");
+    shake128_md = EVP_MD_fetch(NULL, "SHAKE128", NULL);
+#endif
+}
+
+static digest_cache_t *thread_cache(void)
+{
+    digest_cache_t *cache = pthread_getspecific(cache_key);
+
+    if (!cache)
+    {
+        cache = safe_malloc(sizeof(digest_cache_t));
+        memset(cache, 0, sizeof(digest_cache_t));
+        pthread_setspecific(cache_key, cache);
+    }
+
+    return cache;
+}
+
+const EVP_MD *digest_sha256(void)
+{
+    pthread_once(&digest_once, digest_init);
+
+    return sha256_md ? sha256_md : EVP_sha256();
+}
+
+// Cached contexts are re-initialized for whichever digest the caller asks for.
+static EVP_MD_CTX *acquire_md(const EVP_MD *md)
+{
+    digest_cache_t *cache = thread_cache();
+    EVP_MD_CTX     *ctx = cache->count > 0 ? cache->contexts[--cache->count] : EVP_MD_CTX_new();
+
+    if (!ctx)
+    {
+        log_message(LOG_ERR, "Failed to create digest context");
+        return NULL;
+    }
+
+    if (EVP_DigestInit_ex(ctx, md, NULL) != 1)
+    {
+        log_message(LOG_ERR, "Failed to initialize EVP digest context");
+        EVP_MD_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+EVP_MD_CTX *digest_acquire(void)
+{
+    return acquire_md(digest_sha256());
+}
+
+void digest_release(EVP_MD_CTX *ctx)
+{
+    digest_cache_t *cache;
+
+    if (!ctx)
+        return;
+
+    cache = thread_cache();
+    if (cache->count < DIGEST_CACHE_SIZE)
+        cache->contexts[cache->count++] = ctx;
+    else
+        EVP_MD_CTX_free(ctx);
+}
+
+int digest_sha256_buffer(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    EVP_MD_CTX *ctx = digest_acquire();
+    int         rc = -1;
+
+    if (!ctx)
+        return -1;
+
+    if (EVP_DigestUpdate(ctx, data, len) == 1 && EVP_DigestFinal_ex(ctx, digest, NULL) == 1)
+        rc = 0;
+
+    digest_release(ctx);
+
+    return rc;
+}
+
+// Expands data into out_len bytes of SHAKE128 output.
+int digest_shake128_buffer(const void *data, size_t len, unsigned char *out, size_t out_len)
+{
+    EVP_MD_CTX *ctx;
+    int         rc = -1;
+
+    pthread_once(&digest_once, digest_init);
+
+    ctx = acquire_md(shake128_md ? shake128_md : EVP_shake128());
+    if (!ctx)
+        return -1;
+
+    if (EVP_DigestUpdate(ctx, data, len) == 1 && EVP_DigestFinalXOF(ctx, out, out_len) == 1)
+        rc = 0;
+
+    digest_release(ctx);
+
+    return rc;
+}
+
+// Frees the calling thread's cache and the fetched digest; worker caches go with their threads.
+void digest_shutdown(void)
+{
+    digest_cache_t *cache;
+
+    pthread_once(&digest_once, digest_init);
+
+    cache = pthread_getspecific(cache_key);
+    if (cache)
+    {
+        pthread_setspecific(cache_key, NULL);
+        free_cache(cache);
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free(sha256_md);
+    sha256_md = NULL;
+    EVP_MD_free(shake128_md);
+    shake128_md = NULL;
+#endif
+}
+
+#ifndef OPENSSL_NO_DEPRECATED_3_0
+
+struct sha256_stream
+{
+    SHA256_CTX ctx;
+};
+
+// Starts a SHA-256 that can hand out its midstate, either fresh or continuing from resume.
+sha256_stream_t *sha256_stream_new(const sha256_midstate_t *resume)
+{
+    sha256_stream_t *stream = safe_malloc(sizeof(sha256_stream_t));
+
+    SHA256_Init(&stream->ctx);
+
+    if (resume)
+    {
+        uint64_t bits = resume->length * 8;
+
+        for (size_t i = 0; i < 8; i++)
+            stream->ctx.h[i] = resume->state[i];
+        stream->ctx.Nl = (SHA_LONG)(bits & 0xffffffffu);
+        stream->ctx.Nh = (SHA_LONG)(bits >> 32);
+    }
+
+    return stream;
+}
+
+void sha256_stream_update(sha256_stream_t *stream, const void *data, size_t len)
+{
+    SHA256_Update(&stream->ctx, data, len);
+}
+
+// Only a stream that has absorbed a whole number of blocks has a midstate to export.
+bool sha256_stream_midstate(const sha256_stream_t *stream, sha256_midstate_t *out)
+{
+    if (stream->ctx.num != 0)
+        return false;
+
+    for (size_t i = 0; i < 8; i++)
+        out->state[i] = stream->ctx.h[i];
+    out->length = ((uint64_t)stream->ctx.Nh << 32 | stream->ctx.Nl) / 8;
+
+    return true;
+}
+
+void sha256_stream_final(sha256_stream_t *stream, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    SHA256_Final(digest, &stream->ctx);
+    free(stream);
+}
+
+#else
+
+// Without the low-level API callers fall back to hashing whole files through EVP.
+sha256_stream_t *sha256_stream_new(const sha256_midstate_t *resume)
+{
+    (void)resume;
+
+    return NULL;
+}
+
+void sha256_stream_update(sha256_stream_t *stream, const void *data, size_t len)
+{
+    (void)stream;
+    (void)data;
+    (void)len;
+}
+
+bool sha256_stream_midstate(const sha256_stream_t *stream, sha256_midstate_t *out)
+{
+    (void)stream;
+    (void)out;
+
+    return false;
+}
+
+void sha256_stream_final(sha256_stream_t *stream, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    (void)stream;
+    memset(digest, 0, SHA256_DIGEST_LENGTH);
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include "dirscan.h"
+#include "metrics.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIRSCAN_BUF_SIZE 32768
+
+int dir_open_at(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOATIME);
+
+    metrics_count(METRIC_OPEN_CALLS, 1);
+
+    // O_NOATIME is refused for directories we do not own unless we hold CAP_FOWNER.
+    if (fd == -1 && errno == EPERM)
+        fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    return fd;
+}
+
+static void add_entry(dir_listing_t *listing, const char *name, unsigned char type)
+{
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
+
+    if (listing->count == listing->capacity)
+    {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 32;
+        listing->entries = safe_realloc(listing->entries, listing->capacity * sizeof(dir_entry_t));
+    }
+
+    listing->entries[listing->count].name = arena_strndup(&listing->arena, name, strlen(name));
+    listing->entries[listing->count].type = type;
+    listing->count++;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const dir_entry_t *x = a;
+    const dir_entry_t *y = b;
+
+    return strcmp(x->name, y->name);
+}
+
+#ifdef __linux__
+
+int dir_stream_open(dir_stream_t *stream, int dir_fd)
+{
+    stream->fd = dir_fd;
+    stream->handle = NULL;
+    stream->done = false;
+
+    return 0;
+}
+
+// getdents64 fills a whole buffer of entries per call, with d_type set by most filesystems. A slice may overshoot
+// limit by the rest of the last buffer.
+static int read_entries(dir_stream_t *stream, dir_listing_t *listing, size_t limit)
+{
+    char    buf[DIRSCAN_BUF_SIZE] __attribute__((aligned(__alignof__(struct dirent64))));
+    ssize_t n;
+
+    while (listing->count < limit)
+    {
+        n = getdents64(stream->fd, buf, sizeof(buf));
+        if (n == 0)
+        {
+            stream->done = true;
+            break;
+        }
+
+        metrics_count(METRIC_GETDENTS_CALLS, 1);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (ssize_t offset = 0; offset < n;)
+        {
+            const struct dirent64 *entry = (const struct dirent64 *)(buf + offset);
+
+            add_entry(listing, entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
+        }
+    }
+
+    return 0;
+}
+
+void dir_stream_close(dir_stream_t *stream)
+{
+    stream->done = true;
+}
+
+#else
+
+int dir_stream_open(dir_stream_t *stream, int dir_fd)
+{
+    int  fd = dup(dir_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+
+    if (!dir)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    stream->fd = dir_fd;
+    stream->handle = dir;
+    stream->done = false;
+
+    return 0;
+}
+
+static int read_entries(dir_stream_t *stream, dir_listing_t *listing, size_t limit)
+{
+    struct dirent *entry;
+
+    while (listing->count < limit)
+    {
+        errno = 0;
+        entry = readdir(stream->handle);
+        if (!entry)
+        {
+            stream->done = true;
+            return errno != 0 ? -1 : 0;
+        }
+
+        add_entry(listing, entry->d_name, entry->d_type);
+    }
+
+    return 0;
+}
+
+void dir_stream_close(dir_stream_t *stream)
+{
+    if (stream->handle)
+        closedir(stream->handle);
+    stream->handle = NULL;
+    stream->done = true;
+}
+
+#endif
+
+// Starts a fresh listing with the next slice of about limit entries; at the end of the directory stream->done is set.
+int dir_stream_next(dir_stream_t *stream, dir_listing_t *listing, size_t limit)
+{
+    memset(listing, 0, sizeof(dir_listing_t));
+    arena_init(&listing->arena);
+
+    if (read_entries(stream, listing, limit) != 0)
+    {
+        int saved = errno;
+        dir_listing_free(listing);
+        errno = saved;
+        return -1;
+    }
+
+    return 0;
+}
+
+int dir_list(int dir_fd, dir_listing_t *listing)
+{
+    dir_stream_t stream;
+    int          rc;
+    int          saved;
+
+    if (dir_stream_open(&stream, dir_fd) != 0)
+        return -1;
+
+    rc = dir_stream_next(&stream, listing, SIZE_MAX);
+    saved = errno;
+    dir_stream_close(&stream);
+    errno = saved;
+
+    if (rc == 0 && listing->count > 1)
+        qsort(listing->entries, listing->count, sizeof(dir_entry_t), compare_entries);
+
+    return rc;
+}
+
+void dir_listing_free(dir_listing_t *listing)
+{
+    arena_free(&listing->arena);
+    free(listing->entries);
+    listing->entries = NULL;
+    listing->count = 0;
+    listing->capacity = 0;
+}
@@ -0,0 +1,537 @@
+#include "exclude.h"
+#include "config.h"
+#include "logging.h"
+#include "utils.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_ACCEPT 0x1
+#define STATE_UNIVERSAL 0x2 // every continuation is accepted, so nothing below the prefix can be included
+#define STATE_DEAD 0x4      // no continuation is accepted
+
+typedef enum
+{
+    TOKEN_ONE,  // one byte from set
+    TOKEN_STAR, // any run of bytes, '/' included
+    TOKEN_END   // the pattern matched
+} token_kind_t;
+
+typedef struct
+{
+    token_kind_t kind;
+    uint64_t     set[4];
+} token_t;
+
+typedef struct
+{
+    token_t *tokens;
+    size_t   count;
+    size_t   capacity;
+} token_list_t;
+
+// Every pattern is folded into one DFA over byte classes; a literal pattern becomes a plain trie path inside it.
+typedef struct
+{
+    char        **patterns;
+    size_t        pattern_count;
+    bool          compiled;
+    unsigned char classes[256];
+    size_t        class_count;
+    uint32_t     *next; // state * class_count + class
+    uint8_t      *flags;
+    size_t        state_count;
+} matcher_t;
+
+static matcher_t matcher = {0};
+
+static void set_bit(uint64_t set[4], unsigned char c)
+{
+    set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static bool has_bit(const uint64_t set[4], unsigned char c)
+{
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static token_t *push_token(token_list_t *list, token_kind_t kind)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->tokens = safe_realloc(list->tokens, list->capacity * sizeof(token_t));
+    }
+
+    token_t *token = &list->tokens[list->count++];
+
+    memset(token, 0, sizeof(token_t));
+    token->kind = kind;
+
+    return token;
+}
+
+static bool add_class(uint64_t set[4], const char *name, size_t len)
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i].name) != len || strncmp(classes[i].name, name, len) != 0)
+            continue;
+
+        for (int c = 0; c < 256; c++)
+        {
+            if (classes[i].test(c))
+                set_bit(set, (unsigned char)c);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Parses the bracket expression after '['; returns the byte past ']', the '[' itself when unterminated
+// (fnmatch then matches it literally), or NULL for syntax the DFA does not model.
+static const char *parse_bracket(const char *p, uint64_t set[4])
+{
+    const char *start = p;
+    bool        negate = *p == '!' || *p == '^';
+    bool        first = true;
+
+    if (negate)
+        p++;
+
+    while (*p != ']' || first)
+    {
+        unsigned char lo;
+        unsigned char hi;
+
+        first = false;
+
+        if (*p == '\0')
+            return start - 1;
+
+        if (*p == '[' && p[1] == ':')
+        {
+            const char *end = strstr(p + 2, ":]");
+            if (!end || !add_class(set, p + 2, (size_t)(end - p - 2)))
+                return NULL;
+            p = end + 2;
+            continue;
+        }
+
+        if (*p == '[' && (p[1] == '=' || p[1] == '.'))
+            return NULL;
+
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        lo = (unsigned char)*p++;
+        hi = lo;
+
+        if (*p == '-' && p[1] != ']' && p[1] != '\0')
+        {
+            p++;
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            if (*p == '[')
+                return NULL;
+            hi = (unsigned char)*p++;
+        }
+
+        for (unsigned int c = lo; c <= hi; c++)
+            set_bit(set, (unsigned char)c);
+    }
+
+    if (negate)
+    {
+        for (int i = 0; i < 4; i++)
+            set[i] = ~set[i];
+    }
+
+    return p + 1;
+}
+
+static bool tokenize(const char *pattern, token_list_t *list)
+{
+    for (const char *p = pattern; *p;)
+    {
+        token_t *token;
+
+        switch (*p)
+        {
+            case '*':
+                if (list->count == 0 || list->tokens[list->count - 1].kind != TOKEN_STAR)
+                    push_token(list, TOKEN_STAR);
+                p++;
+                break;
+
+            case '?':
+                token = push_token(list, TOKEN_ONE);
+                memset(token->set, 0xff, sizeof(token->set));
+                p++;
+                break;
+
+            case '[':
+            {
+                uint64_t    set[4] = {0};
+                const char *end = parse_bracket(p + 1, set);
+
+                if (!end)
+                    return false;
+
+                token = push_token(list, TOKEN_ONE);
+                if (end == p)
+                {
+                    set_bit(token->set, '[');
+                    p++;
+                }
+                else
+                {
+                    memcpy(token->set, set, sizeof(set));
+                    p = end;
+                }
+                break;
+            }
+
+            case '\\':
+                // fnmatch never matches a pattern ending in a lone backslash; an empty set models that.
+                if (p[1] == '\0')
+                {
+                    push_token(list, TOKEN_ONE);
+                    p++;
+                    break;
+                }
+                p++;
+                // fallthrough
+            default:
+                token = push_token(list, TOKEN_ONE);
+                set_bit(token->set, (unsigned char)*p++);
+                break;
+        }
+    }
+
+    push_token(list, TOKEN_END);
+
+    return true;
+}
+
+// Bytes that every token treats alike share one column of the transition table.
+static void build_classes(const token_list_t *list)
+{
+    unsigned char reps[256];
+
+    matcher.class_count = 0;
+
+    for (int c = 0; c < 256; c++)
+    {
+        size_t k;
+
+        for (k = 0; k < matcher.class_count; k++)
+        {
+            size_t t;
+
+            for (t = 0; t < list->count; t++)
+            {
+                const token_t *token = &list->tokens[t];
+
+                if (token->kind == TOKEN_ONE && has_bit(token->set, (unsigned char)c) != has_bit(token->set, reps[k]))
+                    break;
+            }
+
+            if (t == list->count)
+                break;
+        }
+
+        if (k == matcher.class_count)
+            reps[matcher.class_count++] = (unsigned char)c;
+
+        matcher.classes[c] = (unsigned char)k;
+    }
+}
+
+static void closure(const token_list_t *list, uint64_t *set)
+{
+    // A star can also match nothing; positions only move forward, so one ascending pass suffices.
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if ((set[i >> 6] >> (i & 63) & 1) && list->tokens[i].kind == TOKEN_STAR)
+            set[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+    }
+}
+
+static void step(const token_list_t *list, const uint64_t *from, unsigned char c, uint64_t *to, size_t words)
+{
+    memset(to, 0, words * sizeof(uint64_t));
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const token_t *token = &list->tokens[i];
+
+        if (!(from[i >> 6] >> (i & 63) & 1))
+            continue;
+
+        if (token->kind == TOKEN_STAR)
+            to[i >> 6] |= 1ULL << (i & 63);
+        else if (token->kind == TOKEN_ONE && has_bit(token->set, c))
+            to[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+    }
+
+    closure(list, to);
+}
+
+static uint64_t hash_set(const uint64_t *set, size_t words)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    for (size_t i = 0; i < words; i++)
+        h = (h ^ set[i]) * 1099511628211ULL;
+
+    return h;
+}
+
+// A state that can reach a non-accepting state is not universal; the fixpoint spreads that backwards.
+static void mark_universal(void)
+{
+    bool changed = true;
+
+    for (size_t s = 0; s < matcher.state_count; s++)
+    {
+        if (matcher.flags[s] & STATE_ACCEPT)
+            matcher.flags[s] |= STATE_UNIVERSAL;
+    }
+
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t s = 0; s < matcher.state_count; s++)
+        {
+            if (!(matcher.flags[s] & STATE_UNIVERSAL))
+                continue;
+
+            for (size_t c = 0; c < matcher.class_count; c++)
+            {
+                if (!(matcher.flags[matcher.next[s * matcher.class_count + c]] & STATE_UNIVERSAL))
+                {
+                    matcher.flags[s] &= (uint8_t)~STATE_UNIVERSAL;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+typedef struct
+{
+    const token_list_t *list;
+    size_t              words;
+    uint64_t           *sets;
+    uint32_t           *buckets;
+    size_t              bucket_mask;
+} subset_table_t;
+
+// Returns the DFA state for an NFA position set, creating it when new; UINT32_MAX once the state cap is reached.
+static uint32_t intern(subset_table_t *table, const uint64_t *set)
+{
+    size_t  words = table->words;
+    size_t  b = hash_set(set, words) & table->bucket_mask;
+    size_t  id;
+    uint8_t flags = STATE_DEAD;
+
+    while (table->buckets[b] != UINT32_MAX)
+    {
+        if (memcmp(table->sets + table->buckets[b] * words, set, words * sizeof(uint64_t)) == 0)
+            return table->buckets[b];
+        b = (b + 1) & table->bucket_mask;
+    }
+
+    if (matcher.state_count == EXCLUDE_MAX_DFA_STATES)
+        return UINT32_MAX;
+
+    id = matcher.state_count++;
+    memcpy(table->sets + id * words, set, words * sizeof(uint64_t));
+    table->buckets[b] = (uint32_t)id;
+
+    for (size_t i = 0; i < table->list->count; i++)
+    {
+        if (set[i >> 6] >> (i & 63) & 1)
+        {
+            flags &= (uint8_t)~STATE_DEAD;
+            if (table->list->tokens[i].kind == TOKEN_END)
+                flags |= STATE_ACCEPT;
+        }
+    }
+    matcher.flags[id] = flags;
+
+    return (uint32_t)id;
+}
+
+// Subset construction over the combined NFA; gives up past EXCLUDE_MAX_DFA_STATES.
+static bool build_dfa(const token_list_t *list, const size_t starts[], size_t start_count)
+{
+    subset_table_t table;
+    size_t         bucket_count = 1;
+    unsigned char  reps[256];
+    uint64_t      *scratch;
+    bool           ok = true;
+
+    while (bucket_count < 2 * EXCLUDE_MAX_DFA_STATES)
+        bucket_count *= 2;
+
+    table.list = list;
+    table.words = list->count / 64 + 1;
+    table.sets = safe_malloc(EXCLUDE_MAX_DFA_STATES * table.words * sizeof(uint64_t));
+    table.buckets = safe_malloc(bucket_count * sizeof(uint32_t));
+    table.bucket_mask = bucket_count - 1;
+    memset(table.buckets, 0xff, bucket_count * sizeof(uint32_t));
+
+    for (int c = 255; c >= 0; c--)
+        reps[matcher.classes[c]] = (unsigned char)c;
+
+    matcher.next = safe_malloc(EXCLUDE_MAX_DFA_STATES * matcher.class_count * sizeof(uint32_t));
+    matcher.flags = safe_malloc(EXCLUDE_MAX_DFA_STATES);
+    matcher.state_count = 0;
+
+    scratch = safe_malloc(table.words * sizeof(uint64_t));
+    memset(scratch, 0, table.words * sizeof(uint64_t));
+    for (size_t i = 0; i < start_count; i++)
+        scratch[starts[i] >> 6] |= 1ULL << (starts[i] & 63);
+    closure(list, scratch);
+    intern(&table, scratch);
+
+    for (size_t s = 0; s < matcher.state_count && ok; s++)
+    {
+        for (size_t c = 0; c < matcher.class_count && ok; c++)
+        {
+            step(list, table.sets + s * table.words, reps[c], scratch, table.words);
+
+            uint32_t target = intern(&table, scratch);
+
+            ok = target != UINT32_MAX;
+            matcher.next[s * matcher.class_count + c] = target;
+        }
+    }
+
+    free(table.sets);
+    free(table.buckets);
+    free(scratch);
+
+    if (ok)
+        mark_universal();
+
+    return ok;
+}
+
+void exclude_clear(void)
+{
+    for (size_t i = 0; i < matcher.pattern_count; i++)
+        free(matcher.patterns[i]);
+
+    free(matcher.patterns);
+    free(matcher.next);
+    free(matcher.flags);
+    memset(&matcher, 0, sizeof(matcher));
+}
+
+void exclude_add(const char *pattern)
+{
+    matcher.patterns = safe_realloc(matcher.patterns, (matcher.pattern_count + 1) * sizeof(char *));
+    matcher.patterns[matcher.pattern_count++] = safe_strdup(pattern);
+    matcher.compiled = false;
+}
+
+// Until this succeeds, path_excluded() falls back to one fnmatch() per pattern and no subtree is pruned.
+void exclude_compile(void)
+{
+    token_list_t list = {0};
+    size_t      *starts = safe_malloc((matcher.pattern_count ? matcher.pattern_count : 1) * sizeof(size_t));
+    bool         ok = true;
+
+    free(matcher.next);
+    free(matcher.flags);
+    matcher.next = NULL;
+    matcher.flags = NULL;
+    matcher.compiled = false;
+
+    for (size_t i = 0; i < matcher.pattern_count && ok; i++)
+    {
+        starts[i] = list.count;
+        ok = tokenize(matcher.patterns[i], &list);
+    }
+
+    if (!ok)
+    {
+        log_message(LOG_WARNING, "Exclusion patterns use unsupported bracket syntax; matching them without subtree pruning");
+    }
+    else
+    {
+        build_classes(&list);
+        ok = build_dfa(&list, starts, matcher.pattern_count);
+
+        if (!ok)
+        {
+            log_message(LOG_WARNING, "Exclusion patterns need more than %d DFA states; matching them without subtree pruning",
+                        EXCLUDE_MAX_DFA_STATES);
+            free(matcher.next);
+            free(matcher.flags);
+            matcher.next = NULL;
+            matcher.flags = NULL;
+        }
+    }
+
+    matcher.compiled = ok;
+
+    free(list.tokens);
+    free(starts);
+}
+
+static uint32_t run(uint32_t state, const char *s)
+{
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++)
+    {
+        if (matcher.flags[state] & (STATE_UNIVERSAL | STATE_DEAD))
+            break;
+
+        state = matcher.next[state * matcher.class_count + matcher.classes[*p]];
+    }
+
+    return state;
+}
+
+bool path_excluded(const char *path)
+{
+    if (!matcher.compiled)
+    {
+        for (size_t i = 0; i < matcher.pattern_count; i++)
+        {
+            if (fnmatch(matcher.patterns[i], path, 0) == 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    return matcher.flags[run(0, path)] & STATE_ACCEPT;
+}
+
+// Children are joined as "dir/name", so the subtree is pruned when every continuation of "dir/" is excluded.
+bool subtree_excluded(const char *dir_path)
+{
+    if (!matcher.compiled)
+        return false;
+
+    return matcher.flags[run(run(0, dir_path), "/")] & STATE_UNIVERSAL;
+}
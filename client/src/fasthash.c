@@ -0,0 +1,60 @@
+#include "fasthash.h"
+#include "logging.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// XXH3-128 is compiled straight into this unit; its accumulate loop picks the widest SIMD kernel the build targets.
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+struct fasthash
+{
+    XXH3_state_t *state;
+};
+
+fasthash_t *fasthash_new(void)
+{
+    fasthash_t *hash = safe_malloc(sizeof(fasthash_t));
+
+    hash->state = XXH3_createState();
+    if (!hash->state || XXH3_128bits_reset(hash->state) != XXH_OK)
+    {
+        log_message(LOG_ERR, "Failed to initialize XXH3 state");
+        XXH3_freeState(hash->state);
+        free(hash);
+        return NULL;
+    }
+
+    return hash;
+}
+
+void fasthash_update(fasthash_t *hash, const void *data, size_t len)
+{
+    XXH3_128bits_update(hash->state, data, len);
+}
+
+void fasthash_final(fasthash_t *hash, unsigned char digest[FAST_DIGEST_LENGTH])
+{
+    XXH128_canonical_t canonical;
+
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(hash->state));
+    memcpy(digest, canonical.digest, FAST_DIGEST_LENGTH);
+}
+
+void fasthash_free(fasthash_t *hash)
+{
+    if (!hash)
+        return;
+
+    XXH3_freeState(hash->state);
+    free(hash);
+}
+
+void fasthash_buffer(const void *data, size_t len, unsigned char digest[FAST_DIGEST_LENGTH])
+{
+    XXH128_canonical_t canonical;
+
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits(data, len));
+    memcpy(digest, canonical.digest, FAST_DIGEST_LENGTH);
+}
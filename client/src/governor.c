@@ -0,0 +1,206 @@
+#include "governor.h"
+#include "config.h"
+#include "logging.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define NSEC_PER_SEC 1000000000ULL
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define ADAPT_INTERVAL_NS (100 * 1000000ULL)
+
+// Token bucket holding at most one second of budget; a caller may drive it into debt and then waits it off.
+typedef struct
+{
+    double   rate; // tokens per second, 0 = unlimited
+    double   tokens;
+    uint64_t stamp_ns;
+} bucket_t;
+
+static pthread_mutex_t governor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bucket_t        byte_bucket = {GOVERNOR_BYTES_PER_SEC, GOVERNOR_BYTES_PER_SEC, 0};
+static bucket_t        file_bucket = {GOVERNOR_FILES_PER_SEC, GOVERNOR_FILES_PER_SEC, 0};
+static double          latency_ewma = 0; // read service time, ns per MiB
+static uint64_t        last_adapt_ns = 0;
+
+static uint64_t             check_start_ns = 0;
+static uint64_t             check_start_cpu_ns = 0;
+static atomic_uint_fast64_t paced_ns;
+static atomic_uint_fast64_t bytes_read;
+static atomic_uint_fast64_t files_admitted;
+static atomic_bool          cpu_overrun;
+
+static _Thread_local uint64_t last_thread_cpu_ns = 0;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t governor_clock_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+static void pause_for(uint64_t ns)
+{
+    struct timespec ts = {.tv_sec = (time_t)(ns / NSEC_PER_SEC), .tv_nsec = (long)(ns % NSEC_PER_SEC)};
+
+    if (ns == 0)
+        return;
+
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+
+    atomic_fetch_add(&paced_ns, ns);
+}
+
+// Returns how long the caller has to wait until the amount it just took is covered.
+static uint64_t take(bucket_t *bucket, double amount, uint64_t now)
+{
+    if (bucket->rate <= 0)
+        return 0;
+
+    if (bucket->stamp_ns != 0)
+        bucket->tokens += (double)(now - bucket->stamp_ns) * bucket->rate / (double)NSEC_PER_SEC;
+    bucket->stamp_ns = now;
+
+    if (bucket->tokens > bucket->rate)
+        bucket->tokens = bucket->rate;
+
+    bucket->tokens -= amount;
+
+    return bucket->tokens >= 0 ? 0 : (uint64_t)(-bucket->tokens / bucket->rate * (double)NSEC_PER_SEC);
+}
+
+// AIMD on the byte budget: reads slower than GOVERNOR_TARGET_LATENCY_MS per MiB mean the device is contended, so the
+// rate halves (down to a sixteenth of the budget); otherwise it climbs back by a sixteenth per interval.
+static void adapt(size_t bytes, uint64_t service_ns, uint64_t now)
+{
+    const double ceiling = GOVERNOR_BYTES_PER_SEC;
+    double       per_mib = (double)service_ns * (1024.0 * 1024.0) / (double)bytes;
+
+    latency_ewma = latency_ewma <= 0 ? per_mib : latency_ewma * 0.875 + per_mib * 0.125;
+
+    if (now - last_adapt_ns < ADAPT_INTERVAL_NS)
+        return;
+    last_adapt_ns = now;
+
+    if (latency_ewma > GOVERNOR_TARGET_LATENCY_MS * 1e6)
+        byte_bucket.rate = byte_bucket.rate / 2 > ceiling / 16 ? byte_bucket.rate / 2 : ceiling / 16;
+    else
+        byte_bucket.rate = byte_bucket.rate + ceiling / 16 < ceiling ? byte_bucket.rate + ceiling / 16 : ceiling;
+}
+
+// Past the CPU cap of a check, each thread sleeps as long as it last computed, halving its duty cycle.
+static void pace_cpu(void)
+{
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t spent = last_thread_cpu_ns ? cpu - last_thread_cpu_ns : 0;
+
+    last_thread_cpu_ns = cpu;
+
+    if (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - check_start_cpu_ns <= GOVERNOR_CPU_MS_PER_CHECK * 1000000ULL)
+        return;
+
+    atomic_store(&cpu_overrun, true);
+    pause_for(spent < NSEC_PER_SEC ? spent : NSEC_PER_SEC);
+}
+
+void governor_enter_worker(void)
+{
+    if (!GOVERNOR_IDLE_PRIORITY)
+        return;
+
+#ifdef __linux__
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == -1)
+        log_message(LOG_WARNING, "Failed to switch hashing worker to SCHED_IDLE: %s", strerror(errno));
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+        log_message(LOG_WARNING, "Failed to switch hashing worker to idle I/O priority: %s", strerror(errno));
+#endif
+}
+
+void governor_begin_check(void)
+{
+    check_start_ns = clock_ns(CLOCK_MONOTONIC);
+    check_start_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    atomic_store(&paced_ns, 0);
+    atomic_store(&bytes_read, 0);
+    atomic_store(&files_admitted, 0);
+    atomic_store(&cpu_overrun, false);
+}
+
+// A check that had to be paced or that exceeded its CPU cap is reported, so budgets can be tuned.
+void governor_end_check(void)
+{
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - check_start_ns;
+    uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - check_start_cpu_ns;
+    uint64_t paced = atomic_load(&paced_ns);
+
+    if (paced == 0 && !atomic_load(&cpu_overrun))
+        return;
+
+    log_message(LOG_WARNING, "Integrity check overran its budget: %llu bytes from %llu files in %.1f s using %llu ms CPU%s; paced for %.1f s",
+                (unsigned long long)atomic_load(&bytes_read), (unsigned long long)atomic_load(&files_admitted),
+                (double)wall / NSEC_PER_SEC, (unsigned long long)(cpu / 1000000),
+                atomic_load(&cpu_overrun) ? " (over the CPU cap)" : "", (double)paced / NSEC_PER_SEC);
+}
+
+// Called before a file or directory is opened.
+void governor_admit_file(void)
+{
+    uint64_t wait = 0;
+
+    atomic_fetch_add(&files_admitted, 1);
+
+    if (GOVERNOR_FILES_PER_SEC > 0)
+    {
+        pthread_mutex_lock(&governor_mutex);
+        wait = take(&file_bucket, 1, clock_ns(CLOCK_MONOTONIC));
+        pthread_mutex_unlock(&governor_mutex);
+    }
+
+    pause_for(wait);
+
+    if (GOVERNOR_CPU_MS_PER_CHECK > 0)
+        pace_cpu();
+}
+
+// Called after each chunk is read; service_ns is the time the read itself took, or 0 when it was not measured.
+void governor_account_read(size_t bytes, uint64_t service_ns)
+{
+    uint64_t wait = 0;
+
+    atomic_fetch_add(&bytes_read, bytes);
+
+    if (GOVERNOR_BYTES_PER_SEC > 0 && bytes > 0)
+    {
+        uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+        pthread_mutex_lock(&governor_mutex);
+        if (service_ns > 0)
+            adapt(bytes, service_ns, now);
+        wait = take(&byte_bucket, (double)bytes, now);
+        pthread_mutex_unlock(&governor_mutex);
+    }
+
+    pause_for(wait);
+}
@@ -1,200 +1,1602 @@
 #include "hashing.h"
+#include "baseline.h"
+#include "arena.h"
 #include "config.h"
+#include "device.h"
+#include "digest.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "fasthash.h"
+#include "governor.h"
+#include "inodememo.h"
+#include "io_backend.h"
+#include "linediff.h"
 #include "logging.h"
+#include "lthash.h"
+#include "merkle.h"
+#include "metrics.h"
 #include "parser.h"
+#include "sha256_batch.h"
+#include "threadpool.h"
 #include "utils.h"
 #include <dirent.h>
-#include <fnmatch.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-static const char *exclude_patterns[] =
+// Set while re-hashing entries after change events; full sweeps never trust cached subtrees.
+static bool trust_merkle = false;
+
+int binary_to_hex(const unsigned char *digest, unsigned int len, char *out_hex)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned int i = 0; i < len; i++)
+    {
+        out_hex[i * 2] = hex[(digest[i] >> 4) & 0xF];
+        out_hex[i * 2 + 1] = hex[digest[i] & 0xF];
+    }
+    out_hex[len * 2] = '\0';
+
+    return 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+int hex_to_binary(const char *hex, unsigned char *digest, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; i++)
+    {
+        int hi = hex_value(hex[i * 2]);
+        int lo = hi < 0 ? -1 : hex_value(hex[i * 2 + 1]);
+
+        if (lo < 0)
+            return -1;
+
+        digest[i] = (unsigned char)((hi << 4) | lo);
+    }
+
+    return 0;
+}
+
+// FIM_DIGEST_FORMAT 1 digests a file as SHA-256(path || metadata || content) in one pass. Format 2 seals the content
+// digest instead, SHA-256(path || metadata || SHA-256(content)), so content that did not change keeps its SHA-256
+// across metadata changes, which the prefilter relies on. In format 1 the baseline holds file digests, and the inode
+// memo, whose digests must not depend on the path, shares small contents instead. Tree and append entries always seal a
+// content digest.
+_Static_assert(FIM_DIGEST_FORMAT == 1 || FIM_DIGEST_FORMAT == 2, "unknown FIM_DIGEST_FORMAT");
+_Static_assert(!FIM_FAST_PREFILTER || FIM_DIGEST_FORMAT == 2, "FIM_FAST_PREFILTER needs FIM_DIGEST_FORMAT 2");
+
+// Size of the metadata a file digest starts with: path, mode, size, mtime, ctime, uid and gid.
+static size_t metadata_size(const char *path)
+{
+    return strlen(path) + sizeof(mode_t) + sizeof(off_t) + 2 * sizeof(time_t) + sizeof(uid_t) + sizeof(gid_t);
+}
+
+// Size of a sealed record: the metadata, then the content digest.
+static size_t seal_size(const char *path)
+{
+    return metadata_size(path) + SHA256_DIGEST_LENGTH;
+}
+
+static void append(unsigned char **out, const void *data, size_t len)
+{
+    memcpy(*out, data, len);
+    *out += len;
+}
+
+static unsigned char *build_metadata(const char *path, const struct stat *st, unsigned char *out)
+{
+    append(&out, path, strlen(path));
+    append(&out, &st->st_mode, sizeof(st->st_mode));
+    append(&out, &st->st_size, sizeof(st->st_size));
+    append(&out, &st->st_mtime, sizeof(st->st_mtime));
+    append(&out, &st->st_ctime, sizeof(st->st_ctime));
+    append(&out, &st->st_uid, sizeof(st->st_uid));
+    append(&out, &st->st_gid, sizeof(st->st_gid));
+
+    return out;
+}
+
+static void build_seal(const char *path, const struct stat *st, const unsigned char content[SHA256_DIGEST_LENGTH],
+                       unsigned char *out)
+{
+    out = build_metadata(path, st, out);
+    append(&out, content, SHA256_DIGEST_LENGTH);
+}
+
+// Starts a format-1 file digest; the content follows.
+static void update_metadata(EVP_MD_CTX *ctx, const char *path, const struct stat *st)
+{
+    EVP_DigestUpdate(ctx, path, strlen(path));
+    EVP_DigestUpdate(ctx, &st->st_mode, sizeof(st->st_mode));
+    EVP_DigestUpdate(ctx, &st->st_size, sizeof(st->st_size));
+    EVP_DigestUpdate(ctx, &st->st_mtime, sizeof(st->st_mtime));
+    EVP_DigestUpdate(ctx, &st->st_ctime, sizeof(st->st_ctime));
+    EVP_DigestUpdate(ctx, &st->st_uid, sizeof(st->st_uid));
+    EVP_DigestUpdate(ctx, &st->st_gid, sizeof(st->st_gid));
+}
+
+typedef struct
+{
+    EVP_MD_CTX    *sha256;
+    fasthash_t    *fast;
+    unsigned char *keep; // format 1: a copy of the content for the inode memo
+    size_t         keep_size;
+    size_t         kept; // past keep_size when the file outgrew its stat
+} content_hash_t;
+
+static void content_consume(const unsigned char *buf, size_t len, void *arg)
+{
+    content_hash_t *hash = arg;
+
+    if (hash->sha256)
+        EVP_DigestUpdate(hash->sha256, buf, len);
+    if (hash->fast)
+        fasthash_update(hash->fast, buf, len);
+    if (hash->keep)
+    {
+        if (hash->kept <= hash->keep_size && len <= hash->keep_size - hash->kept)
+            memcpy(hash->keep + hash->kept, buf, len);
+        hash->kept += len;
+    }
+}
+
+// Format-1 file digests cover the path, so the inode memo is given the content of a small file instead.
+static void keep_content(content_hash_t *hash, const struct stat *st)
+{
+    if (FIM_DIGEST_FORMAT == 1 && S_ISREG(st->st_mode) && st->st_size <= INODE_MEMO_CONTENT_MAX)
+    {
+        hash->keep_size = (size_t)st->st_size;
+        hash->keep = safe_malloc(hash->keep_size ? hash->keep_size : 1);
+    }
+}
+
+static void store_kept(content_hash_t *hash, const struct stat *st)
+{
+    if (hash->keep)
+        inode_memo_store_content(st, hash->keep, hash->kept);
+}
+
+// A format-1 file digest from the content another path of the inode read during the check: this path's metadata,
+// then the memo's copy. Waits while another thread is reading the inode; on a miss the caller holds the claim.
+static bool shared_file_digest(const char *path, const struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    EVP_MD_CTX    *ctx;
+    unsigned char *data;
+    size_t         len;
+
+    if (!inode_memo_acquire_content(st, &data, &len))
+        return false;
+
+    ctx = digest_acquire();
+    if (ctx)
+    {
+        update_metadata(ctx, path, st);
+        EVP_DigestUpdate(ctx, data, len);
+        EVP_DigestFinal_ex(ctx, digest, NULL);
+    }
+
+    digest_release(ctx);
+    free(data);
+
+    return ctx != NULL;
+}
+
+// Reads the content once, feeding whichever of the SHA-256 and XXH3-128 digests the caller asked for. With metadata the
+// SHA-256 is the format-1 file digest rather than the content's, and a small file's content goes to the inode memo.
+static int hash_file_contents(int dir_fd, const char *name, const char *path, const struct stat *st, bool metadata,
+                              unsigned char sha256[SHA256_DIGEST_LENGTH], unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    content_hash_t hash = {0};
+    int            rc = -1;
+
+    if (sha256)
+        hash.sha256 = digest_acquire();
+    if (fast)
+        hash.fast = fasthash_new();
+    if (metadata && hash.sha256)
+    {
+        update_metadata(hash.sha256, path, st);
+        keep_content(&hash, st);
+    }
+
+    if ((!sha256 || hash.sha256) && (!fast || hash.fast) && io_read_file_at(dir_fd, name, path, st, content_consume, &hash) == 0)
+    {
+        if (sha256)
+            EVP_DigestFinal_ex(hash.sha256, sha256, NULL);
+        if (fast)
+            fasthash_final(hash.fast, fast);
+        store_kept(&hash, st);
+        rc = 0;
+    }
+
+    digest_release(hash.sha256);
+    fasthash_free(hash.fast);
+    free(hash.keep);
+
+    return rc;
+}
+
+#define TREE_HASH_TAG "heimdall-tree-sha256"
+
+typedef struct
+{
+    int           fd;
+    off_t         offset;
+    size_t        length;
+    size_t        read;
+    EVP_MD_CTX   *sha256;
+    bool          ok;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    task_group_t *group;
+} tree_chunk_t;
+
+static void chunk_consume(const unsigned char *buf, size_t len, void *arg)
+{
+    tree_chunk_t *chunk = arg;
+
+    EVP_DigestUpdate(chunk->sha256, buf, len);
+    chunk->read += len;
+}
+
+static void run_tree_chunk(void *arg)
+{
+    static const unsigned char leaf = 0x00;
+    tree_chunk_t              *chunk = arg;
+
+    chunk->sha256 = digest_acquire();
+    chunk->ok = chunk->sha256 && EVP_DigestUpdate(chunk->sha256, &leaf, 1) == 1 &&
+                io_read_range(chunk->fd, chunk->offset, chunk->length, chunk_consume, chunk) == 0 &&
+                chunk->read == chunk->length && EVP_DigestFinal_ex(chunk->sha256, chunk->digest, NULL) == 1;
+    digest_release(chunk->sha256);
+
+    task_group_done(chunk->group);
+}
+
+static int tree_node(const unsigned char left[SHA256_DIGEST_LENGTH], const unsigned char right[SHA256_DIGEST_LENGTH],
+                     unsigned char out[SHA256_DIGEST_LENGTH])
+{
+    unsigned char node[1 + 2 * SHA256_DIGEST_LENGTH];
+
+    node[0] = 0x01;
+    memcpy(node + 1, left, SHA256_DIGEST_LENGTH);
+    memcpy(node + 1 + SHA256_DIGEST_LENGTH, right, SHA256_DIGEST_LENGTH);
+
+    return digest_sha256_buffer(node, sizeof(node), out);
+}
+
+// Content digest of a large file, hashed as FIM_TREE_HASH_CHUNK_SIZE chunks across the pool. Leaves are
+// SHA-256(0x00 || chunk) and inner nodes SHA-256(0x01 || left || right), an odd node moving up unchanged (the RFC 6962
+// shape); the root is bound to the chunk and file sizes under TREE_HASH_TAG, so it never equals a plain SHA-256.
+static int tree_hash_file(int dir_fd, const char *name, const char *path, const struct stat *st,
+                          unsigned char content[SHA256_DIGEST_LENGTH])
+{
+    const size_t  chunk_size = FIM_TREE_HASH_CHUNK_SIZE;
+    size_t        size = (size_t)st->st_size;
+    size_t        count = (size + chunk_size - 1) / chunk_size;
+    tree_chunk_t *chunks;
+    task_group_t  group;
+    int           fd;
+    int           rc = 0;
+
+    fd = io_open_file_at(dir_fd, name);
+    if (fd == -1)
+    {
+        log_message(LOG_ERR, "Error opening file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    chunks = safe_malloc(count * sizeof(tree_chunk_t));
+    task_group_init(&group);
+    task_group_add(&group, count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        memset(&chunks[i], 0, sizeof(tree_chunk_t));
+        chunks[i].fd = fd;
+        chunks[i].offset = (off_t)(i * chunk_size);
+        chunks[i].length = size - i * chunk_size < chunk_size ? size - i * chunk_size : chunk_size;
+        chunks[i].group = &group;
+        threadpool_submit(run_tree_chunk, &chunks[i]);
+    }
+
+    task_group_wait(&group);
+    task_group_destroy(&group);
+    close(fd);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!chunks[i].ok)
+        {
+            log_message(LOG_ERR, "Error reading file %s: chunk at offset %lld is unreadable or short", path,
+                        (long long)chunks[i].offset);
+            free(chunks);
+            return -1;
+        }
+    }
+
+    // Each level is folded in place: node i only reads nodes 2i and 2i + 1.
+    for (size_t width = count; width > 1 && rc == 0; width = (width + 1) / 2)
+    {
+        for (size_t i = 0; i < width / 2 && rc == 0; i++)
+            rc = tree_node(chunks[2 * i].digest, chunks[2 * i + 1].digest, chunks[i].digest);
+
+        if (width % 2)
+            memcpy(chunks[width / 2].digest, chunks[width - 1].digest, SHA256_DIGEST_LENGTH);
+    }
+
+    if (rc == 0)
+    {
+        unsigned char record[sizeof(TREE_HASH_TAG) + 16 + SHA256_DIGEST_LENGTH];
+        uint64_t      sizes[2] = {chunk_size, size};
+
+        memcpy(record, TREE_HASH_TAG, sizeof(TREE_HASH_TAG));
+        for (size_t i = 0; i < 16; i++)
+            record[sizeof(TREE_HASH_TAG) + i] = (unsigned char)(sizes[i / 8] >> (56 - 8 * (i % 8)));
+        memcpy(record + sizeof(TREE_HASH_TAG) + 16, chunks[0].digest, SHA256_DIGEST_LENGTH);
+
+        rc = digest_sha256_buffer(record, sizeof(record), content);
+    }
+
+    free(chunks);
+
+    return rc;
+}
+
+// The file digest binds the metadata to the content digest, so content that did not change keeps its stored SHA-256.
+static int seal_file_digest(const char *path, const struct stat *st, const unsigned char content[SHA256_DIGEST_LENGTH], unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    size_t         size = seal_size(path);
+    unsigned char *record = safe_malloc(size);
+    int            rc;
+
+    build_seal(path, st, content, record);
+    rc = digest_sha256_buffer(record, size, digest);
+    *len = SHA256_DIGEST_LENGTH;
+    free(record);
+
+    return rc;
+}
+
+// The reported digest of a plain file from what the baseline holds for it: the file digest itself in format 1, the
+// content digest to seal in format 2.
+static int file_digest(const char *path, const struct stat *st, const unsigned char stored[SHA256_DIGEST_LENGTH],
+                       unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    if (FIM_DIGEST_FORMAT == 2)
+        return seal_file_digest(path, st, stored, len, digest);
+
+    memcpy(digest, stored, SHA256_DIGEST_LENGTH);
+    *len = SHA256_DIGEST_LENGTH;
+
+    return 0;
+}
+
+// True when changed-stat content still has its recorded XXH3-128, so the stored SHA-256 stands.
+static bool prefilter_hit(baseline_match_t match, const unsigned char fast[FAST_DIGEST_LENGTH], const unsigned char stored_fast[FAST_DIGEST_LENGTH])
+{
+    return FIM_FAST_PREFILTER && match == BASELINE_STALE && !baseline_audit_cycle() &&
+           memcmp(fast, stored_fast, FAST_DIGEST_LENGTH) == 0;
+}
+
+static void audit_content(const char *path, baseline_match_t match, const unsigned char fast[FAST_DIGEST_LENGTH], const unsigned char stored_fast[FAST_DIGEST_LENGTH],
+                          const unsigned char content[SHA256_DIGEST_LENGTH], const unsigned char previous[SHA256_DIGEST_LENGTH])
+{
+    if (FIM_FAST_PREFILTER && match == BASELINE_STALE && baseline_audit_cycle() &&
+        memcmp(fast, stored_fast, FAST_DIGEST_LENGTH) == 0 && memcmp(content, previous, SHA256_DIGEST_LENGTH) != 0)
+        log_message(LOG_WARNING, "Audit: %s kept its XXH3-128 digest but its SHA-256 changed", path);
+}
+
+// Tree digests skip the prefilter, which would need a serial read, and the inode memo, which holds plain digests.
+// Holding no memo claim also keeps the wait on the chunk tasks safe.
+static int hash_file_tree(int dir_fd, const char *name, const char *path, const struct stat *st, unsigned int *len,
+                          unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    unsigned char content[SHA256_DIGEST_LENGTH];
+    uint64_t      start;
+
+    if (baseline_lookup_tree(path, st, content) == BASELINE_MATCH)
+    {
+        metrics_count(METRIC_FILES_UNCHANGED, 1);
+    }
+    else
+    {
+        start = governor_clock_ns();
+        if (tree_hash_file(dir_fd, name, path, st, content) != 0)
+        {
+            metrics_count(METRIC_FILE_ERRORS, 1);
+            return -1;
+        }
+        metrics_file_hashed(path, (uint64_t)st->st_size, governor_clock_ns() - start);
+
+        baseline_update_tree(path, st, content);
+    }
+
+    return seal_file_digest(path, st, content, len, digest);
+}
+
+typedef struct
+{
+    sha256_stream_t *stream;
+    uint64_t         position;
+    uint64_t         checkpoint; // last FIM_APPEND_BLOCK_SIZE boundary of the file
+    unsigned char    window[FIM_APPEND_BLOCK_SIZE];
+    append_point_t  *next;
+    bool             captured;
+} append_state_t;
+
+typedef struct
+{
+    unsigned char block[FIM_APPEND_BLOCK_SIZE];
+    size_t        read;
+} append_block_t;
+
+static void block_consume(const unsigned char *buf, size_t len, void *arg)
+{
+    append_block_t *block = arg;
+
+    memcpy(block->block + block->read, buf, len);
+    block->read += len;
+}
+
+// The midstate is taken exactly at the checkpoint, and the block ending there is kept to fingerprint it.
+static void append_consume(const unsigned char *buf, size_t len, void *arg)
+{
+    append_state_t *state = arg;
+    uint64_t        window_start = state->checkpoint - FIM_APPEND_BLOCK_SIZE;
+
+    while (len > 0)
+    {
+        size_t take = len;
+
+        if (state->position < state->checkpoint && state->position + take > state->checkpoint)
+            take = (size_t)(state->checkpoint - state->position);
+
+        if (state->position < state->checkpoint && state->position + take > window_start)
+        {
+            uint64_t from = state->position > window_start ? state->position : window_start;
+
+            memcpy(state->window + (from - window_start), buf + (from - state->position),
+                   (size_t)(state->position + take - from));
+        }
+
+        sha256_stream_update(state->stream, buf, take);
+        state->position += take;
+        buf += take;
+        len -= take;
+
+        if (state->position == state->checkpoint)
+            state->captured = sha256_stream_midstate(state->stream, &state->next->midstate);
+    }
+}
+
+// True when the block before the resume point reads as it did when the point was saved.
+static bool prefix_intact(int fd, const append_point_t *from)
+{
+    append_block_t block = {0};
+    unsigned char  fingerprint[FAST_DIGEST_LENGTH];
+
+    if (io_read_range(fd, (off_t)(from->midstate.length - FIM_APPEND_BLOCK_SIZE), FIM_APPEND_BLOCK_SIZE, block_consume,
+                      &block) != 0 || block.read != FIM_APPEND_BLOCK_SIZE)
+        return false;
+
+    fasthash_buffer(block.block, FIM_APPEND_BLOCK_SIZE, fingerprint);
+
+    return memcmp(fingerprint, from->fingerprint, FAST_DIGEST_LENGTH) == 0;
+}
+
+// Plain SHA-256 of a file, continued from a saved resume point when the block before it is unchanged and hashed from
+// the start otherwise. next receives the point at the file's last block boundary; *captured is false when there is
+// none, because the low-level SHA-256 API is unavailable or the file is smaller than one block.
+static int append_hash_file(int dir_fd, const char *name, const char *path, const struct stat *st,
+                            const append_point_t *from, unsigned char content[SHA256_DIGEST_LENGTH],
+                            append_point_t *next, bool *captured, uint64_t *hashed)
+{
+    append_state_t *state;
+    uint64_t        size = (uint64_t)st->st_size;
+    int             fd;
+    int             rc = 0;
+
+    fd = io_open_file_at(dir_fd, name);
+    if (fd == -1)
+    {
+        log_message(LOG_ERR, "Error opening file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    state = safe_malloc(sizeof(append_state_t));
+    memset(state, 0, sizeof(append_state_t));
+    state->checkpoint = size - size % FIM_APPEND_BLOCK_SIZE;
+    state->next = next;
+
+    if (from && (from->midstate.length < FIM_APPEND_BLOCK_SIZE || from->midstate.length % FIM_APPEND_BLOCK_SIZE != 0))
+    {
+        from = NULL;
+    }
+    else if (from && from->midstate.length > size)
+    {
+        log_message(LOG_INFO, "%s was truncated below its resume point; hashing it in full", path);
+        from = NULL;
+    }
+    else if (from && !prefix_intact(fd, from))
+    {
+        log_message(LOG_WARNING, "%s was rewritten, not appended to; hashing it in full", path);
+        from = NULL;
+    }
+
+    state->stream = sha256_stream_new(from ? &from->midstate : NULL);
+    if (!state->stream)
+    {
+        close(fd);
+        free(state);
+        *captured = false;
+        *hashed = size;
+        return hash_file_contents(dir_fd, name, path, st, false, content, NULL);
+    }
+
+    state->position = from ? from->midstate.length : 0;
+    *hashed = size - state->position;
+
+    errno = 0;
+    if (io_read_range(fd, (off_t)state->position, (size_t)*hashed, append_consume, state) != 0 ||
+        state->position != size)
+    {
+        log_message(LOG_ERR, "Error reading file %s: %s", path, errno ? strerror(errno) : "file shrank while reading");
+        rc = -1;
+    }
+
+    sha256_stream_final(state->stream, content);
+    close(fd);
+
+    // No new block boundary was crossed: the saved point still marks the last one.
+    if (from && state->checkpoint == from->midstate.length)
+    {
+        *next = *from;
+        *captured = true;
+    }
+    else
+    {
+        *captured = state->captured && state->checkpoint > 0;
+        if (*captured)
+            fasthash_buffer(state->window, FIM_APPEND_BLOCK_SIZE, next->fingerprint);
+    }
+
+    free(state);
+
+    return rc;
+}
+
+// Append mode skips the prefilter, whose XXH3-128 would need the whole file, and the inode memo, which has no resume
+// points to share.
+static int hash_file_append(int dir_fd, const char *name, const char *path, const struct stat *st, unsigned int *len,
+                            unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    unsigned char    content[SHA256_DIGEST_LENGTH];
+    append_point_t   from;
+    append_point_t   next;
+    baseline_match_t match = baseline_lookup_append(path, st, content, &from);
+    bool             captured;
+    uint64_t         hashed;
+    uint64_t         start;
+
+    if (match == BASELINE_MATCH)
+    {
+        metrics_count(METRIC_FILES_UNCHANGED, 1);
+        return seal_file_digest(path, st, content, len, digest);
+    }
+
+    start = governor_clock_ns();
+    if (append_hash_file(dir_fd, name, path, st, match == BASELINE_STALE ? &from : NULL, content, &next, &captured,
+                         &hashed) != 0)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        return -1;
+    }
+    metrics_file_hashed(path, hashed, governor_clock_ns() - start);
+
+    baseline_update_append(path, st, content, captured ? &next : NULL);
+
+    return seal_file_digest(path, st, content, len, digest);
+}
+
+// Reuses the baseline content digest when the stat tuple is unchanged since it was recorded. With FIM_FAST_PREFILTER
+// a changed stat tuple is first checked with XXH3-128, and SHA-256 only runs when that differs or on audit cycles.
+static int hash_file_stat(int dir_fd, const char *name, const char *path, const struct stat *st, bool tree,
+                          bool append, unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    unsigned char    content[SHA256_DIGEST_LENGTH];
+    unsigned char    previous[SHA256_DIGEST_LENGTH];
+    unsigned char    stored_fast[FAST_DIGEST_LENGTH];
+    unsigned char    fast[FAST_DIGEST_LENGTH];
+    baseline_match_t match;
+    bool             need_fast = FIM_FAST_PREFILTER;
+    uint64_t         start;
+
+    metrics_count(METRIC_FILES_VISITED, 1);
+
+    if (tree && st->st_size >= FIM_TREE_HASH_MIN_SIZE)
+        return hash_file_tree(dir_fd, name, path, st, len, digest);
+
+    if (append && st->st_size >= FIM_APPEND_MIN_SIZE)
+        return hash_file_append(dir_fd, name, path, st, len, digest);
+
+    match = baseline_lookup(path, st, content, stored_fast);
+    if (match == BASELINE_MATCH)
+    {
+        metrics_count(METRIC_FILES_UNCHANGED, 1);
+        return file_digest(path, st, content, len, digest);
+    }
+
+    memcpy(previous, content, SHA256_DIGEST_LENGTH);
+
+    // Another path or entry already read this inode during the check; otherwise this thread claims it.
+    if (FIM_DIGEST_FORMAT == 1 ? shared_file_digest(path, st, content)
+                               : inode_memo_acquire(st, content, FIM_FAST_PREFILTER ? fast : NULL))
+    {
+        metrics_count(METRIC_FILES_SHARED, 1);
+        audit_content(path, match, fast, stored_fast, content, previous);
+        baseline_update(path, st, content, FIM_FAST_PREFILTER ? fast : NULL);
+        return file_digest(path, st, content, len, digest);
+    }
+
+    start = governor_clock_ns();
+
+    if (FIM_FAST_PREFILTER && match == BASELINE_STALE && !baseline_audit_cycle())
+    {
+        if (hash_file_contents(dir_fd, name, path, st, false, NULL, fast) != 0)
+        {
+            metrics_count(METRIC_FILE_ERRORS, 1);
+            inode_memo_release(st);
+            return -1;
+        }
+
+        // Only SHA-256 digests computed from the content are shared, not ones vouched for by XXH3-128.
+        if (prefilter_hit(match, fast, stored_fast))
+        {
+            metrics_file_hashed(path, (uint64_t)st->st_size, governor_clock_ns() - start);
+            inode_memo_release(st);
+            baseline_update(path, st, content, fast);
+            return file_digest(path, st, content, len, digest);
+        }
+
+        // The content changed; the SHA-256 pass usually finds it in the page cache.
+        need_fast = false;
+    }
+
+    if (hash_file_contents(dir_fd, name, path, st, FIM_DIGEST_FORMAT == 1, content, need_fast ? fast : NULL) != 0)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        inode_memo_release(st);
+        return -1;
+    }
+
+    metrics_file_hashed(path, (uint64_t)st->st_size, governor_clock_ns() - start);
+    audit_content(path, match, fast, stored_fast, content, previous);
+
+    baseline_update(path, st, content, FIM_FAST_PREFILTER ? fast : NULL);
+    if (FIM_DIGEST_FORMAT == 2)
+        inode_memo_store(st, content, FIM_FAST_PREFILTER ? fast : NULL);
+
+    return file_digest(path, st, content, len, digest);
+}
+
+static int hash_file_sha256(const char *path, bool tree, bool append, unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    struct stat st;
+
+    metrics_count(METRIC_STAT_CALLS, 1);
+    if (stat(path, &st) == -1)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_ERR, "Error reading metadata of %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return hash_file_stat(AT_FDCWD, path, path, &st, tree, append, len, digest);
+}
+
+int sha256_file(const char *path, char out_hex[HASH_HEX_LEN + 1])
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int  len;
+
+    if (hash_file_sha256(path, false, false, &len, digest) != 0)
+        return -1;
+
+    binary_to_hex(digest, len, out_hex);
+
+    return 0;
+}
+
+typedef struct dir_task dir_task_t;
+
+// Running LtHash of a multiset directory, which its partitions add themselves to as they complete.
+typedef struct
+{
+    lthash_t        sum;
+    pthread_mutex_t mutex;
+    task_group_t    partitions;
+    bool            failed;
+} dir_sum_t;
+
+// Names and paths point into the listing arena of the directory that holds them.
+typedef struct
+{
+    const char   *name;
+    const char   *path;
+    bool          is_dir;
+    bool          ok;
+    bool          skipped; // a directory cycle, or a directory removed since it was listed
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+} dir_child_t;
+
+// A directory node completes once every child task has reported; the last reporter folds the digests in sorted-name order.
+// Children are stat'ed and opened relative to its fd, which is closed as soon as the last of them has opened its entry,
+// so a deep chain holds only a few fds however long the subtree takes. A multiset directory is never listed whole: it
+// is read in partitions, nodes that borrow its fd and path, hash one slice of its entries like a small directory, and
+// add them to its sum.
+struct dir_task
+{
+    dir_task_t    *parent;
+    size_t         slot;
+    const char    *path;
+    const char    *name; // NULL for the root, which is opened by path
+    char          *owned_path;
+    int            fd;       // -1 once closed, or from the start past HASH_DIR_FD_BUDGET: children are reached by path
+    atomic_size_t  fd_users; // the node while it queues children, and each child task still opening its entry
+    dev_t          dev;
+    ino_t          ino;
+    dir_listing_t  listing;
+    dir_child_t   *children;
+    size_t         child_count;
+    atomic_size_t  pending;
+    int            status;
+    bool           cached;
+    bool           tree;      // inherited from the root: large files are tree-hashed
+    bool           append;    // inherited from the root: grown files resume from their saved midstate
+    bool           multiset;  // inherited from the root: the digest is an LtHash of the entries in any order
+    bool           partition; // a slice of the parent's entries, reporting into the parent's sum
+    dir_sum_t     *sum;
+    unsigned char  digest[SHA256_DIGEST_LENGTH];
+    task_group_t  *group;
+};
+
+typedef struct
+{
+    dir_task_t *parent;
+    size_t      slot;
+    struct stat st;
+} file_task_t;
+
+// Small regular files of one directory, read into memory and hashed together through sha256_batch().
+typedef struct
+{
+    dir_task_t *parent;
+    size_t      count;
+    size_t      slots[HASH_BATCH_FILES];
+    struct stat st[HASH_BATCH_FILES];
+} batch_task_t;
+
+static void finish_dir_task(dir_task_t *node);
+static void queue_children(dir_task_t *node);
+static void stream_dir(dir_task_t *node);
+
+static atomic_size_t open_dir_fds; // directory fds held across all walks
+
+// Returns the fd to open a child entry relative to, and in *at the name to open it by.
+static int entry_at(const dir_task_t *parent, const char *name, const char *path, const char **at)
+{
+    if (!parent || parent->fd == -1)
+    {
+        *at = path;
+        return AT_FDCWD;
+    }
+
+    *at = name;
+
+    return parent->fd;
+}
+
+static void close_dir_fd(dir_task_t *node)
+{
+    close(node->fd);
+    node->fd = -1;
+    atomic_fetch_sub(&open_dir_fds, 1);
+}
+
+// A partition's children use its directory's fd.
+static void hold_dir_fd(dir_task_t *node)
+{
+    atomic_fetch_add(&(node->partition ? node->parent : node)->fd_users, 1);
+}
+
+static void release_dir_fd(dir_task_t *node)
+{
+    dir_task_t *owner = node->partition ? node->parent : node;
+
+    if (atomic_fetch_sub(&owner->fd_users, 1) == 1 && owner->fd != -1)
+        close_dir_fd(owner);
+}
+
+static void child_complete(dir_task_t *parent, size_t slot, bool ok, const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    parent->children[slot].ok = ok;
+    if (ok)
+        memcpy(parent->children[slot].digest, digest, SHA256_DIGEST_LENGTH);
+
+    if (atomic_fetch_sub(&parent->pending, 1) == 1)
+        finish_dir_task(parent);
+}
+
+// Folds the child digests and records the directory as a Merkle node, which reports any leaves that differ.
+static void fold_children(dir_task_t *node)
+{
+    EVP_MD_CTX     *ctx = digest_acquire();
+    merkle_child_t *children;
+    size_t          count = 0;
+    unsigned int    len;
+
+    if (!ctx)
+    {
+        node->status = -1;
+        return;
+    }
+
+    children = arena_alloc(&node->listing.arena, (node->child_count ? node->child_count : 1) * sizeof(merkle_child_t));
+
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        const dir_child_t *child = &node->children[i];
+
+        // A subdirectory that could not be read would drop its whole subtree from the digest unnoticed.
+        if (!child->ok && child->is_dir && !child->skipped)
+        {
+            digest_release(ctx);
+            node->status = -1;
+            return;
+        }
+
+        if (!child->ok)
+            continue;
+
+        EVP_DigestUpdate(ctx, child->digest, SHA256_DIGEST_LENGTH);
+
+        children[count].name = child->name;
+        children[count].is_dir = child->is_dir;
+        memcpy(children[count].digest, child->digest, SHA256_DIGEST_LENGTH);
+        count++;
+    }
+
+    EVP_DigestFinal_ex(ctx, node->digest, &len);
+    digest_release(ctx);
+
+    merkle_update(node->path, children, count, node->digest);
+}
+
+// Adds each child of a partition as name, kind and digest, so a renamed or retyped entry changes the sum.
+static void fold_partition(dir_task_t *node)
+{
+    dir_sum_t    *sum = node->parent->sum;
+    lthash_t      partial;
+    unsigned char element[NAME_MAX + 2 + SHA256_DIGEST_LENGTH];
+    bool          ok = true;
+
+    lthash_init(&partial);
+
+    for (size_t i = 0; i < node->child_count && ok; i++)
+    {
+        const dir_child_t *child = &node->children[i];
+        size_t             name_len = strlen(child->name);
+
+        if (!child->ok && child->is_dir && !child->skipped)
+            ok = false;
+
+        if (!child->ok || name_len > NAME_MAX)
+            continue;
+
+        memcpy(element, child->name, name_len + 1);
+        element[name_len + 1] = child->is_dir ? 'd' : 'f';
+        memcpy(element + name_len + 2, child->digest, SHA256_DIGEST_LENGTH);
+        ok = lthash_add(&partial, element, name_len + 2 + SHA256_DIGEST_LENGTH) == 0;
+    }
+
+    pthread_mutex_lock(&sum->mutex);
+    lthash_merge(&sum->sum, &partial);
+    sum->failed = sum->failed || !ok;
+    pthread_mutex_unlock(&sum->mutex);
+}
+
+// A multiset directory keeps no child list, so the Merkle store can only report it as a whole.
+static void seal_multiset(dir_task_t *node)
+{
+    lthash_t empty;
+
+    if (!node->sum)
+        lthash_init(&empty);
+
+    if ((node->sum && node->sum->failed) || lthash_digest(node->sum ? &node->sum->sum : &empty, node->digest) != 0)
     {
-        "/etc/mtab",
-        "/etc/ld.so.cache",
-        "/etc/machine-id",
-        "/etc/NetworkManager/*",
-        "/etc/ssl/*",
-        "/etc/alternatives/*",
-        "/etc/systemd/system/*.wants/*",
-        "/etc/pki/tls/certs/*",
-        "/etc/letsencrypt/*",
-        "/etc/cups/*"};
+        node->status = -1;
+        return;
+    }
 
-static const size_t exclude_count = sizeof(exclude_patterns) / sizeof(exclude_patterns[0]);
+    merkle_update_multiset(node->path, node->digest);
+}
 
-EVP_MD_CTX *init_evp_context(const EVP_MD *type)
+static void free_sum(dir_sum_t *sum)
 {
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx)
+    if (!sum)
+        return;
+
+    pthread_mutex_destroy(&sum->mutex);
+    task_group_destroy(&sum->partitions);
+    free(sum);
+}
+
+static void finish_dir_task(dir_task_t *node)
+{
+    if (node->status == 0 && !node->cached)
+    {
+        if (node->partition)
+            fold_partition(node);
+        else if (node->multiset)
+            seal_multiset(node);
+        else
+            fold_children(node);
+    }
+
+    dir_listing_free(&node->listing);
+    free(node->children);
+    node->children = NULL;
+    free_sum(node->sum);
+    node->sum = NULL;
+
+    if (node->partition)
+    {
+        task_group_t *partitions = &node->parent->sum->partitions;
+
+        free(node);
+        task_group_done(partitions);
+    }
+    else if (node->parent)
+    {
+        child_complete(node->parent, node->slot, node->status == 0, node->digest);
+        free(node);
+    }
+    else
+    {
+        task_group_done(node->group);
+    }
+}
+
+static void run_file_task(void *arg)
+{
+    file_task_t       *task = arg;
+    const dir_child_t *child = &task->parent->children[task->slot];
+    const char        *name;
+    int                dir_fd = entry_at(task->parent, child->name, child->path, &name);
+    unsigned int       len;
+    unsigned char      digest[SHA256_DIGEST_LENGTH];
+    bool               ok;
+
+    ok = hash_file_stat(dir_fd, name, child->path, &task->st, task->parent->tree, task->parent->append, &len,
+                        digest) == 0;
+    release_dir_fd(task->parent);
+    child_complete(task->parent, task->slot, ok, digest);
+
+    free(task);
+}
+
+// Seals every readable file of the batch with one multi-buffer pass and reports each to the parent directory. Format-1
+// digests are file digests already and are reported as they are.
+static void seal_batch(batch_task_t *task, const bool ok[], unsigned char content[][SHA256_DIGEST_LENGTH])
+{
+    const unsigned char *records[HASH_BATCH_FILES];
+    size_t               sizes[HASH_BATCH_FILES];
+    size_t               offsets[HASH_BATCH_FILES];
+    unsigned char        digests[HASH_BATCH_FILES][SHA256_DIGEST_LENGTH];
+    size_t               total = 0;
+    size_t               count = 0;
+    unsigned char       *arena;
+
+    if (FIM_DIGEST_FORMAT == 1)
     {
-        log_message(LOG_ERR, "Failed to create EVP_MD_CTX of type: %s", type);
+        for (size_t i = 0; i < task->count; i++)
+            child_complete(task->parent, task->slots[i], ok[i], ok[i] ? content[i] : NULL);
+        return;
+    }
 
-        return NULL;
+    for (size_t i = 0; i < task->count; i++)
+    {
+        offsets[i] = total;
+        if (ok[i])
+            total += seal_size(task->parent->children[task->slots[i]].path);
     }
 
-    if (EVP_DigestInit_ex(ctx, type, NULL) != 1)
+    arena = safe_malloc(total ? total : 1);
+
+    for (size_t i = 0; i < task->count; i++)
     {
-        log_message(LOG_ERR, "Failed to initialize EVP digest context");
-        EVP_MD_CTX_free(ctx);
+        if (!ok[i])
+            continue;
 
-        return NULL;
+        const char *path = task->parent->children[task->slots[i]].path;
+
+        build_seal(path, &task->st[i], content[i], arena + offsets[i]);
+        records[count] = arena + offsets[i];
+        sizes[count] = seal_size(path);
+        count++;
     }
 
-    return ctx;
+    sha256_batch(records, sizes, count, digests);
+    free(arena);
+
+    for (size_t i = 0, j = 0; i < task->count; i++)
+        child_complete(task->parent, task->slots[i], ok[i], ok[i] ? digests[j++] : NULL);
 }
 
-bool is_excluded(const char *path, const char *patterns[], size_t pattern_count)
+// Format-1 digests cover the metadata as well, so each pending file is hashed from a copy with its metadata in front.
+// data and sizes are pointed at the copies, which live in the returned buffer.
+static unsigned char *prefix_metadata(const batch_task_t *task, const size_t pending[], size_t count,
+                                      const unsigned char *data[], size_t sizes[])
 {
-    for (size_t i = 0; i < pattern_count; i++)
+    size_t         total = 0;
+    unsigned char *buffer;
+    unsigned char *out;
+
+    for (size_t p = 0; p < count; p++)
+        total += metadata_size(task->parent->children[task->slots[pending[p]]].path) + sizes[p];
+
+    buffer = safe_malloc(total ? total : 1);
+    out = buffer;
+
+    for (size_t p = 0; p < count; p++)
     {
-        if (fnmatch(patterns[i], path, 0) == 0)
-            return true;
+        unsigned char *record = out;
+
+        out = build_metadata(task->parent->children[task->slots[pending[p]]].path, &task->st[pending[p]], out);
+        append(&out, data[p], sizes[p]);
+        data[p] = record;
+        sizes[p] = (size_t)(out - record);
     }
 
-    return false;
+    return buffer;
 }
 
-int binary_to_hex(const unsigned char *digest, unsigned int len, char out_hex[HASH_HEX_LEN + 1])
+// Files whose stat tuple or inode memo settles them need no read; the rest are read together through
+// io_read_batch_at() and hashed in one multi-buffer pass.
+static void run_batch_task(void *arg)
 {
-    static const char hex[] = "0123456789abcdef";
-    for (unsigned int i = 0; i < len; i++)
+    batch_task_t        *task = arg;
+    baseline_match_t     match[HASH_BATCH_FILES];
+    bool                 ok[HASH_BATCH_FILES];
+    unsigned char        content[HASH_BATCH_FILES][SHA256_DIGEST_LENGTH];
+    unsigned char        previous[HASH_BATCH_FILES][SHA256_DIGEST_LENGTH];
+    unsigned char        stored_fast[HASH_BATCH_FILES][FAST_DIGEST_LENGTH];
+    unsigned char        fast[HASH_BATCH_FILES][FAST_DIGEST_LENGTH];
+    io_batch_file_t      files[HASH_BATCH_FILES];
+    size_t               reading[HASH_BATCH_FILES]; // batch index of each file in files
+    size_t               pending[HASH_BATCH_FILES];
+    const unsigned char *data[HASH_BATCH_FILES];
+    size_t               sizes[HASH_BATCH_FILES];
+    size_t               bytes[HASH_BATCH_FILES]; // content length of each pending file
+    unsigned char       *copies[HASH_BATCH_FILES] = {NULL}; // format 1: content the inode memo already held
+    size_t               copy_sizes[HASH_BATCH_FILES];
+    unsigned char        digests[HASH_BATCH_FILES][SHA256_DIGEST_LENGTH];
+    unsigned char       *records = NULL;
+    size_t               read_count = 0;
+    size_t               pending_count = 0;
+    int                  dir_fd = AT_FDCWD;
+    uint64_t             start;
+    uint64_t             read_ns;
+    uint64_t             batch_ns;
+
+    for (size_t i = 0; i < task->count; i++)
     {
-        out_hex[i * 2] = hex[(digest[i] >> 4) & 0xF];
-        out_hex[i * 2 + 1] = hex[digest[i] & 0xF];
+        const dir_child_t *child = &task->parent->children[task->slots[i]];
+        const char        *path = child->path;
+        const struct stat *st = &task->st[i];
+
+        match[i] = baseline_lookup(path, st, content[i], stored_fast[i]);
+        ok[i] = true;
+        metrics_count(METRIC_FILES_VISITED, 1);
+
+        if (match[i] == BASELINE_MATCH)
+        {
+            metrics_count(METRIC_FILES_UNCHANGED, 1);
+            continue;
+        }
+
+        memcpy(previous[i], content[i], SHA256_DIGEST_LENGTH);
+
+        if (FIM_DIGEST_FORMAT == 2 && inode_memo_lookup(st, content[i], FIM_FAST_PREFILTER ? fast[i] : NULL))
+        {
+            metrics_count(METRIC_FILES_SHARED, 1);
+            audit_content(path, match[i], fast[i], stored_fast[i], content[i], previous[i]);
+            baseline_update(path, st, content[i], FIM_FAST_PREFILTER ? fast[i] : NULL);
+            continue;
+        }
+
+        // Hashed below with the files read, behind this path's metadata.
+        if (FIM_DIGEST_FORMAT == 1 && inode_memo_lookup_content(st, &copies[i], &copy_sizes[i]))
+        {
+            metrics_count(METRIC_FILES_SHARED, 1);
+            continue;
+        }
+
+        dir_fd = entry_at(task->parent, child->name, path, &files[read_count].name);
+        files[read_count].path = path;
+        files[read_count].st = st;
+        reading[read_count++] = i;
     }
-    out_hex[len * 2] = '\0';
 
-    return 0;
+    // Reads are issued together, so each file is charged an equal share of the batch's read time.
+    start = governor_clock_ns();
+    io_read_batch_at(dir_fd, files, read_count);
+    release_dir_fd(task->parent);
+    read_ns = read_count ? (governor_clock_ns() - start) / read_count : 0;
+
+    for (size_t r = 0; r < read_count; r++)
+    {
+        size_t i = reading[r];
+
+        if (!files[r].ok)
+        {
+            metrics_count(METRIC_FILE_ERRORS, 1);
+            ok[i] = false;
+            continue;
+        }
+
+        if (FIM_DIGEST_FORMAT == 1)
+            inode_memo_store_content(&task->st[i], files[r].data, files[r].len);
+
+        if (FIM_FAST_PREFILTER)
+        {
+            fasthash_buffer(files[r].data, files[r].len, fast[i]);
+
+            if (prefilter_hit(match[i], fast[i], stored_fast[i]))
+            {
+                metrics_file_hashed(files[r].path, files[r].len, read_ns);
+                baseline_update(files[r].path, &task->st[i], content[i], fast[i]);
+                continue;
+            }
+        }
+
+        data[pending_count] = files[r].data;
+        sizes[pending_count] = files[r].len;
+        bytes[pending_count] = files[r].len;
+        pending[pending_count++] = i;
+    }
+
+    for (size_t i = 0; i < task->count; i++)
+    {
+        if (!copies[i])
+            continue;
+
+        data[pending_count] = copies[i];
+        sizes[pending_count] = copy_sizes[i];
+        bytes[pending_count] = copy_sizes[i];
+        pending[pending_count++] = i;
+    }
+
+    if (pending_count == 0)
+    {
+        seal_batch(task, ok, content);
+        free(task);
+        return;
+    }
+
+    start = governor_clock_ns();
+    if (FIM_DIGEST_FORMAT == 1)
+        records = prefix_metadata(task, pending, pending_count, data, sizes);
+    sha256_batch(data, sizes, pending_count, digests);
+    batch_ns = governor_clock_ns() - start;
+    free(records);
+
+    for (size_t p = 0; p < pending_count; p++)
+    {
+        size_t      i = pending[p];
+        const char *path = task->parent->children[task->slots[i]].path;
+
+        // Files hashed together share the batch's hashing time equally; shared copies were not read.
+        metrics_file_hashed(path, bytes[p], (copies[i] ? 0 : read_ns) + batch_ns / pending_count);
+        memcpy(content[i], digests[p], SHA256_DIGEST_LENGTH);
+        audit_content(path, match[i], fast[i], stored_fast[i], content[i], previous[i]);
+        baseline_update(path, &task->st[i], content[i], FIM_FAST_PREFILTER ? fast[i] : NULL);
+        if (FIM_DIGEST_FORMAT == 2)
+            inode_memo_store(&task->st[i], content[i], FIM_FAST_PREFILTER ? fast[i] : NULL);
+        free(copies[i]);
+    }
+
+    seal_batch(task, ok, content);
+    free(task);
 }
 
-static void update_hash_with_metadata(EVP_MD_CTX *ctx, const char *path, const struct stat *st)
+static dir_task_t *new_dir_task(dir_task_t *parent, size_t slot, const char *path, const char *name)
 {
-    EVP_DigestUpdate(ctx, path, strlen(path));
-    EVP_DigestUpdate(ctx, &st->st_mode, sizeof(st->st_mode));
-    EVP_DigestUpdate(ctx, &st->st_size, sizeof(st->st_size));
-    EVP_DigestUpdate(ctx, &st->st_mtime, sizeof(st->st_mtime));
-    EVP_DigestUpdate(ctx, &st->st_ctime, sizeof(st->st_ctime));
-    EVP_DigestUpdate(ctx, &st->st_uid, sizeof(st->st_uid));
-    EVP_DigestUpdate(ctx, &st->st_gid, sizeof(st->st_gid));
+    dir_task_t *node = safe_malloc(sizeof(dir_task_t));
+
+    memset(node, 0, sizeof(dir_task_t));
+    node->parent = parent;
+    node->slot = slot;
+    node->path = path;
+    node->name = name;
+    node->fd = -1;
+    atomic_init(&node->fd_users, 1);
+    node->tree = parent && parent->tree;
+    node->append = parent && parent->append;
+    node->multiset = parent && parent->multiset;
+    atomic_init(&node->pending, 1);
+
+    return node;
 }
 
-static int hash_file_sha256(const char *path, unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+static void skip_dir_task(dir_task_t *node)
 {
-    FILE *fp = open_file(path);
-    if (!fp)
-        return -1;
+    node->status = -1;
+    release_dir_fd(node);
 
-    EVP_MD_CTX *ctx = init_evp_context(EVP_sha256());
+    if (atomic_fetch_sub(&node->pending, 1) == 1)
+        finish_dir_task(node);
+}
 
-    unsigned char buf[BUF_SIZE];
-    size_t        n;
-    struct stat   st;
+// Symlinked directories are followed, so a directory whose (dev, inode) matches an ancestor closes a loop.
+static const dir_task_t *find_cycle(const dir_task_t *node)
+{
+    for (const dir_task_t *up = node->parent; up; up = up->parent)
+    {
+        if (up->dev == node->dev && up->ino == node->ino)
+            return up;
+    }
 
-    if (stat(path, &st) == -1)
+    return NULL;
+}
+
+// A batch holds files of one directory, so it is queued on its first file's device, in that file's inode order.
+static void submit_batch(batch_task_t *batch)
+{
+    device_submit(batch->st[0].st_dev, batch->st[0].st_ino, run_batch_task, batch);
+}
+
+static void queue_file(dir_task_t *node, size_t slot, const struct stat *st, batch_task_t **batch)
+{
+    if (st->st_size > HASH_BATCH_MAX_FILE_SIZE)
     {
-        perror("stat");
-        return -1;
+        file_task_t *task = safe_malloc(sizeof(file_task_t));
+
+        task->parent = node;
+        task->slot = slot;
+        task->st = *st;
+
+        hold_dir_fd(node);
+        device_submit(st->st_dev, st->st_ino, run_file_task, task);
+        return;
     }
 
-    update_hash_with_metadata(ctx, path, &st);
+    if (!*batch)
+    {
+        *batch = safe_malloc(sizeof(batch_task_t));
+        (*batch)->parent = node;
+        (*batch)->count = 0;
+        hold_dir_fd(node);
+    }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
-        EVP_DigestUpdate(ctx, buf, n);
+    (*batch)->slots[(*batch)->count] = slot;
+    (*batch)->st[(*batch)->count] = *st;
 
-    EVP_DigestFinal_ex(ctx, digest, len);
-    EVP_MD_CTX_free(ctx);
-    fclose(fp);
+    if (++(*batch)->count == HASH_BATCH_FILES)
+    {
+        submit_batch(*batch);
+        *batch = NULL;
+    }
+}
 
-    return 0;
+static bool root_is_dir(const char *path)
+{
+    struct stat st;
+
+    metrics_count(METRIC_STAT_CALLS, 1);
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-int sha256_file(const char *path, char out_hex[HASH_HEX_LEN + 1])
+// Opens the node's directory, after which its parent's fd is no longer needed for it.
+static int open_dir_task(dir_task_t *node)
 {
-    unsigned char digest[EVP_MAX_MD_SIZE];
-    unsigned int  len;
+    const char *name;
+    int         dir_fd = entry_at(node->parent, node->name, node->path, &name);
+    int         fd = dir_open_at(dir_fd, name);
+    int         saved = errno;
 
-    if (hash_file_sha256(path, &len, digest) != 0)
+    if (node->parent)
+        release_dir_fd(node->parent);
+
+    if (fd == -1)
+    {
+        errno = saved;
         return -1;
+    }
 
-    binary_to_hex(digest, len, out_hex);
+    node->fd = fd;
+    atomic_fetch_add(&open_dir_fds, 1);
 
     return 0;
 }
 
-static int compare_names(const void *a, const void *b)
+static void run_dir_task(void *arg)
 {
-    const char *const *nameA = a;
-    const char *const *nameB = b;
+    dir_task_t       *node = arg;
+    struct stat       st;
+    const dir_task_t *loop;
 
-    return strcmp(*nameA, *nameB);
-}
+    // Outside a full sweep, a subtree without change events since it was last folded keeps its digest.
+    if (trust_merkle && merkle_lookup(node->path, node->digest))
+    {
+        node->cached = true;
+        if (node->parent)
+            release_dir_fd(node->parent);
 
-static int hash_directory_sha256(const char *dir_path, unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
-{
-    EVP_MD_CTX *ctx;
-    size_t      entry_count;
-    char      **entries;
+        if (atomic_fetch_sub(&node->pending, 1) == 1)
+            finish_dir_task(node);
+        return;
+    }
 
-    ctx = init_evp_context(EVP_sha256());
-    entry_count = 0;
-    entries = get_all_entries(dir_path, &entry_count);
-    if (!entries)
+    // When every path below is excluded the directory folds to the digest of an empty one without being opened.
+    if (subtree_excluded(node->path) && (node->parent || root_is_dir(node->path)))
     {
-        log_message(LOG_WARNING, "Skipping directory (unreadable): %s", dir_path);
-        return -1;
+        metrics_count(METRIC_FILES_EXCLUDED, 1);
+        if (node->parent)
+            release_dir_fd(node->parent);
+
+        if (atomic_fetch_sub(&node->pending, 1) == 1)
+            finish_dir_task(node);
+        return;
     }
 
-    qsort(entries, entry_count, sizeof(char *), compare_names);
+    governor_admit_file();
+    if (open_dir_task(node) == 0)
+        metrics_count(METRIC_STAT_CALLS, 1);
+    if (node->fd == -1 || fstat(node->fd, &st) == -1 || (!node->multiset && dir_list(node->fd, &node->listing) != 0))
+    {
+        // A directory removed since its parent was listed is gone like any other entry; one that cannot be read
+        // fails the whole entry rather than leave its subtree out of the digest.
+        if (errno == ENOENT && node->parent)
+            node->parent->children[node->slot].skipped = true;
+        else
+            metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_WARNING, "Cannot read directory %s: %s", node->path, strerror(errno));
+        skip_dir_task(node);
+        return;
+    }
 
-    for (size_t i = 0; i < entry_count; i++)
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+
+    if ((loop = find_cycle(node)) != NULL)
     {
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", dir_path, entries[i]);
+        log_message(LOG_WARNING, "Skipping directory cycle: %s is %s", node->path, loop->path);
+        node->parent->children[node->slot].skipped = true;
+        skip_dir_task(node);
+        return;
+    }
 
-        if (is_excluded(fullpath, exclude_patterns, exclude_count))
-        {
-            // printf("Skipping excluded path: %s\n", fullpath);
-            continue;
-        }
+    // Past the budget the directory is not held open while its children wait; they are stat'ed and opened by path.
+    if (!node->multiset && atomic_load(&open_dir_fds) > HASH_DIR_FD_BUDGET)
+        close_dir_fd(node);
+
+    if (node->multiset)
+        stream_dir(node);
+    else
+        queue_children(node);
+}
+
+// Queues a task for every hashable entry of the node's listing and drops the node's own hold on its pending count.
+// Entries are taken HASH_BATCH_FILES at a time so their stats can be issued together.
+static void queue_children(dir_task_t *node)
+{
+    batch_task_t *batch = NULL;
+    size_t        next = 0;
+
+    node->children = safe_malloc((node->listing.count ? node->listing.count : 1) * sizeof(dir_child_t));
 
-        struct stat st;
-        if (stat(fullpath, &st) == -1)
+    while (next < node->listing.count)
+    {
+        const dir_entry_t *candidates[HASH_BATCH_FILES];
+        const char        *paths[HASH_BATCH_FILES];
+        const char        *names[HASH_BATCH_FILES];
+        struct stat        st[HASH_BATCH_FILES];
+        int                errors[HASH_BATCH_FILES];
+        int                dir_fd = AT_FDCWD;
+        size_t             count = 0;
+        size_t             stat_count = 0;
+
+        for (; next < node->listing.count && count < HASH_BATCH_FILES; next++)
         {
-            perror("stat");
-            continue;
+            const dir_entry_t *entry = &node->listing.entries[next];
+
+            // Device nodes, FIFOs and sockets are never hashed, so their d_type alone rules them out.
+            if (entry->type != DT_REG && entry->type != DT_DIR && entry->type != DT_LNK && entry->type != DT_UNKNOWN)
+                continue;
+
+            const char *path = arena_join(&node->listing.arena, node->path, entry->name);
+            if (path_excluded(path))
+            {
+                metrics_count(METRIC_FILES_EXCLUDED, 1);
+                continue;
+            }
+
+            // A known directory needs no stat here; its own task fstat()s the fd it opens.
+            if (entry->type != DT_DIR)
+                dir_fd = entry_at(node, entry->name, path, &names[stat_count++]);
+
+            candidates[count] = entry;
+            paths[count++] = path;
         }
 
-        if (S_ISREG(st.st_mode))
+        io_stat_batch_at(dir_fd, names, stat_count, st, errors);
+
+        for (size_t c = 0, k = 0; c < count; c++)
         {
-            unsigned int  file_len;
-            unsigned char filehash[SHA256_DIGEST_LENGTH];
+            const dir_entry_t *entry = candidates[c];
+            const struct stat *child_st = NULL;
+            bool               is_dir = entry->type == DT_DIR;
+
+            if (!is_dir)
+            {
+                size_t j = k++;
+
+                if (errors[j] != 0)
+                {
+                    metrics_count(METRIC_FILE_ERRORS, 1);
+                    log_message(LOG_WARNING, "Error reading metadata of %s: %s", paths[c], strerror(errors[j]));
+                    continue;
+                }
+
+                if (!S_ISREG(st[j].st_mode) && !S_ISDIR(st[j].st_mode))
+                    continue;
+
+                child_st = &st[j];
+                is_dir = S_ISDIR(st[j].st_mode);
+            }
 
-            hash_file_sha256(fullpath, &file_len, filehash);
-            EVP_DigestUpdate(ctx, filehash, SHA256_DIGEST_LENGTH);
+            size_t       slot = node->child_count++;
+            dir_child_t *child = &node->children[slot];
+
+            child->name = entry->name;
+            child->path = paths[c];
+            child->is_dir = is_dir;
+            child->ok = false;
+            child->skipped = false;
+            atomic_fetch_add(&node->pending, 1);
+
+            if (child->is_dir)
+            {
+                hold_dir_fd(node);
+                threadpool_submit(run_dir_task, new_dir_task(node, slot, paths[c], entry->name));
+            }
+            else
+                queue_file(node, slot, child_st, &batch);
         }
-        else if (S_ISDIR(st.st_mode))
-        {
-            unsigned int  dir_len;
-            unsigned char dirhash[SHA256_DIGEST_LENGTH];
+    }
+
+    if (batch)
+        submit_batch(batch);
+    release_dir_fd(node);
+
+    if (atomic_fetch_sub(&node->pending, 1) == 1)
+        finish_dir_task(node);
+}
 
-            hash_directory_sha256(fullpath, &dir_len, dirhash);
-            EVP_DigestUpdate(ctx, dirhash, SHA256_DIGEST_LENGTH);
+static void run_partition_task(void *arg)
+{
+    queue_children(arg);
+}
+
+// Reads a multiset directory HASH_STREAM_PARTITION entries at a time in readdir order and hashes each slice as a
+// partition task. At most two partitions per worker are outstanding, so memory stays bounded however large the
+// directory is; the reader helps run them while it waits.
+static void stream_dir(dir_task_t *node)
+{
+    dir_stream_t stream;
+    size_t       in_flight = 2 * threadpool_size();
+    int          rc = dir_stream_open(&stream, node->fd);
+
+    node->sum = safe_malloc(sizeof(dir_sum_t));
+    lthash_init(&node->sum->sum);
+    pthread_mutex_init(&node->sum->mutex, NULL);
+    task_group_init(&node->sum->partitions);
+    node->sum->failed = false;
+
+    while (rc == 0 && !stream.done)
+    {
+        dir_task_t *part = new_dir_task(node, 0, node->path, NULL);
+
+        part->partition = true;
+        part->fd = node->fd;
+        part->dev = node->dev;
+        part->ino = node->ino;
+
+        rc = dir_stream_next(&stream, &part->listing, HASH_STREAM_PARTITION);
+        if (rc != 0 || part->listing.count == 0)
+        {
+            dir_listing_free(&part->listing);
+            free(part);
+            continue;
         }
 
-        free(entries[i]);
+        task_group_add(&node->sum->partitions, 1);
+        hold_dir_fd(part);
+        threadpool_submit(run_partition_task, part);
+        task_group_throttle(&node->sum->partitions, in_flight);
+    }
+
+    if (rc != 0)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_WARNING, "Skipping directory (unreadable): %s: %s", node->path, strerror(errno));
+        node->status = -1;
     }
-    free(entries);
 
-    EVP_DigestFinal_ex(ctx, digest, len);
-    EVP_MD_CTX_free(ctx);
+    dir_stream_close(&stream);
+    release_dir_fd(node);
+    task_group_wait(&node->sum->partitions);
 
-    return 0;
+    if (atomic_fetch_sub(&node->pending, 1) == 1)
+        finish_dir_task(node);
+}
+
+static int hash_directory_sha256(const char *dir_path, bool tree, bool multiset, bool append, unsigned int *len,
+                                 unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    task_group_t group;
+    dir_task_t  *root;
+    int          status;
+
+    task_group_init(&group);
+    task_group_add(&group, 1);
+
+    root = new_dir_task(NULL, 0, NULL, NULL);
+    root->owned_path = safe_strdup(dir_path);
+    root->path = root->owned_path;
+    root->tree = tree;
+    root->multiset = multiset;
+    root->append = append;
+    root->group = &group;
+
+    threadpool_submit(run_dir_task, root);
+    task_group_wait(&group);
+
+    status = root->status;
+    if (status == 0)
+    {
+        memcpy(digest, root->digest, SHA256_DIGEST_LENGTH);
+        *len = SHA256_DIGEST_LENGTH;
+    }
+
+    free(root->owned_path);
+    free(root);
+    task_group_destroy(&group);
+
+    return status;
 }
 
 int sha256_dir(const char *dir_path, char out_hex[HASH_HEX_LEN + 1])
@@ -202,7 +1604,7 @@ int sha256_dir(const char *dir_path, char out_hex[HASH_HEX_LEN + 1])
     unsigned char digest[EVP_MAX_MD_SIZE];
     unsigned int  len;
 
-    if (hash_directory_sha256(dir_path, &len, digest) != 0)
+    if (hash_directory_sha256(dir_path, false, false, false, &len, digest) != 0)
         return -1;
 
     binary_to_hex(digest, len, out_hex);
@@ -210,73 +1612,239 @@ int sha256_dir(const char *dir_path, char out_hex[HASH_HEX_LEN + 1])
     return 0;
 }
 
+static bool same_stat(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+// Logs the ranges that differ from the previous vector and stores the current one for the next cycle.
+static void record_lines(const char *path, const line_vector_t *previous, const line_vector_t *current)
+{
+    if (!previous)
+        log_message(LOG_INFO, "Recorded %zu line hashes for %s", current->count, path);
+    else if (!line_vector_equal(previous, current))
+        line_diff_report(path, previous, current);
+
+    line_vector_save(path, current);
+}
+
+// Diffs the per-line digest vector against the one stored last cycle and logs only the changed ranges.
 void hash_file_lines(const char *path)
 {
-    FILE   *fp;
-    char   *line;
-    size_t  len;
-    ssize_t read;
-    int     line_no;
+    struct stat   st;
+    line_vector_t previous;
+    line_vector_t current;
+    bool          have_previous;
+    uint64_t      start;
+
+    metrics_count(METRIC_FILES_VISITED, 1);
+    metrics_count(METRIC_STAT_CALLS, 1);
+    if (stat(path, &st) == -1)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_ERR, "Error reading metadata of %s: %s", path, strerror(errno));
+        return;
+    }
+
+    have_previous = line_vector_load(path, &previous) == 0;
+
+    if (have_previous && !baseline_full_rehash() && same_stat(&previous.st, &st))
+    {
+        metrics_count(METRIC_FILES_UNCHANGED, 1);
+        line_vector_free(&previous);
+        return;
+    }
+
+    start = governor_clock_ns();
+    if (line_vector_build(path, &st, &current, NULL, NULL) != 0)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_ERR, "Error hashing lines of %s", path);
+        if (have_previous)
+            line_vector_free(&previous);
+        return;
+    }
+    metrics_file_hashed(path, (uint64_t)st.st_size, governor_clock_ns() - start);
+
+    record_lines(path, have_previous ? &previous : NULL, &current);
+
+    if (have_previous)
+        line_vector_free(&previous);
+    line_vector_free(&current);
+}
+
+// File digest and line digests of one path from a single read; an unchanged file is not read at all.
+static int hash_file_and_lines(const char *path, unsigned int *len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    struct stat      st;
+    line_vector_t    previous;
+    line_vector_t    current;
+    bool             have_previous;
+    content_hash_t   hash = {0};
+    unsigned char    content[SHA256_DIGEST_LENGTH];
+    unsigned char    stored[SHA256_DIGEST_LENGTH];
+    unsigned char    stored_fast[FAST_DIGEST_LENGTH];
+    unsigned char    fast[FAST_DIGEST_LENGTH];
+    baseline_match_t match;
+    int              rc = -1;
+    uint64_t         start;
+
+    metrics_count(METRIC_STAT_CALLS, 1);
+    if (stat(path, &st) == -1)
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_ERR, "Error reading metadata of %s: %s", path, strerror(errno));
+        return -1;
+    }
 
-    fp = open_file(path);
+    have_previous = line_vector_load(path, &previous) == 0;
 
-    line = NULL;
-    len = 0;
-    line_no = 1;
+    if (have_previous && !baseline_full_rehash() && same_stat(&previous.st, &st))
+    {
+        line_vector_free(&previous);
+        return hash_file_stat(AT_FDCWD, path, path, &st, false, false, len, digest);
+    }
 
-    log_message(LOG_INFO, "Calculated hash per line for %s", path);
+    metrics_count(METRIC_FILES_VISITED, 1);
+    start = governor_clock_ns();
+    match = baseline_lookup(path, &st, stored, stored_fast);
+    hash.sha256 = digest_acquire();
+    if (FIM_FAST_PREFILTER)
+        hash.fast = fasthash_new();
+    if (FIM_DIGEST_FORMAT == 1 && hash.sha256)
+    {
+        update_metadata(hash.sha256, path, &st);
+        keep_content(&hash, &st);
+    }
 
-    while ((read = getline(&line, &len, fp)) != -1)
+    if (hash.sha256 && (!FIM_FAST_PREFILTER || hash.fast) && line_vector_build(path, &st, &current, content_consume, &hash) == 0)
     {
-        unsigned char digest[SHA256_DIGEST_LENGTH];
-        EVP_Digest(line, read, digest, NULL, EVP_sha256(), NULL);
+        EVP_DigestFinal_ex(hash.sha256, content, NULL);
+        if (hash.fast)
+            fasthash_final(hash.fast, fast);
+        store_kept(&hash, &st);
+        rc = 0;
+    }
 
-        char out_hex[HASH_HEX_LEN + 1];
-        binary_to_hex(digest, SHA256_DIGEST_LENGTH, out_hex);
+    digest_release(hash.sha256);
+    fasthash_free(hash.fast);
+    free(hash.keep);
 
-        log_message(LOG_INFO, "Hash for line %d: %s\n", line_no, out_hex);
-        line_no++;
+    if (rc == 0)
+    {
+        metrics_file_hashed(path, (uint64_t)st.st_size, governor_clock_ns() - start);
+        audit_content(path, match, fast, stored_fast, content, stored);
+        baseline_update(path, &st, content, FIM_FAST_PREFILTER ? fast : NULL);
+        if (FIM_DIGEST_FORMAT == 2)
+            inode_memo_store(&st, content, FIM_FAST_PREFILTER ? fast : NULL);
+        record_lines(path, have_previous ? &previous : NULL, &current);
+        line_vector_free(&current);
+        rc = file_digest(path, &st, content, len, digest);
+    }
+    else
+    {
+        metrics_count(METRIC_FILE_ERRORS, 1);
+        log_message(LOG_ERR, "Error hashing lines of %s", path);
     }
+
+    if (have_previous)
+        line_vector_free(&previous);
+
+    return rc;
 }
 
-static void do_hash(config_entry_t entry)
+static void do_hash(const config_entry_t *entry)
 {
-    hash_level_t type = entry.hash_level;
-    char         out_hex[HASH_HEX_LEN + 1];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int  len;
+    char          out_hex[HASH_HEX_LEN + 1];
 
-    switch (type)
+    switch (entry->hash_level)
     {
         case HASH_DIR_LVL:
-            if (sha256_dir(entry.path, out_hex) != 0)
-                log_message(LOG_ERR, "Error hashing directory: %s", entry.path);
-            else
-                log_message(LOG_INFO, "Hash for %s: %s\n", entry.path, out_hex);
+            if (hash_directory_sha256(entry->path, entry->tree, entry->multiset, entry->append, &len, digest) != 0)
+            {
+                log_message(LOG_ERR, "Error hashing directory: %s", entry->path);
+                break;
+            }
+            binary_to_hex(digest, len, out_hex);
+            log_message(LOG_INFO, "Hash for %s: %s\n", entry->path, out_hex);
             break;
         case HASH_FILE_LVL:
-            if (sha256_file(entry.path, out_hex) != 0)
-                log_message(LOG_ERR, "Error hashing file: %s", entry.path);
-            else
-                log_message(LOG_INFO, "Hash for %s: %s\n", entry.path, out_hex);
+            // Line digests need one sequential read, so entries that keep them never take the tree or append path.
+            if ((entry->lines ? hash_file_and_lines(entry->path, &len, digest)
+                              : hash_file_sha256(entry->path, entry->tree, entry->append, &len, digest)) != 0)
+            {
+                log_message(LOG_ERR, "Error hashing file: %s", entry->path);
+                break;
+            }
+            binary_to_hex(digest, len, out_hex);
+            log_message(LOG_INFO, "Hash for %s: %s\n", entry->path, out_hex);
             break;
         case HASH_LINE_LVL:
-            hash_file_lines(entry.path);
+            hash_file_lines(entry->path);
             break;
         default:
             break;
     }
 }
 
-void integrity_check(void)
+typedef struct
+{
+    const config_entry_t *entry;
+    task_group_t         *group;
+} entry_task_t;
+
+// Everything the entry causes, including the pool tasks it submits, is charged to the entry's metrics scope.
+static void run_entry_task(void *arg)
+{
+    entry_task_t    *task = arg;
+    metrics_scope_t *saved = metrics_enter(metrics_scope_for(task->entry->path));
+    uint64_t         start = governor_clock_ns();
+
+    do_hash(task->entry);
+    metrics_record(METRIC_ENTRY_DURATION, governor_clock_ns() - start);
+    metrics_leave(saved);
+    task_group_done(task->group);
+}
+
+void integrity_check_entries(const config_entry_t *entries, const bool selected[], size_t count, bool trust_cache)
 {
-    size_t          capacity = 0;
-    config_entry_t *entries;
+    task_group_t  group;
+    entry_task_t *tasks = safe_malloc(count * sizeof(entry_task_t));
 
-    entries = parse_config(&capacity);
+    task_group_init(&group);
+    trust_merkle = trust_cache;
+    governor_begin_check();
+    metrics_begin_check();
+    inode_memo_begin();
 
-    for (size_t i = 0; i < capacity; i++)
+    // Queued by severity, so red entries reach the workers first when many are due together.
+    for (int level = ALERT_RED; level <= ALERT_GREEN; level++)
     {
-        do_hash(entries[i]);
+        for (size_t i = 0; i < count; i++)
+        {
+            if ((selected && !selected[i]) || (int)entries[i].alert_level != level)
+                continue;
+
+            tasks[i].entry = &entries[i];
+            tasks[i].group = &group;
+
+            task_group_add(&group, 1);
+            threadpool_submit(run_entry_task, &tasks[i]);
+        }
     }
 
-    free(entries);
+    task_group_wait(&group);
+    task_group_destroy(&group);
+    free(tasks);
+    trust_merkle = false;
+    governor_end_check();
+    inode_memo_end();
+
+    baseline_sync();
+    merkle_sync();
+    metrics_end_check();
 }
@@ -0,0 +1,343 @@
+#include "inodememo.h"
+#include "config.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INODE_MEMO_INITIAL_SLOTS 1024
+
+typedef struct
+{
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool            used;
+    bool            ready;   // the digests below are valid
+    bool            claimed; // a thread is reading the inode and will store or release it
+    unsigned char   sha256[SHA256_DIGEST_LENGTH];
+    unsigned char   fast[FAST_DIGEST_LENGTH];
+    unsigned char  *data; // copy of the content, in digest format 1; NULL when the content was not kept
+} memo_slot_t;
+
+// Open addressing with linear probing, kept at most half full.
+static pthread_mutex_t memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  memo_cond = PTHREAD_COND_INITIALIZER;
+static memo_slot_t    *slots = NULL;
+static size_t          slot_count = 0;
+static size_t          used_count = 0;
+static size_t          held_bytes = 0; // content copies, bounded by INODE_MEMO_CONTENT_BUDGET
+static bool            active = false;
+
+static size_t slot_of(dev_t dev, ino_t ino, size_t count)
+{
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev * 0xC2B2AE3D27D4EB4FULL;
+
+    return (size_t)(h ^ (h >> 29)) & (count - 1);
+}
+
+static bool same_inode(const memo_slot_t *slot, const struct stat *st)
+{
+    return slot->dev == st->st_dev && slot->ino == st->st_ino && slot->size == st->st_size &&
+           slot->mtime.tv_sec == st->st_mtim.tv_sec && slot->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           slot->ctime.tv_sec == st->st_ctim.tv_sec && slot->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static memo_slot_t *probe(const struct stat *st)
+{
+    size_t i = slot_of(st->st_dev, st->st_ino, slot_count);
+
+    while (slots[i].used && (slots[i].dev != st->st_dev || slots[i].ino != st->st_ino))
+        i = (i + 1) & (slot_count - 1);
+
+    return &slots[i];
+}
+
+static void grow(void)
+{
+    memo_slot_t *old = slots;
+    size_t       old_count = slot_count;
+
+    slot_count = old_count ? old_count * 2 : INODE_MEMO_INITIAL_SLOTS;
+    slots = safe_malloc(slot_count * sizeof(memo_slot_t));
+    memset(slots, 0, slot_count * sizeof(memo_slot_t));
+
+    for (size_t i = 0; i < old_count; i++)
+    {
+        if (!old[i].used)
+            continue;
+
+        size_t j = slot_of(old[i].dev, old[i].ino, slot_count);
+
+        while (slots[j].used)
+            j = (j + 1) & (slot_count - 1);
+        slots[j] = old[i];
+    }
+
+    free(old);
+}
+
+void inode_memo_begin(void)
+{
+    pthread_mutex_lock(&memo_mutex);
+    active = true;
+    pthread_mutex_unlock(&memo_mutex);
+}
+
+void inode_memo_end(void)
+{
+    pthread_mutex_lock(&memo_mutex);
+    for (size_t i = 0; i < slot_count; i++)
+        free(slots[i].data);
+    free(slots);
+    slots = NULL;
+    slot_count = 0;
+    used_count = 0;
+    held_bytes = 0;
+    active = false;
+    pthread_cond_broadcast(&memo_cond);
+    pthread_mutex_unlock(&memo_mutex);
+}
+
+static memo_slot_t *insert(const struct stat *st)
+{
+    if ((used_count + 1) * 2 > slot_count)
+        grow();
+
+    memo_slot_t *slot = probe(st);
+
+    if (!slot->used)
+        used_count++;
+
+    if (slot->data)
+    {
+        held_bytes -= (size_t)slot->size;
+        free(slot->data);
+        slot->data = NULL;
+    }
+
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim;
+    slot->ctime = st->st_ctim;
+    slot->used = true;
+
+    return slot;
+}
+
+static bool copy_hit(const memo_slot_t *slot, const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH],
+                     unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    if (!slot->used || !slot->ready || !same_inode(slot, st))
+        return false;
+
+    memcpy(sha256, slot->sha256, SHA256_DIGEST_LENGTH);
+    if (fast)
+        memcpy(fast, slot->fast, FAST_DIGEST_LENGTH);
+
+    return true;
+}
+
+// Non-blocking: fast may be NULL and is only filled in when the digest was stored with one.
+bool inode_memo_lookup(const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH], unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    bool hit = false;
+
+    if (!S_ISREG(st->st_mode))
+        return false;
+
+    pthread_mutex_lock(&memo_mutex);
+    if (active && slots)
+        hit = copy_hit(probe(st), st, sha256, fast);
+    pthread_mutex_unlock(&memo_mutex);
+
+    return hit;
+}
+
+// Like inode_memo_lookup, but waits while another thread is reading the inode. On a miss the caller holds the claim
+// and must store or release it; a caller holding a claim never waits, so claims cannot deadlock.
+bool inode_memo_acquire(const struct stat *st, unsigned char sha256[SHA256_DIGEST_LENGTH], unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    bool hit = false;
+
+    if (!S_ISREG(st->st_mode))
+        return false;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    if (active)
+    {
+        memo_slot_t *slot = slots ? probe(st) : NULL;
+
+        while (active && slot && slot->used && slot->claimed)
+        {
+            pthread_cond_wait(&memo_cond, &memo_mutex);
+            slot = slots ? probe(st) : NULL;
+        }
+
+        hit = slot && copy_hit(slot, st, sha256, fast);
+
+        if (!hit && active)
+        {
+            slot = insert(st);
+            slot->ready = false;
+            slot->claimed = true;
+        }
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+
+    return hit;
+}
+
+void inode_memo_store(const struct stat *st, const unsigned char sha256[SHA256_DIGEST_LENGTH], const unsigned char fast[FAST_DIGEST_LENGTH])
+{
+    if (!S_ISREG(st->st_mode))
+        return;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    if (active)
+    {
+        // An inode seen again with a newer stat tuple replaces the old record.
+        memo_slot_t *slot = insert(st);
+
+        memcpy(slot->sha256, sha256, SHA256_DIGEST_LENGTH);
+        if (fast)
+            memcpy(slot->fast, fast, FAST_DIGEST_LENGTH);
+        else
+            memset(slot->fast, 0, FAST_DIGEST_LENGTH);
+        slot->ready = true;
+        slot->claimed = false;
+        pthread_cond_broadcast(&memo_cond);
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+}
+
+// Gives up a claim after a failed read; the next reader of the inode claims it afresh.
+void inode_memo_release(const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode))
+        return;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    if (active && slots)
+    {
+        memo_slot_t *slot = probe(st);
+
+        if (slot->used && slot->claimed)
+        {
+            slot->claimed = false;
+            pthread_cond_broadcast(&memo_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+}
+
+// The content API serves digest format 1, whose digests cover the path and so cannot be shared. Contents of up to
+// INODE_MEMO_CONTENT_MAX bytes are copied instead, and each further path of the inode hashes the copy behind its own
+// metadata rather than reading the file again. Larger files are never claimed, so nobody waits on them.
+static bool holds_content(const struct stat *st)
+{
+    return S_ISREG(st->st_mode) && st->st_size <= INODE_MEMO_CONTENT_MAX;
+}
+
+static bool copy_content(const memo_slot_t *slot, const struct stat *st, unsigned char **data, size_t *len)
+{
+    if (!slot->used || !slot->ready || !slot->data || !same_inode(slot, st))
+        return false;
+
+    *len = (size_t)slot->size;
+    *data = safe_malloc(*len ? *len : 1);
+    memcpy(*data, slot->data, *len);
+
+    return true;
+}
+
+// Non-blocking. On a hit *data is a copy of the content for the caller to free.
+bool inode_memo_lookup_content(const struct stat *st, unsigned char **data, size_t *len)
+{
+    bool hit = false;
+
+    if (!holds_content(st))
+        return false;
+
+    pthread_mutex_lock(&memo_mutex);
+    if (active && slots)
+        hit = copy_content(probe(st), st, data, len);
+    pthread_mutex_unlock(&memo_mutex);
+
+    return hit;
+}
+
+// Waits and claims like inode_memo_acquire; the claim is settled by inode_memo_store_content or inode_memo_release.
+bool inode_memo_acquire_content(const struct stat *st, unsigned char **data, size_t *len)
+{
+    bool hit = false;
+
+    if (!holds_content(st))
+        return false;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    if (active)
+    {
+        memo_slot_t *slot = slots ? probe(st) : NULL;
+
+        while (active && slot && slot->used && slot->claimed)
+        {
+            pthread_cond_wait(&memo_cond, &memo_mutex);
+            slot = slots ? probe(st) : NULL;
+        }
+
+        hit = slot && copy_content(slot, st, data, len);
+
+        if (!hit && active)
+        {
+            slot = insert(st);
+            slot->ready = false;
+            slot->claimed = true;
+        }
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+
+    return hit;
+}
+
+// Keeps a copy of content read for st, unless it is larger than stat said or the budget is spent; either way a claim
+// on the inode is settled.
+void inode_memo_store_content(const struct stat *st, const unsigned char *data, size_t len)
+{
+    if (!holds_content(st))
+        return;
+
+    pthread_mutex_lock(&memo_mutex);
+
+    if (active)
+    {
+        memo_slot_t *slot = insert(st);
+
+        if (len == (size_t)st->st_size && held_bytes + len <= (size_t)INODE_MEMO_CONTENT_BUDGET)
+        {
+            slot->data = safe_malloc(len ? len : 1);
+            memcpy(slot->data, data, len);
+            held_bytes += len;
+        }
+
+        memset(slot->sha256, 0, SHA256_DIGEST_LENGTH);
+        memset(slot->fast, 0, FAST_DIGEST_LENGTH);
+        slot->ready = true;
+        slot->claimed = false;
+        pthread_cond_broadcast(&memo_cond);
+    }
+
+    pthread_mutex_unlock(&memo_mutex);
+}
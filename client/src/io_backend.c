@@ -0,0 +1,967 @@
+#include "io_backend.h"
+#include "config.h"
+#include "governor.h"
+#include "hashing.h"
+#include "logging.h"
+#include "metrics.h"
+#include "uring.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/capability.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#endif
+
+#define IO_UNSUPPORTED 1
+
+_Static_assert(IO_URING_ENTRIES >= 3 * HASH_BATCH_FILES,
+               "a batch's reads and the drops and closes linked to them must fit in one submission");
+
+typedef struct
+{
+    unsigned char *pread_buf;
+    unsigned char *direct_buf;
+    unsigned char *batch_buf; // HASH_BATCH_FILES slots of IO_BATCH_SLOT_SIZE, registered with the ring
+    unsigned char *spill;     // batch files read through the synchronous path
+    size_t         spill_len;
+    size_t         spill_capacity;
+    unsigned char *residency; // mincore() vector of the file being read in cache-neutral mode
+    size_t         residency_capacity;
+    uring_t       *ring;
+} io_buffers_t;
+
+// Which pages of a file range were in the page cache before we read it, taken with one mincore() of an untouched
+// mapping, so that in cache-neutral mode the pages our reads bring in can be dropped again as the read passes them.
+typedef struct
+{
+    int    fd;
+    off_t  base; // page-aligned file offset of the first page
+    size_t pages;
+    size_t passed; // pages already dropped, or left alone because they were cached
+    size_t cold;   // pages that were not resident
+    bool   probed; // mincore() would not tell the truth for this file; residency is probed with RWF_NOWAIT reads
+} residency_t;
+
+static pthread_key_t  buffers_key;
+static pthread_once_t io_once = PTHREAD_ONCE_INIT;
+static size_t         page_bytes;
+static bool           fowner_capable; // CAP_FOWNER was effective when I/O started
+
+// A mapped file truncated underneath us raises SIGBUS; the faulting thread jumps back and reports an error.
+static _Thread_local sigjmp_buf *volatile bus_jump = NULL;
+
+static void free_buffers(void *arg)
+{
+    io_buffers_t *buffers = arg;
+
+    uring_destroy(buffers->ring);
+    free(buffers->pread_buf);
+    free(buffers->direct_buf);
+    free(buffers->batch_buf);
+    free(buffers->spill);
+    free(buffers->residency);
+    free(buffers);
+}
+
+static void handle_sigbus(int sig, siginfo_t *info, void *ucontext)
+{
+    (void)info;
+    (void)ucontext;
+
+    if (bus_jump)
+        siglongjmp(*bus_jump, 1);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+#ifdef __linux__
+
+static bool has_cap_fowner(void)
+{
+    struct __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+    struct __user_cap_data_struct   data[_LINUX_CAPABILITY_U32S_3];
+
+    if (syscall(SYS_capget, &header, data) != 0)
+        return false;
+
+    return (data[CAP_FOWNER / 32].effective & (1u << (CAP_FOWNER % 32))) != 0;
+}
+
+#else
+
+static bool has_cap_fowner(void)
+{
+    return false;
+}
+
+#endif
+
+static void io_init(void)
+{
+    struct sigaction sa;
+
+    pthread_key_create(&buffers_key, free_buffers);
+    page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+    fowner_capable = has_cap_fowner();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handle_sigbus;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static io_buffers_t *thread_buffers(void)
+{
+    io_buffers_t *buffers = pthread_getspecific(buffers_key);
+
+    if (!buffers)
+    {
+        buffers = safe_malloc(sizeof(io_buffers_t));
+        memset(buffers, 0, sizeof(io_buffers_t));
+        pthread_setspecific(buffers_key, buffers);
+    }
+
+    return buffers;
+}
+
+io_backend_t io_select_backend(const struct stat *st)
+{
+    if (IO_FORCE_BACKEND != IO_BACKEND_AUTO)
+        return IO_FORCE_BACKEND;
+
+    // Pseudo-files report size 0 but still have content; only a read loop sees all of it.
+    if (!S_ISREG(st->st_mode) || st->st_size < IO_MMAP_MIN_SIZE)
+        return IO_BACKEND_PREAD;
+
+    if (st->st_size < IO_DIRECT_MIN_SIZE)
+        return IO_BACKEND_MMAP;
+
+    return IO_BACKEND_DIRECT;
+}
+
+const char *io_backend_name(io_backend_t backend)
+{
+    switch (backend)
+    {
+        case IO_BACKEND_AUTO: return "auto";
+        case IO_BACKEND_STDIO: return "stdio";
+        case IO_BACKEND_PREAD: return "pread";
+        case IO_BACKEND_MMAP: return "mmap";
+        case IO_BACKEND_DIRECT: return "direct";
+        default: return "unknown";
+    }
+}
+
+// Every read is charged to the governor's budgets and to the metrics of the entry being checked.
+static void account_read(size_t bytes, uint64_t service_ns)
+{
+    governor_account_read(bytes, service_ns);
+    metrics_count(METRIC_BYTES_READ, bytes);
+}
+
+static int open_readonly(int dir_fd, const char *name, int extra_flags)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOATIME | extra_flags);
+
+    metrics_count(METRIC_OPEN_CALLS, 1);
+
+    // O_NOATIME is refused for files we do not own unless we hold CAP_FOWNER.
+    if (fd == -1 && errno == EPERM)
+        fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | extra_flags);
+
+    return fd;
+}
+
+#ifdef __linux__
+
+// Linux answers mincore() with every page resident unless the caller owns the file, holds CAP_FOWNER or may write to
+// it, so that unprivileged users cannot watch the page cache of files they can only read. st may be NULL.
+static bool mincore_trusted(int fd, const struct stat *st)
+{
+    struct stat now;
+
+    if (fowner_capable)
+        return true;
+
+    if (!st)
+    {
+        metrics_count(METRIC_STAT_CALLS, 1);
+        if (fstat(fd, &now) != 0)
+            return false;
+        st = &now;
+    }
+
+    return st->st_uid == geteuid();
+}
+
+// RWF_NOWAIT reads tell whether a page is cached without waiting for it, but a miss still starts reading it in. Pages
+// are probed one at a time with random access advised, so a miss brings in only the page probed, which was cold and is
+// dropped with the rest, and last to first, so readahead set off by a cached page only reaches pages already probed.
+static bool probe_pages(io_buffers_t *buffers, int fd, off_t offset, size_t pages, unsigned char *vec)
+{
+    bool ok = true;
+
+    if (!buffers->pread_buf)
+        buffers->pread_buf = safe_malloc(IO_PREAD_BLOCK_SIZE);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+    for (size_t i = pages; ok && i-- > 0;)
+    {
+        struct iovec iov = {buffers->pread_buf, page_bytes};
+        ssize_t      n;
+
+        do
+        {
+            n = preadv2(fd, &iov, 1, offset + (off_t)(i * page_bytes), RWF_NOWAIT);
+            metrics_count(METRIC_READ_CALLS, 1);
+        } while (n == -1 && errno == EINTR);
+
+        // Past EOF there is nothing of ours to drop, so such pages count as cached.
+        if (n >= 0)
+            vec[i] = 1;
+        else if (errno == EAGAIN)
+            vec[i] = 0;
+        else
+            ok = false;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+
+    return ok;
+}
+
+#else
+
+static bool mincore_trusted(int fd, const struct stat *st)
+{
+    (void)fd;
+    (void)st;
+
+    return true;
+}
+
+static bool probe_pages(io_buffers_t *buffers, int fd, off_t offset, size_t pages, unsigned char *vec)
+{
+    (void)buffers;
+    (void)fd;
+    (void)offset;
+    (void)pages;
+    (void)vec;
+
+    return false;
+}
+
+#endif
+
+// Fills vec with the residency of pages of the snapshot's file from offset, which is page-aligned.
+static bool page_residency(io_buffers_t *buffers, const residency_t *res, off_t offset, size_t pages,
+                           unsigned char *vec)
+{
+    void *map;
+    bool  ok;
+
+    if (res->probed)
+        return probe_pages(buffers, res->fd, offset, pages, vec);
+
+    map = mmap(NULL, pages * page_bytes, PROT_READ, MAP_SHARED, res->fd, offset);
+    metrics_count(METRIC_MMAP_CALLS, 1);
+    if (map == MAP_FAILED)
+        return false;
+
+    ok = mincore(map, pages * page_bytes, vec) == 0;
+    munmap(map, pages * page_bytes);
+
+    return ok;
+}
+
+static bool residency_snapshot(io_buffers_t *buffers, int fd, off_t offset, size_t length, residency_t *res)
+{
+    size_t span;
+
+    if (!IO_CACHE_NEUTRAL || length == 0)
+        return false;
+
+    res->fd = fd;
+    res->base = offset - offset % (off_t)page_bytes;
+    span = (size_t)(offset - res->base) + length;
+    res->pages = span / page_bytes + (span % page_bytes != 0);
+    res->passed = 0;
+    res->cold = 0;
+    res->probed = !mincore_trusted(fd, NULL);
+
+    if (res->pages > buffers->residency_capacity)
+    {
+        buffers->residency_capacity = res->pages;
+        buffers->residency = safe_realloc(buffers->residency, res->pages);
+    }
+
+    if (!page_residency(buffers, res, res->base, res->pages, buffers->residency))
+        return false;
+
+    for (size_t i = 0; i < res->pages; i++)
+        res->cold += !(buffers->residency[i] & 1);
+
+    return true;
+}
+
+// posix_fadvise() succeeds even for pages it cannot drop, such as ones mapped elsewhere, so released bytes are what
+// actually left the cache. A probed file cannot be checked without reading the pages back in; there the drop is taken
+// as done, which only overstates it for pages another process maps or dirties while we read.
+static size_t released_bytes(io_buffers_t *buffers, const residency_t *res, off_t offset, size_t pages)
+{
+    unsigned char vec[256];
+    size_t        released = 0;
+
+    if (res->probed)
+        return pages * page_bytes;
+
+    while (pages > 0)
+    {
+        size_t chunk = pages < sizeof(vec) ? pages : sizeof(vec);
+
+        if (!page_residency(buffers, res, offset, chunk, vec))
+            return released;
+
+        for (size_t i = 0; i < chunk; i++)
+            released += !(vec[i] & 1);
+
+        offset += (off_t)(chunk * page_bytes);
+        pages -= chunk;
+    }
+
+    return released * page_bytes;
+}
+
+// Drops the pages wholly below offset that were not resident at the snapshot. Readahead beyond offset is dropped when
+// the read gets there, or by a final call with the end of the range.
+static void residency_drop(io_buffers_t *buffers, residency_t *res, off_t offset)
+{
+    size_t upto = offset > res->base ? (size_t)(offset - res->base) / page_bytes : 0;
+
+    if (upto > res->pages)
+        upto = res->pages;
+
+    while (res->passed < upto)
+    {
+        size_t first = res->passed;
+        size_t end;
+
+        while (first < upto && buffers->residency[first] & 1)
+            first++;
+        for (end = first; end < upto && !(buffers->residency[end] & 1); end++)
+            ;
+
+        if (end > first)
+        {
+            off_t  start = res->base + (off_t)(first * page_bytes);
+            size_t bytes = (end - first) * page_bytes;
+
+            metrics_count(METRIC_CACHE_FILLED_BYTES, bytes);
+            if (posix_fadvise(res->fd, start, (off_t)bytes, POSIX_FADV_DONTNEED) == 0)
+                metrics_count(METRIC_CACHE_RELEASED_BYTES, released_bytes(buffers, res, start, end - first));
+        }
+        res->passed = end;
+    }
+}
+
+static void residency_finish(io_buffers_t *buffers, residency_t *res)
+{
+    residency_drop(buffers, res, res->base + (off_t)(res->pages * page_bytes));
+}
+
+static int read_stdio(const char *path, io_consume_fn consume, void *arg)
+{
+    unsigned char buf[BUF_SIZE];
+    size_t        n;
+    FILE         *fp = open_file(path);
+    uint64_t      start = governor_clock_ns();
+
+    metrics_count(METRIC_OPEN_CALLS, 1);
+    if (!fp)
+        return -1;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        metrics_count(METRIC_READ_CALLS, 1);
+        account_read(n, governor_clock_ns() - start);
+        consume(buf, n, arg);
+        start = governor_clock_ns();
+    }
+
+    int rc = ferror(fp) ? -1 : 0;
+    fclose(fp);
+
+    return rc;
+}
+
+// Reads [offset, offset + length) in IO_PREAD_BLOCK_SIZE blocks, stopping early at EOF. With a residency snapshot, the
+// pages each block brought into the page cache are dropped once it has been consumed.
+static int read_pread_range(int fd, off_t offset, size_t length, residency_t *res, io_consume_fn consume, void *arg)
+{
+    io_buffers_t *buffers = thread_buffers();
+    off_t         start_offset = offset;
+    ssize_t       n;
+    uint64_t      start;
+
+    if (!buffers->pread_buf)
+        buffers->pread_buf = safe_malloc(IO_PREAD_BLOCK_SIZE);
+
+    while (length > 0)
+    {
+        size_t want = length < IO_PREAD_BLOCK_SIZE ? length : IO_PREAD_BLOCK_SIZE;
+
+        start = governor_clock_ns();
+        n = pread(fd, buffers->pread_buf, want, offset);
+        metrics_count(METRIC_READ_CALLS, 1);
+        if (n == 0)
+            break;
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return offset == start_offset ? IO_UNSUPPORTED : -1;
+        }
+
+        account_read((size_t)n, governor_clock_ns() - start);
+        consume(buffers->pread_buf, (size_t)n, arg);
+        offset += n;
+        length -= (size_t)n;
+        if (res)
+            residency_drop(buffers, res, offset);
+    }
+
+    if (res)
+        residency_finish(buffers, res);
+
+    return 0;
+}
+
+static int read_pread(int fd, residency_t *res, io_consume_fn consume, void *arg)
+{
+    return read_pread_range(fd, 0, SIZE_MAX, res, consume, arg);
+}
+
+static int read_mmap(int fd, const struct stat *st, residency_t *res, io_consume_fn consume, void *arg)
+{
+    io_buffers_t  *buffers = thread_buffers();
+    sigjmp_buf     jump;
+    unsigned char *map;
+    size_t         size = (size_t)st->st_size;
+    struct stat    now;
+    volatile int   rc = 0;
+
+    if (size == 0)
+        return IO_UNSUPPORTED;
+
+    // The other backends read to EOF. A file whose size changed since it was stat'ed goes to pread, so its digest does
+    // not depend on the backend its stat'ed size picked.
+    metrics_count(METRIC_STAT_CALLS, 1);
+    if (fstat(fd, &now) != 0 || now.st_size != st->st_size)
+        return IO_UNSUPPORTED;
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    metrics_count(METRIC_MMAP_CALLS, 1);
+    if (map == MAP_FAILED)
+        return IO_UNSUPPORTED;
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (sigsetjmp(jump, 1) == 0)
+    {
+        bus_jump = &jump;
+
+        for (size_t offset = 0; offset < size; offset += IO_PREAD_BLOCK_SIZE)
+        {
+            size_t chunk = size - offset < IO_PREAD_BLOCK_SIZE ? size - offset : IO_PREAD_BLOCK_SIZE;
+
+            // Page faults are folded into consume, so mapped chunks count against the budget but not the latency.
+            account_read(chunk, 0);
+            consume(map + offset, chunk, arg);
+
+            // Our own mapping pins the pages, so it lets go of them first.
+            if (res)
+            {
+                madvise(map + offset, chunk, MADV_DONTNEED);
+                residency_drop(buffers, res, (off_t)(offset + chunk));
+            }
+        }
+    }
+    else
+    {
+        errno = EIO;
+        rc = -1;
+    }
+
+    bus_jump = NULL;
+    munmap(map, size);
+
+    if (res)
+        residency_finish(buffers, res);
+
+    return rc;
+}
+
+static int read_direct(int dir_fd, const char *name, io_consume_fn consume, void *arg)
+{
+    io_buffers_t *buffers = thread_buffers();
+    off_t         offset = 0;
+    ssize_t       n;
+    int           fd = open_readonly(dir_fd, name, O_DIRECT);
+    uint64_t      start;
+
+    // Filesystems such as tmpfs reject O_DIRECT with EINVAL.
+    if (fd == -1)
+        return IO_UNSUPPORTED;
+
+    if (!buffers->direct_buf && posix_memalign((void **)&buffers->direct_buf, IO_DIRECT_ALIGN, IO_PREAD_BLOCK_SIZE) != 0)
+    {
+        buffers->direct_buf = NULL;
+        close(fd);
+        return IO_UNSUPPORTED;
+    }
+
+    while ((start = governor_clock_ns(), n = pread(fd, buffers->direct_buf, IO_PREAD_BLOCK_SIZE, offset)) != 0)
+    {
+        metrics_count(METRIC_READ_CALLS, 1);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return offset == 0 ? IO_UNSUPPORTED : -1;
+        }
+
+        account_read((size_t)n, governor_clock_ns() - start);
+        consume(buffers->direct_buf, (size_t)n, arg);
+        offset += n;
+
+        // A short read marks EOF; the next unaligned offset would be rejected by O_DIRECT.
+        if ((size_t)n < IO_PREAD_BLOCK_SIZE)
+            break;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+// For callers that split one file across workers; the file is admitted by the governor once, when it is opened.
+int io_open_file_at(int dir_fd, const char *name)
+{
+    pthread_once(&io_once, io_init);
+    governor_admit_file();
+
+    return open_readonly(dir_fd, name, 0);
+}
+
+int io_read_range(int fd, off_t offset, size_t length, io_consume_fn consume, void *arg)
+{
+    residency_t res;
+
+    pthread_once(&io_once, io_init);
+
+    bool tracked = residency_snapshot(thread_buffers(), fd, offset, length, &res);
+
+    return read_pread_range(fd, offset, length, tracked ? &res : NULL, consume, arg) == 0 ? 0 : -1;
+}
+
+int io_read_file(const char *path, const struct stat *st, io_consume_fn consume, void *arg)
+{
+    return io_read_file_at(AT_FDCWD, path, path, st, consume, arg);
+}
+
+static int read_admitted_file_at(int dir_fd, const char *name, const char *path, const struct stat *st,
+                                 io_consume_fn consume, void *arg)
+{
+    io_backend_t backend = io_select_backend(st);
+    int          rc = IO_UNSUPPORTED;
+    int          fd;
+    residency_t  res;
+    bool         tracked;
+
+    if (backend == IO_BACKEND_DIRECT)
+    {
+        rc = read_direct(dir_fd, name, consume, arg);
+        backend = IO_BACKEND_MMAP;
+    }
+
+    if (rc == IO_UNSUPPORTED && backend != IO_BACKEND_STDIO)
+    {
+        fd = open_readonly(dir_fd, name, 0);
+        if (fd == -1)
+        {
+            log_message(LOG_ERR, "Error opening file %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        tracked = S_ISREG(st->st_mode) && residency_snapshot(thread_buffers(), fd, 0, (size_t)st->st_size, &res);
+
+        // In cache-neutral mode a large file with nothing cached skips the page cache altogether.
+        if (tracked && res.cold == res.pages && st->st_size >= IO_CACHE_NEUTRAL_DIRECT_MIN_SIZE)
+            rc = read_direct(dir_fd, name, consume, arg);
+
+        if (rc == IO_UNSUPPORTED && backend == IO_BACKEND_MMAP)
+            rc = read_mmap(fd, st, tracked ? &res : NULL, consume, arg);
+
+        if (rc == IO_UNSUPPORTED)
+            rc = read_pread(fd, tracked ? &res : NULL, consume, arg);
+
+        close(fd);
+    }
+
+    if (rc == IO_UNSUPPORTED)
+        rc = read_stdio(path, consume, arg);
+
+    if (rc != 0)
+        log_message(LOG_ERR, "Error reading file %s: %s", path, strerror(errno));
+
+    return rc;
+}
+
+// Opens name relative to dir_fd, sparing the kernel a walk of the full path; path is only used for messages and stdio.
+int io_read_file_at(int dir_fd, const char *name, const char *path, const struct stat *st, io_consume_fn consume, void *arg)
+{
+    pthread_once(&io_once, io_init);
+    governor_admit_file();
+
+    return read_admitted_file_at(dir_fd, name, path, st, consume, arg);
+}
+
+#ifdef __linux__
+
+static atomic_bool uring_disabled;
+
+// The first failure, at setup or later, turns io_uring off for the process; threads that still hold a working ring
+// keep using it.
+static void drop_ring(io_buffers_t *buffers, int priority, const char *what)
+{
+    if (!atomic_exchange(&uring_disabled, true))
+        log_message(priority, "io_uring %s (%s); small files are read with system calls", what, strerror(errno));
+
+    uring_destroy(buffers->ring);
+    buffers->ring = NULL;
+}
+
+static uring_t *thread_ring(io_buffers_t *buffers)
+{
+    size_t size = (size_t)HASH_BATCH_FILES * IO_BATCH_SLOT_SIZE;
+
+    if (!IO_URING || buffers->ring || atomic_load(&uring_disabled))
+        return buffers->ring;
+
+    if (!buffers->batch_buf && posix_memalign((void **)&buffers->batch_buf, IO_DIRECT_ALIGN, size) != 0)
+    {
+        buffers->batch_buf = NULL;
+        return NULL;
+    }
+
+    buffers->ring = uring_create(IO_URING_ENTRIES, buffers->batch_buf, size);
+    if (!buffers->ring)
+        drop_ring(buffers, LOG_INFO, "is unavailable");
+
+    return buffers->ring;
+}
+
+static void store_result(uint64_t user_data, int result, void *arg)
+{
+    int *results = arg;
+
+    results[user_data] = result;
+}
+
+static void statx_to_stat(const struct statx *sx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = (ino_t)sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = (off_t)sx->stx_size;
+    st->st_blksize = (blksize_t)sx->stx_blksize;
+    st->st_blocks = (blkcnt_t)sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+// Stats up to HASH_BATCH_FILES names per io_uring_enter; returns how many were done before the ring gave out.
+static size_t stat_batch_uring(uring_t *ring, io_buffers_t *buffers, int dir_fd, const char *const names[],
+                               size_t count, struct stat st[], int errors[])
+{
+    struct statx sx[HASH_BATCH_FILES];
+    int          results[HASH_BATCH_FILES];
+    size_t       done = 0;
+
+    while (done < count)
+    {
+        size_t n = count - done < HASH_BATCH_FILES ? count - done : HASH_BATCH_FILES;
+
+        for (size_t i = 0; i < n; i++)
+            uring_prep_statx(ring, dir_fd, names[done + i], &sx[i], i);
+
+        if (uring_run(ring, store_result, results) != 0)
+        {
+            drop_ring(buffers, LOG_WARNING, "failed");
+            break;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            errors[done + i] = results[i] < 0 ? -results[i] : 0;
+            if (results[i] >= 0)
+                statx_to_stat(&sx[i], &st[done + i]);
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+// In cache-neutral mode the batch is first read only from the page cache. A file that comes up short has the rest read
+// in a third submission, with a linked fadvise dropping the pages from the first missing one on; small files are a few
+// pages, so a cached page after a missing one is rare and is dropped too. Such files stay open until the drop has been
+// checked. results[] becomes each file's total.
+static bool read_cold_tails(uring_t *ring, io_buffers_t *buffers, const io_batch_file_t files[], size_t count,
+                            const int fds[], int results[])
+{
+    int tails[HASH_BATCH_FILES];
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t cached;
+
+        tails[i] = 0;
+        if (fds[i] < 0)
+            continue;
+
+        if (results[i] == -EAGAIN)
+            results[i] = 0;
+        cached = results[i] > 0 ? (size_t)results[i] : 0;
+
+        if (results[i] < 0 || cached == IO_BATCH_SLOT_SIZE || (off_t)cached >= files[i].st->st_size)
+        {
+            uring_prep_close(ring, fds[i]);
+            continue;
+        }
+
+        uring_prep_read(ring, fds[i], buffers->batch_buf + i * IO_BATCH_SLOT_SIZE + cached,
+                        (unsigned)(IO_BATCH_SLOT_SIZE - cached), cached, URING_READ_DROP, i);
+        tails[i] = -ECANCELED;
+    }
+
+    bool ok = uring_run(ring, store_result, tails) == 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fds[i] < 0 || results[i] < 0 || tails[i] == 0)
+            continue;
+
+        if (ok && tails[i] > 0)
+        {
+            residency_t res = {.fd = fds[i], .probed = !mincore_trusted(fds[i], files[i].st)};
+            size_t      first = (size_t)results[i] - (size_t)results[i] % page_bytes;
+            size_t      end = (size_t)(results[i] + tails[i]);
+            size_t      pages = (end - first + page_bytes - 1) / page_bytes;
+
+            metrics_count(METRIC_CACHE_FILLED_BYTES, pages * page_bytes);
+            metrics_count(METRIC_CACHE_RELEASED_BYTES, released_bytes(buffers, &res, (off_t)first, pages));
+        }
+
+        close(fds[i]);
+        results[i] = tails[i] < 0 ? tails[i] : results[i] + tails[i];
+    }
+
+    return ok;
+}
+
+// Opens every file in one submission, then reads each into its slot with a linked close in a second. Files that fail
+// either step, or fill their slot and may hold more, are left for the synchronous path, which reports errors.
+static void read_batch_uring(uring_t *ring, io_buffers_t *buffers, int dir_fd, io_batch_file_t files[], size_t count,
+                             bool done[])
+{
+    int      fds[HASH_BATCH_FILES];
+    int      results[HASH_BATCH_FILES];
+    size_t   opened = 0;
+    uint64_t start;
+    uint64_t share;
+    unsigned flags = IO_CACHE_NEUTRAL ? URING_READ_NOWAIT : URING_READ_CLOSE;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fds[i] = -1;
+        uring_prep_openat(ring, dir_fd, files[i].name, O_RDONLY | O_CLOEXEC | O_NOATIME, i);
+    }
+
+    bool ok = uring_run(ring, store_result, fds) == 0;
+    bool retry = false;
+
+    // As in open_readonly(), files we do not own are opened again without O_NOATIME.
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        if (fds[i] == -EPERM)
+        {
+            uring_prep_openat(ring, dir_fd, files[i].name, O_RDONLY | O_CLOEXEC, i);
+            retry = true;
+        }
+    }
+
+    if (!ok || (retry && uring_run(ring, store_result, fds) != 0))
+    {
+        for (size_t i = 0; i < count; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+        drop_ring(buffers, LOG_WARNING, "failed");
+        return;
+    }
+
+    start = governor_clock_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        results[i] = -ECANCELED;
+        if (fds[i] < 0)
+            continue;
+
+        uring_prep_read(ring, fds[i], buffers->batch_buf + i * IO_BATCH_SLOT_SIZE, IO_BATCH_SLOT_SIZE, 0, flags, i);
+        opened++;
+    }
+
+    if (opened > 0 && uring_run(ring, store_result, results) != 0)
+    {
+        // Cache-neutral reads have no linked closes, so nothing has closed the files yet.
+        for (size_t i = 0; IO_CACHE_NEUTRAL && i < count; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+        drop_ring(buffers, LOG_WARNING, "failed");
+        return;
+    }
+
+    if (IO_CACHE_NEUTRAL && opened > 0 && !read_cold_tails(ring, buffers, files, count, fds, results))
+    {
+        drop_ring(buffers, LOG_WARNING, "failed");
+        return;
+    }
+    share = opened > 0 ? (governor_clock_ns() - start) / opened : 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fds[i] < 0 || results[i] < 0 || results[i] == IO_BATCH_SLOT_SIZE)
+            continue;
+
+        files[i].data = buffers->batch_buf + i * IO_BATCH_SLOT_SIZE;
+        files[i].len = (size_t)results[i];
+        files[i].ok = true;
+        done[i] = true;
+        account_read(files[i].len, share);
+    }
+}
+
+#endif
+
+static void spill_consume(const unsigned char *buf, size_t len, void *arg)
+{
+    io_buffers_t *buffers = arg;
+
+    if (buffers->spill_len + len > buffers->spill_capacity)
+    {
+        while (buffers->spill_len + len > buffers->spill_capacity)
+            buffers->spill_capacity = buffers->spill_capacity ? buffers->spill_capacity * 2 : IO_BATCH_SLOT_SIZE;
+        buffers->spill = safe_realloc(buffers->spill, buffers->spill_capacity);
+    }
+
+    memcpy(buffers->spill + buffers->spill_len, buf, len);
+    buffers->spill_len += len;
+}
+
+// Stats names relative to dir_fd, following symlinks like fstatat(); errors[i] is 0 or the errno for names[i].
+void io_stat_batch_at(int dir_fd, const char *const names[], size_t count, struct stat st[], int errors[])
+{
+    size_t done = 0;
+
+    pthread_once(&io_once, io_init);
+
+#ifdef __linux__
+    io_buffers_t *buffers = thread_buffers();
+    uring_t      *ring = thread_ring(buffers);
+
+    if (ring)
+        done = stat_batch_uring(ring, buffers, dir_fd, names, count, st, errors);
+#endif
+
+    for (size_t i = done; i < count; i++)
+    {
+        metrics_count(METRIC_STAT_CALLS, 1);
+        errors[i] = fstatat(dir_fd, names[i], &st[i], 0) == -1 ? errno : 0;
+    }
+}
+
+// Reads up to HASH_BATCH_FILES small files of one directory. With io_uring they are opened, read and closed in two
+// submissions; files it cannot finish, or all of them without it, go through the backends of io_read_file_at().
+void io_read_batch_at(int dir_fd, io_batch_file_t files[], size_t count)
+{
+    io_buffers_t *buffers;
+    size_t        offsets[HASH_BATCH_FILES];
+    bool          done[HASH_BATCH_FILES] = {false};
+
+    pthread_once(&io_once, io_init);
+    buffers = thread_buffers();
+    buffers->spill_len = 0;
+
+    if (count > HASH_BATCH_FILES)
+        count = HASH_BATCH_FILES;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        governor_admit_file();
+        files[i].data = NULL;
+        files[i].len = 0;
+        files[i].ok = false;
+    }
+
+#ifdef __linux__
+    uring_t *ring = thread_ring(buffers);
+
+    if (ring)
+        read_batch_uring(ring, buffers, dir_fd, files, count, done);
+#endif
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (done[i])
+            continue;
+
+        offsets[i] = buffers->spill_len;
+        files[i].ok = read_admitted_file_at(dir_fd, files[i].name, files[i].path, files[i].st, spill_consume, buffers) == 0;
+        files[i].len = buffers->spill_len - offsets[i];
+    }
+
+    // The spill buffer has stopped growing, so its offsets can now be turned into pointers.
+    for (size_t i = 0; i < count; i++)
+        if (!done[i] && files[i].ok)
+            files[i].data = buffers->spill + offsets[i];
+}
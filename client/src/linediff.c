@@ -0,0 +1,436 @@
+#include "linediff.h"
+#include "config.h"
+#include "digest.h"
+#include "io_backend.h"
+#include "logging.h"
+#include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define LINE_STORE_MAGIC "HLV1"
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t reserved;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    int64_t  ctime_sec;
+    int64_t  ctime_nsec;
+    uint64_t count;
+} line_store_header_t;
+
+typedef struct
+{
+    EVP_MD_CTX    *ctx;
+    line_vector_t *lines;
+    bool           open_line;
+    io_consume_fn  tee;
+    void          *tee_arg;
+} line_builder_t;
+
+static char store_dir[PATH_MAX] = LINE_STORE_DIR;
+
+typedef enum
+{
+    EDIT_EQUAL,
+    EDIT_DELETE,
+    EDIT_INSERT
+} edit_t;
+
+static void push_line(line_builder_t *builder)
+{
+    line_vector_t *lines = builder->lines;
+
+    if (lines->count == lines->capacity)
+    {
+        lines->capacity = lines->capacity ? lines->capacity * 2 : 256;
+        lines->digests = safe_realloc(lines->digests, lines->capacity * sizeof(*lines->digests));
+    }
+
+    EVP_DigestFinal_ex(builder->ctx, lines->digests[lines->count++], NULL);
+    EVP_DigestInit_ex(builder->ctx, digest_sha256(), NULL);
+    builder->open_line = false;
+}
+
+// memchr is vectorized in libc, so each chunk is scanned for newlines many bytes at a time without copying.
+static void consume_lines(const unsigned char *buf, size_t len, void *arg)
+{
+    line_builder_t *builder = arg;
+
+    if (builder->tee)
+        builder->tee(buf, len, builder->tee_arg);
+
+    while (len > 0)
+    {
+        const unsigned char *nl = memchr(buf, '\n', len);
+        size_t               seg = nl ? (size_t)(nl - buf) + 1 : len;
+
+        EVP_DigestUpdate(builder->ctx, buf, seg);
+        builder->open_line = true;
+
+        if (nl)
+            push_line(builder);
+
+        buf += seg;
+        len -= seg;
+    }
+}
+
+// tee, when given, sees every chunk as well, so a caller can digest the whole file from the same read.
+int line_vector_build(const char *path, const struct stat *st, line_vector_t *out, io_consume_fn tee, void *tee_arg)
+{
+    line_builder_t builder;
+
+    memset(out, 0, sizeof(line_vector_t));
+    out->st = *st;
+
+    builder.ctx = digest_acquire();
+    builder.lines = out;
+    builder.open_line = false;
+    builder.tee = tee;
+    builder.tee_arg = tee_arg;
+
+    if (!builder.ctx)
+        return -1;
+
+    if (io_read_file(path, st, consume_lines, &builder) != 0)
+    {
+        digest_release(builder.ctx);
+        line_vector_free(out);
+        return -1;
+    }
+
+    if (builder.open_line)
+        push_line(&builder);
+
+    digest_release(builder.ctx);
+
+    return 0;
+}
+
+// Line vectors are kept under LINE_STORE_DIR unless another directory is chosen before the first check. A directory
+// whose store paths would not fit in PATH_MAX is refused and the current one kept.
+int line_store_open(const char *dir)
+{
+    if (strlen(dir) + 1 + 32 >= sizeof(store_dir))
+    {
+        log_message(LOG_ERR, "Line store directory too long, keeping %s: %s", store_dir, dir);
+        return -1;
+    }
+
+    snprintf(store_dir, sizeof(store_dir), "%s", dir);
+
+    return 0;
+}
+
+static int store_path_for(const char *path, char *out, size_t size)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char          hex[HASH_HEX_LEN + 1];
+    int           n;
+
+    digest_sha256_buffer(path, strlen(path), digest);
+    binary_to_hex(digest, 16, hex);
+    n = snprintf(out, size, "%s/%s", store_dir, hex);
+
+    return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+// A store whose count does not fit the file is corrupt or truncated; like a missing one, it is rebuilt by the caller.
+int line_vector_load(const char *path, line_vector_t *out)
+{
+    char                store[PATH_MAX];
+    line_store_header_t header;
+    struct stat         st;
+    FILE               *fp;
+
+    memset(out, 0, sizeof(line_vector_t));
+    if (store_path_for(path, store, sizeof(store)) != 0)
+        return -1;
+
+    fp = fopen(store, "rb");
+    if (!fp)
+        return -1;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, LINE_STORE_MAGIC, 4) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    if (fstat(fileno(fp), &st) == -1 || (uint64_t)st.st_size < sizeof(header) ||
+        header.count > ((uint64_t)st.st_size - sizeof(header)) / sizeof(*out->digests))
+    {
+        log_message(LOG_WARNING, "Ignoring corrupt line store %s for %s", store, path);
+        fclose(fp);
+        return -1;
+    }
+
+    out->count = (size_t)header.count;
+    out->capacity = out->count;
+    out->digests = safe_malloc((out->count ? out->count : 1) * sizeof(*out->digests));
+
+    if (fread(out->digests, sizeof(*out->digests), out->count, fp) != out->count)
+    {
+        fclose(fp);
+        line_vector_free(out);
+        return -1;
+    }
+
+    fclose(fp);
+
+    out->st.st_dev = (dev_t)header.dev;
+    out->st.st_ino = (ino_t)header.ino;
+    out->st.st_size = (off_t)header.size;
+    out->st.st_mtim.tv_sec = (time_t)header.mtime_sec;
+    out->st.st_mtim.tv_nsec = (long)header.mtime_nsec;
+    out->st.st_ctim.tv_sec = (time_t)header.ctime_sec;
+    out->st.st_ctim.tv_nsec = (long)header.ctime_nsec;
+
+    return 0;
+}
+
+int line_vector_save(const char *path, const line_vector_t *lines)
+{
+    char                store[PATH_MAX];
+    char                tmp_path[PATH_MAX + 8];
+    line_store_header_t header;
+    FILE               *fp;
+
+    if (store_path_for(path, store, sizeof(store)) != 0)
+    {
+        log_message(LOG_ERR, "Failed to write line hashes for %s: store path too long", path);
+        return -1;
+    }
+
+    fp = open_atomic(store, tmp_path, sizeof(tmp_path));
+    if (!fp)
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LINE_STORE_MAGIC, 4);
+    header.dev = (uint64_t)lines->st.st_dev;
+    header.ino = (uint64_t)lines->st.st_ino;
+    header.size = (int64_t)lines->st.st_size;
+    header.mtime_sec = (int64_t)lines->st.st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t)lines->st.st_mtim.tv_nsec;
+    header.ctime_sec = (int64_t)lines->st.st_ctim.tv_sec;
+    header.ctime_nsec = (int64_t)lines->st.st_ctim.tv_nsec;
+    header.count = lines->count;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        (lines->count > 0 && fwrite(lines->digests, sizeof(*lines->digests), lines->count, fp) != lines->count))
+    {
+        log_message(LOG_ERR, "Failed to write line hashes for %s: %s", path, strerror(errno));
+        fclose(fp);
+        remove(tmp_path);
+        return -1;
+    }
+
+    return commit_atomic(fp, tmp_path, store);
+}
+
+void line_vector_free(line_vector_t *lines)
+{
+    free(lines->digests);
+    lines->digests = NULL;
+    lines->count = 0;
+    lines->capacity = 0;
+}
+
+bool line_vector_equal(const line_vector_t *a, const line_vector_t *b)
+{
+    return a->count == b->count &&
+           (a->count == 0 || memcmp(a->digests, b->digests, a->count * sizeof(*a->digests)) == 0);
+}
+
+static bool same_line(const line_vector_t *a, size_t i, const line_vector_t *b, size_t j)
+{
+    return memcmp(a->digests[i], b->digests[j], SHA256_DIGEST_LENGTH) == 0;
+}
+
+// Myers' O((N+M)D) shortest edit script over the trimmed middle of both vectors.
+// The V array of every round is kept for backtracking, so D is capped at LINE_DIFF_MAX_EDITS.
+static edit_t *shortest_edit(const line_vector_t *a, const line_vector_t *b, size_t start, size_t n, size_t m, size_t *edit_count)
+{
+    long    max = (long)(n + m) < LINE_DIFF_MAX_EDITS ? (long)(n + m) : LINE_DIFF_MAX_EDITS;
+    long   *v = safe_malloc((size_t)(2 * max + 3) * sizeof(long));
+    long  **trace = safe_malloc((size_t)(max + 1) * sizeof(long *));
+    long    found = -1;
+    edit_t *edits;
+    long    x;
+    long    y;
+
+    memset(v, 0, (size_t)(2 * max + 3) * sizeof(long));
+
+    for (long d = 0; d <= max && found < 0; d++)
+    {
+        // V[k] lives at v[k + max + 1]; round d reads k-1 and k+1 for k in [-d, d].
+        trace[d] = safe_malloc((size_t)(2 * d + 3) * sizeof(long));
+        memcpy(trace[d], v + max - d, (size_t)(2 * d + 3) * sizeof(long));
+
+        for (long k = -d; k <= d; k += 2)
+        {
+            if (k == -d || (k != d && v[k - 1 + max + 1] < v[k + 1 + max + 1]))
+                x = v[k + 1 + max + 1];
+            else
+                x = v[k - 1 + max + 1] + 1;
+
+            y = x - k;
+
+            while (x < (long)n && y < (long)m && same_line(a, start + (size_t)x, b, start + (size_t)y))
+            {
+                x++;
+                y++;
+            }
+
+            v[k + max + 1] = x;
+
+            if (x >= (long)n && y >= (long)m)
+            {
+                found = d;
+                break;
+            }
+        }
+    }
+
+    if (found < 0)
+    {
+        for (long d = 0; d <= max; d++)
+            free(trace[d]);
+        free(trace);
+        free(v);
+        return NULL;
+    }
+
+    edits = safe_malloc((n + m + 1) * sizeof(edit_t));
+    *edit_count = 0;
+    x = (long)n;
+    y = (long)m;
+
+    for (long d = found; d >= 0; d--)
+    {
+        const long *tv = trace[d];
+        long        k = x - y;
+        long        prev_k;
+
+        if (k == -d || (k != d && tv[k - 1 + d + 1] < tv[k + 1 + d + 1]))
+            prev_k = k + 1;
+        else
+            prev_k = k - 1;
+
+        long prev_x = d == 0 ? 0 : tv[prev_k + d + 1];
+        long prev_y = prev_x - prev_k;
+
+        if (d == 0)
+            prev_x = prev_y = 0;
+
+        while (x > prev_x && y > prev_y)
+        {
+            edits[(*edit_count)++] = EDIT_EQUAL;
+            x--;
+            y--;
+        }
+
+        if (d > 0)
+            edits[(*edit_count)++] = x == prev_x ? EDIT_INSERT : EDIT_DELETE;
+
+        x = prev_x;
+        y = prev_y;
+    }
+
+    for (long d = 0; d <= found; d++)
+        free(trace[d]);
+    free(trace);
+    free(v);
+
+    // Backtracking produced the script from the end; flip it into file order.
+    for (size_t i = 0; i < *edit_count / 2; i++)
+    {
+        edit_t tmp = edits[i];
+        edits[i] = edits[*edit_count - 1 - i];
+        edits[*edit_count - 1 - i] = tmp;
+    }
+
+    return edits;
+}
+
+static void report_hunk(const char *path, size_t old_start, size_t old_end, size_t new_start, size_t new_end)
+{
+    if (old_start < old_end && new_start < new_end)
+        log_message(LOG_WARNING, "Lines %zu-%zu of %s modified (now lines %zu-%zu)",
+                    old_start + 1, old_end, path, new_start + 1, new_end);
+    else if (old_start < old_end)
+        log_message(LOG_WARNING, "Lines %zu-%zu of %s deleted", old_start + 1, old_end, path);
+    else
+        log_message(LOG_WARNING, "Lines %zu-%zu of %s inserted", new_start + 1, new_end, path);
+}
+
+void line_diff_report(const char *path, const line_vector_t *old, const line_vector_t *cur)
+{
+    size_t  prefix = 0;
+    size_t  suffix = 0;
+    size_t  edit_count = 0;
+    edit_t *edits;
+
+    while (prefix < old->count && prefix < cur->count && same_line(old, prefix, cur, prefix))
+        prefix++;
+
+    while (suffix < old->count - prefix && suffix < cur->count - prefix &&
+           same_line(old, old->count - 1 - suffix, cur, cur->count - 1 - suffix))
+        suffix++;
+
+    size_t n = old->count - prefix - suffix;
+    size_t m = cur->count - prefix - suffix;
+
+    if (n == 0 && m == 0)
+        return;
+
+    edits = shortest_edit(old, cur, prefix, n, m, &edit_count);
+    if (!edits)
+    {
+        report_hunk(path, prefix, prefix + n, prefix, prefix + m);
+        log_message(LOG_WARNING, "More than %d line edits in %s; reported as one modified range",
+                    LINE_DIFF_MAX_EDITS, path);
+        return;
+    }
+
+    size_t ai = prefix;
+    size_t bi = prefix;
+
+    for (size_t i = 0; i < edit_count;)
+    {
+        if (edits[i] == EDIT_EQUAL)
+        {
+            ai++;
+            bi++;
+            i++;
+            continue;
+        }
+
+        size_t old_start = ai;
+        size_t new_start = bi;
+
+        while (i < edit_count && edits[i] != EDIT_EQUAL)
+        {
+            if (edits[i] == EDIT_DELETE)
+                ai++;
+            else
+                bi++;
+            i++;
+        }
+
+        report_hunk(path, old_start, ai, new_start, bi);
+    }
+
+    free(edits);
+}
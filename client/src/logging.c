@@ -1,55 +1,349 @@
 #include "../include/logging.h"
+#include "../include/config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-static FILE           *log_fp = NULL;
+#define LOG_RING_MASK (LOG_RING_RECORDS - 1)
+#define LOG_WRITE_BATCH 256 // records per writev; three iovecs each stays under IOV_MAX
+
+// Bounded MPMC ring after Vyukov: a slot whose sequence equals the producer's position is free, one past it holds a
+// published record. Producers claim a position with one CAS and never block on the writer; a full ring drops the record.
+typedef struct
+{
+    atomic_size_t sequence;
+    time_t        time;
+    int           priority;
+    size_t        length;
+    char          text[LOG_RECORD_MAX];
+} log_slot_t;
+
+static log_slot_t          *ring = NULL;
+static atomic_size_t        head;
+static atomic_size_t        tail; // only the writer consumes
+static atomic_uint_fast64_t dropped;
+static uint64_t             dropped_reported = 0;
+static sem_t                wakeup;
+
+static int             log_fd = -1;
+static pthread_t       writer;
+static atomic_bool     writer_running;
+static atomic_bool     stopping;
+static bool            initialized = false;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char            newline[] = "\n";
+
+static void write_all(struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(log_fd, iov, count);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+// Timestamps are formatted here rather than by producers, since localtime_r takes the timezone lock.
+static size_t format_timestamp(time_t when, char *buf, size_t size)
+{
+    struct tm tm_info;
+
+    localtime_r(&when, &tm_info);
+
+    return strftime(buf, size, "[%Y-%m-%d %H:%M:%S] ", &tm_info);
+}
+
+static void report_drops(void)
+{
+    uint64_t total = atomic_load(&dropped);
+
+    if (total == dropped_reported)
+        return;
+
+    char         line[128];
+    struct iovec iov[1];
+    size_t       stamp = format_timestamp(time(NULL), line, sizeof(line));
+    int          len = snprintf(line + stamp, sizeof(line) - stamp, "Log ring full: dropped %llu records\n",
+                                (unsigned long long)(total - dropped_reported));
+
+    syslog(LOG_WARNING, "Log ring full: dropped %llu records", (unsigned long long)(total - dropped_reported));
+    dropped_reported = total;
+
+    if (log_fd == -1)
+        return;
+
+    iov[0].iov_base = line;
+    iov[0].iov_len = stamp + (size_t)len;
+    write_all(iov, 1);
+}
+
+// Writes every published record in batches of one writev each, then forwards them to syslog.
+static void drain(void)
+{
+    static char  stamps[LOG_WRITE_BATCH][32];
+    struct iovec iov[LOG_WRITE_BATCH * 3];
+
+    for (;;)
+    {
+        size_t position = atomic_load_explicit(&tail, memory_order_relaxed);
+        size_t count = 0;
+        int    iov_count = 0;
+
+        while (count < LOG_WRITE_BATCH)
+        {
+            log_slot_t *slot = &ring[(position + count) & LOG_RING_MASK];
+
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + count + 1)
+                break;
+
+            iov[iov_count].iov_base = stamps[count];
+            iov[iov_count++].iov_len = format_timestamp(slot->time, stamps[count], sizeof(stamps[count]));
+            iov[iov_count].iov_base = slot->text;
+            iov[iov_count++].iov_len = slot->length;
+            iov[iov_count].iov_base = newline;
+            iov[iov_count++].iov_len = 1;
+            count++;
+        }
+
+        if (count == 0)
+            break;
+
+        if (log_fd != -1)
+            write_all(iov, iov_count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            log_slot_t *slot = &ring[(position + i) & LOG_RING_MASK];
+
+            syslog(slot->priority, "%s", slot->text);
+            atomic_store_explicit(&slot->sequence, position + i + LOG_RING_RECORDS, memory_order_release);
+        }
+        atomic_store(&tail, position + count);
+    }
+
+    report_drops();
+}
+
+static void *writer_main(void *arg)
+{
+    sigset_t all;
+
+    (void)arg;
+
+    // Signal handlers log and then close the log, which joins this thread; they must never run on it.
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (!atomic_load(&stopping))
+    {
+        while (sem_wait(&wakeup) == -1 && errno == EINTR)
+            ;
+        drain();
+    }
+
+    drain();
+
+    return NULL;
+}
+
+static void start_writer(void)
+{
+    pthread_mutex_lock(&log_mutex);
+
+    if (initialized && !atomic_load(&writer_running))
+    {
+        atomic_store(&stopping, false);
+        if (pthread_create(&writer, NULL, writer_main, NULL) == 0)
+            atomic_store(&writer_running, true);
+    }
+
+    pthread_mutex_unlock(&log_mutex);
+}
+
+// A forked child has the ring but not the writer: everything published is written before the fork, and the child
+// starts its own writer with its first record.
+static void before_fork(void)
+{
+    while (atomic_load(&writer_running) && atomic_load(&head) != atomic_load(&tail))
+        sched_yield();
+}
+
+static void after_fork_child(void)
+{
+    sem_init(&wakeup, 0, 0);
+    atomic_store(&writer_running, false);
+    pthread_mutex_init(&log_mutex, NULL);
+}
 
 void log_init(const char *ident, int option, int facility)
 {
     openlog(ident, option, facility);
 
-    log_fp = fopen(LOG_FILE, "a");
-    if (!log_fp)
+    log_fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd == -1)
         syslog(LOG_ERR, "Failed to open log file: %s", LOG_FILE);
 
+    if (!ring)
+    {
+        ring = malloc(LOG_RING_RECORDS * sizeof(log_slot_t));
+        if (!ring)
+        {
+            syslog(LOG_ERR, "Failed to allocate the log ring");
+            return;
+        }
+
+        for (size_t i = 0; i < LOG_RING_RECORDS; i++)
+            atomic_init(&ring[i].sequence, i);
+        atomic_init(&head, 0);
+        atomic_init(&tail, 0);
+        sem_init(&wakeup, 0, 0);
+        pthread_atfork(before_fork, NULL, after_fork_child);
+    }
+
+    initialized = true;
+    start_writer();
+
     log_message(LOG_INFO, "Starting %s...", ident);
 }
 
 void log_close(void)
 {
-    if (log_fp)
-        fclose(log_fp);
+    if (atomic_load(&writer_running))
+    {
+        atomic_store(&stopping, true);
+        sem_post(&wakeup);
+        pthread_join(writer, NULL);
+        atomic_store(&writer_running, false);
+    }
+
+    initialized = false;
+
+    if (log_fd != -1)
+        close(log_fd);
+    log_fd = -1;
     closelog();
 }
 
-static void get_timestamp(char *buf, size_t size)
+uint64_t log_dropped_count(void)
+{
+    return atomic_load(&dropped);
+}
+
+// Without a writer (before log_init or after log_close) records are written synchronously.
+static void log_direct(int priority, const char *fmt, va_list args)
 {
-    time_t     now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(buf, size, "[%Y-%m-%d %H:%M:%S]", tm_info);
+    char    text[LOG_RECORD_MAX];
+    char    stamp[32];
+    va_list copy;
+
+    va_copy(copy, args);
+    vsnprintf(text, sizeof(text), fmt, copy);
+    va_end(copy);
+
+    syslog(priority, "%s", text);
+
+    if (log_fd != -1)
+    {
+        struct iovec iov[3] = {
+            {stamp, format_timestamp(time(NULL), stamp, sizeof(stamp))},
+            {text, strlen(text)},
+            {newline, 1},
+        };
+
+        pthread_mutex_lock(&log_mutex);
+        write_all(iov, 3);
+        pthread_mutex_unlock(&log_mutex);
+    }
 }
 
 void log_message(int priority, const char *fmt, ...)
 {
-    va_list args;
+    va_list     args;
+    log_slot_t *slot;
+    size_t      pos;
+    int         retries = priority <= LOG_WARNING ? LOG_RING_FULL_RETRIES : 0;
 
-    pthread_mutex_lock(&log_mutex);
+    if (initialized && !atomic_load(&writer_running))
+        start_writer();
 
     va_start(args, fmt);
-    vsyslog(priority, fmt, args);
-    va_end(args);
 
-    if (log_fp)
+    if (!atomic_load(&writer_running))
     {
-        char timestamp[32];
-        get_timestamp(timestamp, sizeof(timestamp));
-
-        va_start(args, fmt);
-        fprintf(log_fp, "%s ", timestamp);
-        vfprintf(log_fp, fmt, args);
-        fprintf(log_fp, "\n");
-        fflush(log_fp);
+        log_direct(priority, fmt, args);
         va_end(args);
+        return;
     }
 
-    pthread_mutex_unlock(&log_mutex);
+    pos = atomic_load_explicit(&head, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &ring[pos & LOG_RING_MASK];
+
+        size_t   sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Full: warnings and errors give the writer a bounded number of turns to make room, the rest drop at once.
+            if (retries-- > 0)
+            {
+                sched_yield();
+                pos = atomic_load_explicit(&head, memory_order_relaxed);
+                continue;
+            }
+
+            atomic_fetch_add(&dropped, 1);
+            va_end(args);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+
+    slot->length = len < 0 ? 0 : (size_t)len < sizeof(slot->text) ? (size_t)len : sizeof(slot->text) - 1;
+    slot->time = time(NULL);
+    slot->priority = priority;
+
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    sem_post(&wakeup);
 }
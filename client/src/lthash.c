@@ -0,0 +1,45 @@
+#include "lthash.h"
+#include "digest.h"
+#include <string.h>
+
+#define LTHASH_TAG "heimdall-lthash16"
+
+void lthash_init(lthash_t *hash)
+{
+    memset(hash, 0, sizeof(lthash_t));
+}
+
+// Lanes are read and written little-endian so digests do not depend on the host.
+int lthash_add(lthash_t *hash, const void *element, size_t len)
+{
+    unsigned char expanded[LTHASH_LANES * 2];
+
+    if (digest_shake128_buffer(element, len, expanded, sizeof(expanded)) != 0)
+        return -1;
+
+    for (size_t i = 0; i < LTHASH_LANES; i++)
+        hash->lanes[i] += (uint16_t)(expanded[2 * i] | expanded[2 * i + 1] << 8);
+
+    return 0;
+}
+
+void lthash_merge(lthash_t *into, const lthash_t *from)
+{
+    for (size_t i = 0; i < LTHASH_LANES; i++)
+        into->lanes[i] += from->lanes[i];
+}
+
+// Compresses the lanes under a tag of their own, so a multiset digest never equals an ordered one.
+int lthash_digest(const lthash_t *hash, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    unsigned char bytes[sizeof(LTHASH_TAG) - 1 + LTHASH_LANES * 2];
+
+    memcpy(bytes, LTHASH_TAG, sizeof(LTHASH_TAG) - 1);
+    for (size_t i = 0; i < LTHASH_LANES; i++)
+    {
+        bytes[sizeof(LTHASH_TAG) - 1 + 2 * i] = (unsigned char)(hash->lanes[i] & 0xff);
+        bytes[sizeof(LTHASH_TAG) + 2 * i] = (unsigned char)(hash->lanes[i] >> 8);
+    }
+
+    return digest_sha256_buffer(bytes, sizeof(bytes), digest);
+}
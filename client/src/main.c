@@ -1,26 +1,120 @@
+#include "baseline.h"
 #include "config.h"
 #include "daemonize.h"
 #include "daemonize_control.h"
+#include "digest.h"
 #include "hashing.h"
+#include "linediff.h"
 #include "logging.h"
+#include "merkle.h"
+#include "metrics.h"
+#include "parser.h"
+#include "scheduler.h"
 #include "utils.h"
+#include "watcher.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <unistd.h>
 
-int main(void)
+// Sleeps until the timer wheel has an entry due or, in watch mode, until inotify reports a change. Scheduled checks
+// re-hash without trusting cached subtrees; in watch mode they only back up the events, so their periods are stretched.
+static void schedule_loop(bool watching)
 {
-    log_init(LOG_IDENT, LOG_PID, LOG_DAEMON);
-    maybe_daemonize();
+    const config_plan_t *plan = config_plan();
+    unsigned int         scale = watching ? FIM_WATCH_SWEEP_FACTOR : 1;
+    bool                *due = safe_malloc(plan->count * sizeof(bool));
+    bool                 cycle_due;
+
+    scheduler_reset(plan->entries, plan->count, scale);
 
     while (1)
     {
-        log_message(LOG_INFO, "Heimdall: Performing integrity check...");
+        // A reloaded plan renumbers its entries, so the watches and timers are rebuilt and every entry is checked once.
+        if (config_refresh())
+        {
+            plan = config_plan();
+            if (watching)
+            {
+                watcher_close();
+                watcher_init(plan->entries, plan->count);
+            }
+            due = safe_realloc(due, plan->count * sizeof(bool));
+            scheduler_reset(plan->entries, plan->count, scale);
+        }
+
+        memset(due, 0, plan->count * sizeof(bool));
+        size_t count = scheduler_collect(due, plan->count, &cycle_due);
+
+        if (cycle_due)
+        {
+            baseline_begin_cycle();
+            if (baseline_full_rehash())
+            {
+                scheduler_rearm_all(due, plan->count);
+                count = plan->count;
+            }
+        }
 
-        integrity_check();
+        if (count > 0)
+        {
+            log_message(LOG_INFO, "Heimdall: Performing integrity check of %zu monitored paths...", count);
+            integrity_check_entries(plan->entries, due, plan->count, false);
+            baseline_end_sweep();
+        }
 
-        sleep(FIM_INTERVAL_SEC);
+        struct pollfd pfd = {.fd = watching ? watcher_fd() : -1, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, scheduler_timeout_ms()) <= 0 || !watching)
+            continue;
+
+        // Let bursts of writes to the same file settle into a single re-hash.
+        usleep(FIM_WATCH_DEBOUNCE_MS * 1000);
+
+        memset(due, 0, plan->count * sizeof(bool));
+        size_t changed = watcher_drain(due, plan->count);
+        if (changed == 0)
+            continue;
+
+        log_message(LOG_INFO, "Heimdall: Change events on %zu monitored paths, re-hashing...", changed);
+        integrity_check_entries(plan->entries, due, plan->count, true);
     }
 
+    free(due);
+    scheduler_close();
+}
+
+static void handle_sighup(int sig)
+{
+    (void)sig;
+
+    config_request_reload();
+}
+
+int main(void)
+{
+    log_init(LOG_IDENT, LOG_PID, LOG_DAEMON);
+    maybe_daemonize();
+    baseline_open(BASELINE_PATH);
+    merkle_open(MERKLE_PATH);
+    line_store_open(LINE_STORE_DIR);
+    metrics_init();
+
+    signal(SIGHUP, handle_sighup);
+
+    const config_plan_t *plan = config_plan();
+
+    schedule_loop(FIM_WATCH_MODE && watcher_init(plan->entries, plan->count) == 0);
+
+    watcher_close();
+    metrics_close();
+    config_release();
+
     log_message(LOG_INFO, "Heimdall shutting down cleanly.");
+    baseline_sync();
+    baseline_close();
+    merkle_sync();
+    merkle_close();
+    digest_shutdown();
     log_close();
 
     return EXIT_SUCCESS;
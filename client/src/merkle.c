@@ -0,0 +1,470 @@
+#include "merkle.h"
+#include "arena.h"
+#include "config.h"
+#include "logging.h"
+#include "pathmap.h"
+#include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MERKLE_MAGIC    "heimdall-merkle 3 digest-format %d"
+#define MERKLE_V2_MAGIC "heimdall-merkle 2" // digest format 2
+
+// One node per directory: its sorted children and the digest folded over them, or for a multiset directory only its
+// LtHash digest. The children array and their names share a single allocation made by pack_children().
+typedef struct
+{
+    merkle_child_t *children;
+    size_t          child_count;
+    unsigned char   digest[SHA256_DIGEST_LENGTH];
+    bool            valid;    // false until re-hashed since the last change event or restart
+    bool            multiset; // digest is an LtHash; no children are kept
+} merkle_node_t;
+
+static pathmap_t      *nodes = NULL;
+static char            store_path[PATH_MAX] = {0};
+static bool            dirty = false;
+static pthread_mutex_t merkle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static merkle_child_t *pack_children(const merkle_child_t *children, size_t count)
+{
+    size_t          names = 0;
+    merkle_child_t *packed;
+    char           *p;
+
+    for (size_t i = 0; i < count; i++)
+        names += strlen(children[i].name) + 1;
+
+    packed = safe_malloc(count * sizeof(merkle_child_t) + names);
+    p = (char *)(packed + count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = strlen(children[i].name) + 1;
+
+        packed[i] = children[i];
+        packed[i].name = memcpy(p, children[i].name, len);
+        p += len;
+    }
+
+    return packed;
+}
+
+static void free_node(void *value)
+{
+    merkle_node_t *node = value;
+
+    free(node->children);
+    free(node);
+}
+
+static merkle_node_t *ensure_node(const char *dir_path)
+{
+    merkle_node_t *node;
+
+    if (!nodes)
+        nodes = pathmap_new();
+
+    node = pathmap_find(nodes, dir_path);
+    if (!node)
+    {
+        node = safe_malloc(sizeof(merkle_node_t));
+        memset(node, 0, sizeof(merkle_node_t));
+        pathmap_put(nodes, dir_path, node);
+    }
+
+    return node;
+}
+
+// Gives the node being loaded its packed children once its last child record has been read.
+static void finish_loaded(merkle_node_t *node, const merkle_child_t *scratch, size_t count)
+{
+    if (!node)
+        return;
+
+    node->children = pack_children(scratch, count);
+    node->child_count = count;
+}
+
+int merkle_open(const char *path)
+{
+    FILE           *fp;
+    char           *line = NULL;
+    size_t          len = 0;
+    merkle_node_t  *node = NULL;
+    merkle_child_t *scratch = NULL;
+    arena_t         names;
+    size_t          loaded = 0;
+    size_t          expected = 0;
+
+    snprintf(store_path, sizeof(store_path), "%s", path);
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return errno == ENOENT ? 0 : -1;
+
+    arena_init(&names);
+    pthread_mutex_lock(&merkle_mutex);
+
+    // Child digests of files follow FIM_DIGEST_FORMAT; a store of the other format is rebuilt by re-hashing.
+    int  format = 0;
+    bool known_format = false;
+    if (getline(&line, &len, fp) != -1)
+    {
+        if (strncmp(line, MERKLE_V2_MAGIC "\n", strlen(MERKLE_V2_MAGIC) + 1) == 0)
+            format = 2;
+        else if (sscanf(line, MERKLE_MAGIC, &format) != 1)
+            format = 0;
+        known_format = format == FIM_DIGEST_FORMAT;
+    }
+    if (format != 0 && !known_format)
+        log_message(LOG_NOTICE, "Ignoring Merkle store %s with format-%d digests, not format %d", path, format,
+                    FIM_DIGEST_FORMAT);
+    else if (!known_format)
+        log_message(LOG_WARNING, "Ignoring Merkle store %s with unknown format", path);
+
+    while (known_format && getline(&line, &len, fp) != -1)
+    {
+        char   hex[HASH_HEX_LEN + 1];
+        char   kind;
+        size_t count;
+        int    offset;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (sscanf(line, "M %64s %n", hex, &offset) == 1)
+        {
+            finish_loaded(node, scratch, loaded);
+            node = NULL;
+
+            merkle_node_t *multiset = ensure_node(line + offset);
+            free(multiset->children);
+            multiset->children = NULL;
+            multiset->child_count = 0;
+            multiset->valid = false;
+            multiset->multiset = true;
+            hex_to_binary(hex, multiset->digest, SHA256_DIGEST_LENGTH);
+        }
+        else if (sscanf(line, "N %64s %zu %n", hex, &count, &offset) == 2)
+        {
+            finish_loaded(node, scratch, loaded);
+
+            node = ensure_node(line + offset);
+            free(node->children);
+            node->children = NULL;
+            node->child_count = 0;
+            node->valid = false;
+            node->multiset = false;
+            hex_to_binary(hex, node->digest, SHA256_DIGEST_LENGTH);
+
+            scratch = safe_realloc(scratch, (count ? count : 1) * sizeof(merkle_child_t));
+            loaded = 0;
+            expected = count;
+        }
+        else if (node && loaded < expected && sscanf(line, "C %c %64s %n", &kind, hex, &offset) == 2)
+        {
+            merkle_child_t *child = &scratch[loaded++];
+
+            child->name = arena_strndup(&names, line + offset, strlen(line + offset));
+            child->is_dir = kind == 'd';
+            hex_to_binary(hex, child->digest, SHA256_DIGEST_LENGTH);
+        }
+    }
+
+    finish_loaded(node, scratch, loaded);
+
+    pthread_mutex_unlock(&merkle_mutex);
+
+    arena_free(&names);
+    free(scratch);
+    free(line);
+    fclose(fp);
+
+    return 0;
+}
+
+static void write_node(const char *dir_path, void *value, void *arg)
+{
+    const merkle_node_t *node = value;
+    char                 hex[HASH_HEX_LEN + 1];
+
+    if (strchr(dir_path, '\n'))
+        return;
+
+    binary_to_hex(node->digest, SHA256_DIGEST_LENGTH, hex);
+
+    if (node->multiset)
+    {
+        fprintf(arg, "M %s %s\n", hex, dir_path);
+        return;
+    }
+
+    fprintf(arg, "N %s %zu %s\n", hex, node->child_count, dir_path);
+
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        binary_to_hex(node->children[i].digest, SHA256_DIGEST_LENGTH, hex);
+        fprintf(arg, "C %c %s %s\n", node->children[i].is_dir ? 'd' : 'f', hex, node->children[i].name);
+    }
+}
+
+int merkle_sync(void)
+{
+    char  tmp_path[PATH_MAX + 8];
+    FILE *fp;
+
+    if (store_path[0] == '\0' || !dirty)
+        return 0;
+
+    fp = open_atomic(store_path, tmp_path, sizeof(tmp_path));
+    if (!fp)
+        return -1;
+
+    pthread_mutex_lock(&merkle_mutex);
+
+    fprintf(fp, MERKLE_MAGIC "\n", FIM_DIGEST_FORMAT);
+    if (nodes)
+        pathmap_foreach(nodes, write_node, fp);
+    dirty = false;
+
+    pthread_mutex_unlock(&merkle_mutex);
+
+    return commit_atomic(fp, tmp_path, store_path);
+}
+
+void merkle_close(void)
+{
+    pthread_mutex_lock(&merkle_mutex);
+
+    pathmap_free(nodes, free_node);
+    nodes = NULL;
+    store_path[0] = '\0';
+
+    pthread_mutex_unlock(&merkle_mutex);
+}
+
+bool merkle_lookup(const char *dir_path, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    bool found = false;
+
+    pthread_mutex_lock(&merkle_mutex);
+
+    const merkle_node_t *node = nodes ? pathmap_find(nodes, dir_path) : NULL;
+    if (node && node->valid)
+    {
+        memcpy(digest, node->digest, SHA256_DIGEST_LENGTH);
+        found = true;
+    }
+
+    pthread_mutex_unlock(&merkle_mutex);
+
+    return found;
+}
+
+typedef struct
+{
+    const char *prefix;
+    size_t      prefix_len;
+    char      **keys;
+    size_t      count;
+} prefix_scan_t;
+
+static void collect_prefix(const char *key, void *value, void *arg)
+{
+    prefix_scan_t *scan = arg;
+
+    (void)value;
+
+    if (strncmp(key, scan->prefix, scan->prefix_len) == 0 && (key[scan->prefix_len] == '\0' || key[scan->prefix_len] == '/'))
+    {
+        scan->keys = safe_realloc(scan->keys, (scan->count + 1) * sizeof(char *));
+        scan->keys[scan->count++] = safe_strdup(key);
+    }
+}
+
+// Drops the node of a vanished directory together with every node below it.
+static void forget_subtree(const char *dir_path)
+{
+    prefix_scan_t scan = {dir_path, strlen(dir_path), NULL, 0};
+
+    pathmap_foreach(nodes, collect_prefix, &scan);
+
+    for (size_t i = 0; i < scan.count; i++)
+    {
+        free_node(pathmap_remove(nodes, scan.keys[i]));
+        free(scan.keys[i]);
+    }
+
+    free(scan.keys);
+}
+
+static void report(const char *what, const char *dir_path, const merkle_child_t *child)
+{
+    log_message(LOG_WARNING, "%s: %s/%s%s", what, dir_path, child->name, child->is_dir ? "/" : "");
+}
+
+// Children are sorted by name on both sides, so one merge pass finds every added, removed and modified leaf.
+static void report_changes(const char *dir_path, const merkle_node_t *old, const merkle_child_t *children, size_t count)
+{
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < old->child_count || j < count)
+    {
+        int cmp = i == old->child_count ? 1 : j == count ? -1 : strcmp(old->children[i].name, children[j].name);
+
+        if (cmp < 0)
+        {
+            report("Removed", dir_path, &old->children[i]);
+
+            if (old->children[i].is_dir)
+            {
+                char subdir[PATH_MAX];
+                snprintf(subdir, sizeof(subdir), "%s/%s", dir_path, old->children[i].name);
+                forget_subtree(subdir);
+            }
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            report("Added", dir_path, &children[j]);
+            j++;
+        }
+        else
+        {
+            if (old->children[i].is_dir != children[j].is_dir)
+                report("Replaced", dir_path, &children[j]);
+            else if (!children[j].is_dir && memcmp(old->children[i].digest, children[j].digest, SHA256_DIGEST_LENGTH) != 0)
+                report("Modified", dir_path, &children[j]);
+            i++;
+            j++;
+        }
+    }
+}
+
+static bool same_children(const merkle_node_t *node, const merkle_child_t *children, size_t count)
+{
+    if (node->child_count != count)
+        return false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (node->children[i].is_dir != children[i].is_dir || strcmp(node->children[i].name, children[i].name) != 0 ||
+            memcmp(node->children[i].digest, children[i].digest, SHA256_DIGEST_LENGTH) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Copies children, so the caller keeps ownership of the array and its names. A node folded to what the store already
+// holds is only marked valid, so a check that found nothing new leaves the store unwritten.
+void merkle_update(const char *dir_path, const merkle_child_t *children, size_t count, const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    pthread_mutex_lock(&merkle_mutex);
+
+    bool           known = nodes && pathmap_find(nodes, dir_path);
+    merkle_node_t *node = ensure_node(dir_path);
+
+    if (known && !node->multiset && memcmp(node->digest, digest, SHA256_DIGEST_LENGTH) == 0 &&
+        same_children(node, children, count))
+    {
+        node->valid = true;
+        pthread_mutex_unlock(&merkle_mutex);
+        return;
+    }
+
+    // A digest of the other kind says nothing about which children changed.
+    if (known && !node->multiset && memcmp(node->digest, digest, SHA256_DIGEST_LENGTH) != 0)
+        report_changes(dir_path, node, children, count);
+
+    // report_changes may have dropped nodes below dir_path, but never dir_path itself.
+    node = pathmap_find(nodes, dir_path);
+
+    free(node->children);
+    node->children = pack_children(children, count);
+    node->child_count = count;
+    memcpy(node->digest, digest, SHA256_DIGEST_LENGTH);
+    node->valid = true;
+    node->multiset = false;
+    dirty = true;
+
+    pthread_mutex_unlock(&merkle_mutex);
+}
+
+// A multiset directory has no child list to diff, so a change is reported for the directory as a whole.
+void merkle_update_multiset(const char *dir_path, const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    pthread_mutex_lock(&merkle_mutex);
+
+    bool           known = nodes && pathmap_find(nodes, dir_path);
+    merkle_node_t *node = ensure_node(dir_path);
+
+    if (known && node->multiset && memcmp(node->digest, digest, SHA256_DIGEST_LENGTH) == 0)
+    {
+        node->valid = true;
+        pthread_mutex_unlock(&merkle_mutex);
+        return;
+    }
+
+    if (known && node->multiset && memcmp(node->digest, digest, SHA256_DIGEST_LENGTH) != 0)
+        log_message(LOG_WARNING, "Modified: %s/ (multiset digest; entries are not listed)", dir_path);
+
+    free(node->children);
+    node->children = NULL;
+    node->child_count = 0;
+    memcpy(node->digest, digest, SHA256_DIGEST_LENGTH);
+    node->valid = true;
+    node->multiset = true;
+    dirty = true;
+
+    pthread_mutex_unlock(&merkle_mutex);
+}
+
+// Invalidates the node for path and every ancestor, leaving sibling subtrees cached.
+void merkle_invalidate(const char *path)
+{
+    char key[PATH_MAX];
+
+    snprintf(key, sizeof(key), "%s", path);
+
+    pthread_mutex_lock(&merkle_mutex);
+
+    while (nodes && key[0] != '\0')
+    {
+        merkle_node_t *node = pathmap_find(nodes, key);
+        if (node)
+            node->valid = false;
+
+        char *slash = strrchr(key, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+
+    pthread_mutex_unlock(&merkle_mutex);
+}
+
+static void invalidate_node(const char *key, void *value, void *arg)
+{
+    merkle_node_t *node = value;
+
+    (void)key;
+    (void)arg;
+
+    node->valid = false;
+}
+
+void merkle_invalidate_all(void)
+{
+    pthread_mutex_lock(&merkle_mutex);
+
+    if (nodes)
+        pathmap_foreach(nodes, invalidate_node, NULL);
+
+    pthread_mutex_unlock(&merkle_mutex);
+}
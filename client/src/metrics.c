@@ -0,0 +1,643 @@
+#include "metrics.h"
+#include "config.h"
+#include "governor.h"
+#include "logging.h"
+#include "pathmap.h"
+#include "utils.h"
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Log-linear buckets after HdrHistogram: values below 2 * SUB_COUNT get a bucket each, and every power of two above
+// is split into SUB_COUNT equal buckets, so any recorded value is known to within 1 / SUB_COUNT. Values are nanoseconds
+// and clamp at 2^44 (almost five hours).
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 44
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// Exported cumulative buckets are every fourth power of two from 2^10 ns (about 1 us) to 2^40 ns (about 18 min),
+// which fall on bucket boundaries, so they are exact.
+#define EXPORT_MIN_BITS 10
+#define EXPORT_MAX_BITS 40
+#define EXPORT_STEP_BITS 2
+
+#define METRICS_REQUEST_WAIT_MS 100
+
+typedef struct
+{
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+} histogram_t;
+
+struct metrics_scope
+{
+    const char          *entry; // "" for work outside any config entry
+    atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+    histogram_t          histograms[METRIC_HISTOGRAM_COUNT];
+};
+
+typedef struct
+{
+    const char *family;
+    const char *label; // distinguishes counters sharing a family, or NULL
+    const char *help;
+} counter_info_t;
+
+typedef struct
+{
+    const char *family;
+    const char *help;
+} histogram_info_t;
+
+// Counters of one family are adjacent, so each family gets a single HELP and TYPE header.
+static const counter_info_t counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_FILES_VISITED] = {"heimdall_files_visited_total", NULL, "Files considered by integrity checks."},
+    [METRIC_FILES_UNCHANGED] = {"heimdall_files_skipped_total", "reason=\"unchanged\"", "Files whose content was not read, by reason."},
+    [METRIC_FILES_SHARED] = {"heimdall_files_skipped_total", "reason=\"shared\"", NULL},
+    [METRIC_FILES_EXCLUDED] = {"heimdall_files_skipped_total", "reason=\"excluded\"", NULL},
+    [METRIC_FILE_ERRORS] = {"heimdall_file_errors_total", NULL, "Files that could not be stat'ed or read."},
+    [METRIC_SLOW_FILES] = {"heimdall_slow_files_total", NULL, "Files that took longer than the slow-file threshold."},
+    [METRIC_BYTES_READ] = {"heimdall_read_bytes_total", NULL, "Content bytes read for hashing."},
+    [METRIC_STAT_CALLS] = {"heimdall_syscalls_total", "call=\"stat\"", "System calls issued for hashing, by call."},
+    [METRIC_OPEN_CALLS] = {"heimdall_syscalls_total", "call=\"open\"", NULL},
+    [METRIC_READ_CALLS] = {"heimdall_syscalls_total", "call=\"read\"", NULL},
+    [METRIC_GETDENTS_CALLS] = {"heimdall_syscalls_total", "call=\"getdents\"", NULL},
+    [METRIC_MMAP_CALLS] = {"heimdall_syscalls_total", "call=\"mmap\"", NULL},
+    [METRIC_URING_ENTER_CALLS] = {"heimdall_syscalls_total", "call=\"io_uring_enter\"", NULL},
+    [METRIC_URING_OPS] = {"heimdall_uring_ops_total", NULL, "File operations completed through io_uring instead of system calls."},
+    [METRIC_CACHE_FILLED_BYTES] = {"heimdall_page_cache_bytes_total", "event=\"filled\"", "Page cache brought in by content reads, and released again, in cache-neutral mode."},
+    [METRIC_CACHE_RELEASED_BYTES] = {"heimdall_page_cache_bytes_total", "event=\"released\"", NULL},
+};
+
+static const histogram_info_t histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_FILE_HASH_LATENCY] = {"heimdall_file_hash", "Time from opening a file to its content digest."},
+    [METRIC_QUEUE_WAIT] = {"heimdall_queue_wait", "Time hashing tasks spent queued before a worker ran them."},
+    [METRIC_ENTRY_DURATION] = {"heimdall_entry_check", "Time to check one config entry."},
+};
+
+static const unsigned quantiles_permille[] = {500, 900, 990, 999};
+
+static metrics_scope_t  unscoped = {.entry = ""};
+static pathmap_t       *scopes = NULL;
+static pthread_mutex_t  scopes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local metrics_scope_t *current = NULL;
+
+static histogram_t          check_duration;
+static atomic_uint_fast64_t checks;
+static uint64_t             check_start = 0;
+static _Atomic uint64_t     last_check_ns = 0; // written by the checking thread, read by the metrics server
+static _Atomic time_t       last_check_time = 0;
+
+static int       listen_fd = -1;
+static pthread_t server;
+static bool      serving = false;
+
+static unsigned bit_length(uint64_t v)
+{
+    return v ? 64 - (unsigned)__builtin_clzll(v) : 0;
+}
+
+static size_t bucket_of(uint64_t v)
+{
+    if (v >= 1ULL << HISTOGRAM_MAX_BITS)
+        v = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+
+    if (v < 2 * HISTOGRAM_SUB_COUNT)
+        return (size_t)v;
+
+    unsigned shift = bit_length(v) - HISTOGRAM_SUB_BITS - 1;
+
+    return (size_t)(shift + 1) * HISTOGRAM_SUB_COUNT + (size_t)((v >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+// Largest value that lands in the bucket, which is what quantiles report.
+static uint64_t bucket_upper(size_t index)
+{
+    if (index < 2 * HISTOGRAM_SUB_COUNT)
+        return index;
+
+    unsigned shift = (unsigned)(index / HISTOGRAM_SUB_COUNT) - 1;
+    uint64_t m = HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT;
+
+    return ((m + 1) << shift) - 1;
+}
+
+static void histogram_record(histogram_t *h, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+}
+
+static metrics_scope_t *scope_or_unscoped(void)
+{
+    return current ? current : &unscoped;
+}
+
+metrics_scope_t *metrics_scope_for(const char *entry_path)
+{
+    metrics_scope_t *scope;
+
+    pthread_mutex_lock(&scopes_mutex);
+
+    if (!scopes)
+        scopes = pathmap_new();
+
+    scope = pathmap_find(scopes, entry_path);
+    if (!scope)
+    {
+        scope = safe_malloc(sizeof(metrics_scope_t));
+        memset(scope, 0, sizeof(metrics_scope_t));
+        scope->entry = pathmap_put(scopes, entry_path, scope);
+    }
+
+    pthread_mutex_unlock(&scopes_mutex);
+
+    return scope;
+}
+
+metrics_scope_t *metrics_current(void)
+{
+    return current;
+}
+
+metrics_scope_t *metrics_enter(metrics_scope_t *scope)
+{
+    metrics_scope_t *previous = current;
+
+    current = scope;
+
+    return previous;
+}
+
+void metrics_leave(metrics_scope_t *previous)
+{
+    current = previous;
+}
+
+void metrics_count(metric_counter_t counter, uint64_t amount)
+{
+    atomic_fetch_add_explicit(&scope_or_unscoped()->counters[counter], amount, memory_order_relaxed);
+}
+
+void metrics_record(metric_histogram_t histogram, uint64_t ns)
+{
+    histogram_record(&scope_or_unscoped()->histograms[histogram], ns);
+}
+
+void metrics_file_hashed(const char *path, uint64_t bytes, uint64_t ns)
+{
+    metrics_record(METRIC_FILE_HASH_LATENCY, ns);
+
+    if (METRICS_SLOW_FILE_MS > 0 && ns >= (uint64_t)METRICS_SLOW_FILE_MS * 1000000)
+    {
+        metrics_count(METRIC_SLOW_FILES, 1);
+        log_message(LOG_NOTICE, "Slow file: %s took %.1f ms for %llu bytes", path, (double)ns / 1e6,
+                    (unsigned long long)bytes);
+    }
+}
+
+static void print_label_value(FILE *out, const char *value)
+{
+    for (; *value; value++)
+    {
+        if (*value == '\\' || *value == '"')
+            fprintf(out, "\\%c", *value);
+        else if (*value == '\n')
+            fputs("\\n", out);
+        else
+            fputc(*value, out);
+    }
+}
+
+static void print_labels(FILE *out, const metrics_scope_t *scope, const char *extra)
+{
+    fputs("{entry=\"", out);
+    print_label_value(out, scope->entry);
+    fputc('"', out);
+    if (extra)
+        fprintf(out, ",%s", extra);
+    fputc('}', out);
+}
+
+static double seconds_of(uint64_t ns)
+{
+    return (double)ns / 1e9;
+}
+
+// Prometheus buckets are cumulative counts of values below each bound.
+static void print_histogram(FILE *out, const char *family, const metrics_scope_t *scope, const histogram_t *h)
+{
+    uint64_t cumulative = 0;
+    size_t   bucket = 0;
+    char     le[64];
+
+    for (unsigned bits = EXPORT_MIN_BITS; bits <= EXPORT_MAX_BITS; bits += EXPORT_STEP_BITS)
+    {
+        for (; bucket < HISTOGRAM_BUCKETS && bucket_upper(bucket) < 1ULL << bits; bucket++)
+            cumulative += atomic_load_explicit(&h->buckets[bucket], memory_order_relaxed);
+
+        snprintf(le, sizeof(le), "le=\"%.9g\"", seconds_of(1ULL << bits));
+        fprintf(out, "%s_seconds_bucket", family);
+        print_labels(out, scope, le);
+        fprintf(out, " %llu\n", (unsigned long long)cumulative);
+    }
+
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+    fprintf(out, "%s_seconds_bucket", family);
+    print_labels(out, scope, "le=\"+Inf\"");
+    fprintf(out, " %llu\n%s_seconds_sum", (unsigned long long)count, family);
+    print_labels(out, scope, NULL);
+    fprintf(out, " %.9f\n%s_seconds_count", seconds_of(atomic_load_explicit(&h->sum, memory_order_relaxed)), family);
+    print_labels(out, scope, NULL);
+    fprintf(out, " %llu\n", (unsigned long long)count);
+}
+
+// HDR quantiles: the upper bound of the bucket holding the requested rank, within 1 / HISTOGRAM_SUB_COUNT.
+static void print_quantiles(FILE *out, const char *family, const metrics_scope_t *scope, const histogram_t *h)
+{
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+    for (size_t q = 0; q < sizeof(quantiles_permille) / sizeof(quantiles_permille[0]); q++)
+    {
+        uint64_t rank = (count * quantiles_permille[q] + 999) / 1000;
+        uint64_t seen = 0;
+        size_t   bucket = 0;
+        char     label[32];
+
+        for (; bucket < HISTOGRAM_BUCKETS - 1; bucket++)
+        {
+            seen += atomic_load_explicit(&h->buckets[bucket], memory_order_relaxed);
+            if (seen >= rank && rank > 0)
+                break;
+        }
+
+        snprintf(label, sizeof(label), "quantile=\"%u.%03u\"", quantiles_permille[q] / 1000, quantiles_permille[q] % 1000);
+        fprintf(out, "%s_quantile_seconds", family);
+        print_labels(out, scope, label);
+        fprintf(out, " %.9f\n", count ? seconds_of(bucket_upper(bucket)) : 0.0);
+    }
+}
+
+typedef struct
+{
+    FILE    *out;
+    size_t   index;
+    bool     quantiles;
+    uint64_t total; // for metrics_total
+} render_ctx_t;
+
+static void render_counter(const char *key, void *value, void *arg)
+{
+    const metrics_scope_t *scope = value;
+    const render_ctx_t    *ctx = arg;
+    const counter_info_t  *info = &counter_info[ctx->index];
+
+    (void)key;
+
+    fputs(info->family, ctx->out);
+    print_labels(ctx->out, scope, info->label);
+    fprintf(ctx->out, " %llu\n",
+            (unsigned long long)atomic_load_explicit(&scope->counters[ctx->index], memory_order_relaxed));
+}
+
+static void render_footprint(const char *key, void *value, void *arg)
+{
+    const metrics_scope_t *scope = value;
+    const render_ctx_t    *ctx = arg;
+    uint64_t               filled;
+    uint64_t               released;
+
+    filled = atomic_load_explicit(&scope->counters[METRIC_CACHE_FILLED_BYTES], memory_order_relaxed);
+    released = atomic_load_explicit(&scope->counters[METRIC_CACHE_RELEASED_BYTES], memory_order_relaxed);
+
+    (void)key;
+
+    fputs("heimdall_page_cache_footprint_bytes", ctx->out);
+    print_labels(ctx->out, scope, NULL);
+    fprintf(ctx->out, " %llu\n", (unsigned long long)(filled > released ? filled - released : 0));
+}
+
+static void render_histogram(const char *key, void *value, void *arg)
+{
+    const metrics_scope_t *scope = value;
+    const render_ctx_t    *ctx = arg;
+    const histogram_t     *h = &scope->histograms[ctx->index];
+
+    (void)key;
+
+    if (atomic_load_explicit(&h->count, memory_order_relaxed) == 0)
+        return;
+
+    if (ctx->quantiles)
+        print_quantiles(ctx->out, histogram_info[ctx->index].family, scope, h);
+    else
+        print_histogram(ctx->out, histogram_info[ctx->index].family, scope, h);
+}
+
+static void render_scopes(pathmap_visit_fn visit, render_ctx_t *ctx)
+{
+    visit(unscoped.entry, &unscoped, ctx);
+    if (scopes)
+        pathmap_foreach(scopes, visit, ctx);
+}
+
+static void print_check_histogram(FILE *out)
+{
+    uint64_t cumulative = 0;
+    size_t   bucket = 0;
+    uint64_t count = atomic_load_explicit(&check_duration.count, memory_order_relaxed);
+
+    fprintf(out, "# HELP heimdall_check_duration_seconds Time to run one integrity check over the due entries.\n");
+    fprintf(out, "# TYPE heimdall_check_duration_seconds histogram\n");
+
+    for (unsigned bits = EXPORT_MIN_BITS; bits <= EXPORT_MAX_BITS; bits += EXPORT_STEP_BITS)
+    {
+        for (; bucket < HISTOGRAM_BUCKETS && bucket_upper(bucket) < 1ULL << bits; bucket++)
+            cumulative += atomic_load_explicit(&check_duration.buckets[bucket], memory_order_relaxed);
+        fprintf(out, "heimdall_check_duration_seconds_bucket{le=\"%.9g\"} %llu\n", seconds_of(1ULL << bits),
+                (unsigned long long)cumulative);
+    }
+
+    fprintf(out, "heimdall_check_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)count);
+    fprintf(out, "heimdall_check_duration_seconds_sum %.9f\n",
+            seconds_of(atomic_load_explicit(&check_duration.sum, memory_order_relaxed)));
+    fprintf(out, "heimdall_check_duration_seconds_count %llu\n", (unsigned long long)count);
+}
+
+static void add_counter(const char *key, void *value, void *arg)
+{
+    const metrics_scope_t *scope = value;
+    render_ctx_t          *ctx = arg;
+
+    (void)key;
+    ctx->total += atomic_load_explicit(&scope->counters[ctx->index], memory_order_relaxed);
+}
+
+// Sum of a counter over every scope, for callers that account for a whole run.
+uint64_t metrics_total(metric_counter_t counter)
+{
+    render_ctx_t ctx = {NULL, counter, false, 0};
+
+    pthread_mutex_lock(&scopes_mutex);
+    render_scopes(add_counter, &ctx);
+    pthread_mutex_unlock(&scopes_mutex);
+
+    return ctx.total;
+}
+
+// Prometheus text exposition format 0.0.4.
+void metrics_render(FILE *out)
+{
+    render_ctx_t ctx = {out, 0, false, 0};
+
+    pthread_mutex_lock(&scopes_mutex);
+
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        if (counter_info[i].help)
+        {
+            fprintf(out, "# HELP %s %s\n", counter_info[i].family, counter_info[i].help);
+            fprintf(out, "# TYPE %s counter\n", counter_info[i].family);
+        }
+
+        ctx.index = i;
+        render_scopes(render_counter, &ctx);
+    }
+
+    // Pages the kernel reclaimed on its own since are not seen, so this is an upper bound.
+    fprintf(out, "# HELP heimdall_page_cache_footprint_bytes Page cache filled by content reads and not released.\n");
+    fprintf(out, "# TYPE heimdall_page_cache_footprint_bytes gauge\n");
+    render_scopes(render_footprint, &ctx);
+
+    for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        ctx.index = i;
+
+        fprintf(out, "# HELP %s_seconds %s\n", histogram_info[i].family, histogram_info[i].help);
+        fprintf(out, "# TYPE %s_seconds histogram\n", histogram_info[i].family);
+        ctx.quantiles = false;
+        render_scopes(render_histogram, &ctx);
+
+        fprintf(out, "# HELP %s_quantile_seconds %s\n", histogram_info[i].family, histogram_info[i].help);
+        fprintf(out, "# TYPE %s_quantile_seconds gauge\n", histogram_info[i].family);
+        ctx.quantiles = true;
+        render_scopes(render_histogram, &ctx);
+    }
+
+    pthread_mutex_unlock(&scopes_mutex);
+
+    print_check_histogram(out);
+    fprintf(out, "# HELP heimdall_checks_total Integrity checks run.\n# TYPE heimdall_checks_total counter\n");
+    fprintf(out, "heimdall_checks_total %llu\n", (unsigned long long)atomic_load(&checks));
+    fprintf(out, "# HELP heimdall_last_check_timestamp_seconds When the last integrity check finished.\n");
+    fprintf(out, "# TYPE heimdall_last_check_timestamp_seconds gauge\n");
+    fprintf(out, "heimdall_last_check_timestamp_seconds %lld\n", (long long)atomic_load(&last_check_time));
+    fprintf(out, "# HELP heimdall_last_check_duration_seconds Duration of the last integrity check.\n");
+    fprintf(out, "# TYPE heimdall_last_check_duration_seconds gauge\n");
+    fprintf(out, "heimdall_last_check_duration_seconds %.9f\n", seconds_of(atomic_load(&last_check_ns)));
+    fprintf(out, "# HELP heimdall_log_dropped_records_total Log records dropped because the log ring was full.\n");
+    fprintf(out, "# TYPE heimdall_log_dropped_records_total counter\n");
+    fprintf(out, "heimdall_log_dropped_records_total %llu\n", (unsigned long long)log_dropped_count());
+}
+
+// Replaced atomically, as node_exporter's textfile collector expects; readable by a collector running unprivileged.
+static void write_textfile(void)
+{
+    char  tmp_path[PATH_MAX + 8];
+    FILE *fp;
+
+    if (METRICS_TEXTFILE_PATH[0] == '\0')
+        return;
+
+    fp = open_atomic(METRICS_TEXTFILE_PATH, tmp_path, sizeof(tmp_path));
+    if (!fp)
+        return;
+
+    fchmod(fileno(fp), 0644);
+    metrics_render(fp);
+    commit_atomic(fp, tmp_path, METRICS_TEXTFILE_PATH);
+}
+
+void metrics_begin_check(void)
+{
+    check_start = governor_clock_ns();
+}
+
+void metrics_end_check(void)
+{
+    atomic_store(&last_check_ns, governor_clock_ns() - check_start);
+    atomic_store(&last_check_time, time(NULL));
+    histogram_record(&check_duration, last_check_ns);
+    atomic_fetch_add(&checks, 1);
+
+    write_textfile();
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// A client that sends an HTTP request (curl --unix-socket) gets a response header; one that only reads gets the
+// exposition alone once METRICS_REQUEST_WAIT_MS have passed.
+static void serve(int client)
+{
+    struct pollfd pfd = {.fd = client, .events = POLLIN, .revents = 0};
+    char          request[1024];
+    ssize_t       n = 0;
+    char         *body = NULL;
+    size_t        body_len = 0;
+    FILE         *out;
+
+    if (poll(&pfd, 1, METRICS_REQUEST_WAIT_MS) == 1)
+        n = recv(client, request, sizeof(request) - 1, 0);
+
+    out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    metrics_render(out);
+    fclose(out);
+
+    if (n >= 4 && strncmp(request, "GET ", 4) == 0)
+    {
+        char header[128];
+        int  len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                            body_len);
+
+        send_all(client, header, (size_t)len);
+    }
+
+    send_all(client, body, body_len);
+    free(body);
+}
+
+static void *server_main(void *arg)
+{
+    sigset_t all;
+
+    (void)arg;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;)
+    {
+        int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (client == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // shutdown() by metrics_close
+        }
+
+        serve(client);
+        close(client);
+    }
+
+    return NULL;
+}
+
+// Serves the exposition on METRICS_SOCKET_PATH, readable by root only. Must run after daemonizing.
+int metrics_init(void)
+{
+    struct sockaddr_un addr;
+    char               dir[sizeof(addr.sun_path)];
+    char              *slash;
+
+    if (METRICS_SOCKET_PATH[0] == '\0' || serving)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(METRICS_SOCKET_PATH) >= sizeof(addr.sun_path))
+    {
+        log_message(LOG_ERR, "Metrics socket path too long: %s", METRICS_SOCKET_PATH);
+        return -1;
+    }
+    memcpy(addr.sun_path, METRICS_SOCKET_PATH, strlen(METRICS_SOCKET_PATH));
+
+    snprintf(dir, sizeof(dir), "%s", METRICS_SOCKET_PATH);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir)
+    {
+        *slash = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+            log_message(LOG_WARNING, "Failed to create %s: %s", dir, strerror(errno));
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        log_message(LOG_ERR, "Failed to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // A socket left behind by an unclean exit would make bind() fail.
+    unlink(METRICS_SOCKET_PATH);
+
+    // The socket is created 0600 by bind() itself; a chmod() afterwards would leave a window in which anyone could
+    // connect. metrics_init() runs before any thread that creates files, so the umask can be changed here.
+    mode_t saved_umask = umask(0177);
+    int    bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(saved_umask);
+
+    if (bound == -1 || listen(listen_fd, 8) == -1)
+    {
+        log_message(LOG_ERR, "Failed to listen on %s: %s", METRICS_SOCKET_PATH, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&server, NULL, server_main, NULL) != 0)
+    {
+        log_message(LOG_ERR, "Failed to start the metrics server");
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(METRICS_SOCKET_PATH);
+        return -1;
+    }
+
+    serving = true;
+    log_message(LOG_INFO, "Serving metrics on %s", METRICS_SOCKET_PATH);
+
+    return 0;
+}
+
+void metrics_close(void)
+{
+    if (!serving)
+        return;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(METRICS_SOCKET_PATH);
+    serving = false;
+}
@@ -1,15 +1,97 @@
 #include "parser.h"
 #include "config.h"
+#include "exclude.h"
 #include "hashing.h"
 #include "logging.h"
+#include "pathmap.h"
 #include "utils.h"
+#include <ctype.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-static void add_default_entries(config_entry_t **entries, size_t *count, size_t *capacity)
+// Parsed once and kept until SIGHUP or an edit of CONFIG_PATH; workers only read it between reloads.
+static config_plan_t         current_plan = {0};
+static bool                  loaded = false;
+static struct stat           config_st;
+static bool                  config_present = false;
+static volatile sig_atomic_t reload_requested = 0;
+
+static void add_default_excludes(void)
+{
+    static const char *defaults[] = {
+        "/etc/mtab",
+        "/etc/ld.so.cache",
+        "/etc/machine-id",
+        "/etc/NetworkManager/*",
+        "/etc/ssl/*",
+        "/etc/alternatives/*",
+        "/etc/systemd/system/*.wants/*",
+        "/etc/pki/tls/certs/*",
+        "/etc/letsencrypt/*",
+        "/etc/cups/*",
+    };
+
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+        exclude_add(defaults[i]);
+}
+
+// Entries naming the same path at file and line level collapse into one file entry that also keeps line digests,
+// so the file is read once per cycle; duplicates keep the most severe alert level.
+static void plan_add(config_plan_t *plan, const char *path, hash_level_t level, alert_level_t alert, unsigned int interval,
+                     bool tree, bool multiset, bool append)
+{
+    pathmap_t      *index = level == HASH_DIR_LVL ? plan->dirs : plan->files;
+    size_t          slot = (size_t)(uintptr_t)pathmap_find(index, path);
+    config_entry_t *entry;
+
+    if (slot)
+    {
+        entry = &plan->entries[slot - 1];
+
+        if (alert < entry->alert_level)
+            entry->alert_level = alert;
+
+        if (interval && (!entry->interval || interval < entry->interval))
+            entry->interval = interval;
+
+        entry->tree = entry->tree || tree;
+        entry->multiset = entry->multiset || multiset;
+        entry->append = entry->append || append;
+
+        if (level != entry->hash_level)
+        {
+            entry->hash_level = HASH_FILE_LVL;
+            entry->lines = true;
+        }
+
+        plan->merged++;
+        return;
+    }
+
+    if (plan->count == plan->capacity)
+    {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 32;
+        plan->entries = safe_realloc(plan->entries, plan->capacity * sizeof(config_entry_t));
+    }
+
+    entry = &plan->entries[plan->count++];
+    entry->path = pathmap_put(index, path, (void *)(uintptr_t)plan->count);
+    entry->hash_level = level;
+    entry->alert_level = alert;
+    entry->lines = level == HASH_LINE_LVL;
+    entry->interval = interval;
+    entry->tree = tree;
+    entry->multiset = multiset;
+    entry->append = append;
+}
+
+static void add_default_entries(config_plan_t *plan)
 {
     const struct
     {
@@ -41,21 +123,10 @@ static void add_default_entries(config_entry_t **entries, size_t *count, size_t
     const size_t default_count = sizeof(defaults) / sizeof(defaults[0]);
 
     for (size_t i = 0; i < default_count; i++)
-    {
-        if (*count >= *capacity)
-        {
-            *capacity *= 2;
-            *entries = safe_realloc(*entries, *capacity * sizeof(config_entry_t));
-        }
-
-        strcpy((*entries)[*count].path, defaults[i].path);
-        (*entries)[*count].hash_level = defaults[i].level;
-        (*entries)[*count].alert_level = defaults[i].alert;
-        (*count)++;
-    }
+        plan_add(plan, defaults[i].path, defaults[i].level, defaults[i].alert, 0, false, false, false);
 }
 
-static void load_user_config(config_entry_t **entries, size_t *count, size_t *capacity)
+static void load_user_config(config_plan_t *plan)
 {
     FILE *fp = fopen(CONFIG_PATH, "r");
     if (!fp)
@@ -72,35 +143,52 @@ static void load_user_config(config_entry_t **entries, size_t *count, size_t *ca
 
         line[strcspn(line, "\n")] = '\0';
 
-        char path[PATH_MAX];
-        char level_char, alert_char;
+        // "exclude = <pattern>" adds an fnmatch pattern to the built-in exclusions.
+        char pattern[sizeof(line)];
+        if (sscanf(line, " exclude = %[^\n]", pattern) == 1)
+        {
+            size_t len = strlen(pattern);
+            while (len > 0 && isspace((unsigned char)pattern[len - 1]))
+                pattern[--len] = '\0';
+            exclude_add(pattern);
+            continue;
+        }
+
+        char          path[PATH_MAX];
+        char          level_field[8];
+        char          level_char, alert_char;
+        hash_level_t  level;
+        alert_level_t alert;
+        unsigned int  interval = 0;
+        int           fields = sscanf(line, " %[^,], %7[^, ] , %c , %u", path, level_field, &alert_char, &interval);
+        bool          tree;
+        bool          multiset;
+        bool          append;
 
-        if (sscanf(line, " %[^,], %c, %c", path, &level_char, &alert_char) != 3)
+        if (fields != 3 && fields != 4)
         {
             log_message(LOG_ERR, "Malformed config line: %s", line);
             continue;
         }
 
-        if (*count >= *capacity)
+        // A 't' after the level ("ft", "dt") opts the entry's large files into tree hashing, an 'm' ("dm", "dtm")
+        // digests its directories as multisets, and an 'a' ("fa", "da") resumes hashing of files that only grew.
+        level_char = level_field[0];
+        tree = strchr(level_field + 1, 't') != NULL;
+        multiset = strchr(level_field + 1, 'm') != NULL;
+        append = strchr(level_field + 1, 'a') != NULL;
+        if (strspn(level_field + 1, "tma") != strlen(level_field + 1) || ((tree || append) && level_char == 'l') ||
+            (multiset && level_char != 'd'))
         {
-            *capacity *= 2;
-            *entries = realloc(*entries, *capacity * sizeof(config_entry_t));
-            if (!*entries)
-            {
-                log_message(LOG_ERR, "Memory allocation failed in load_user_config()");
-                fclose(fp);
-                exit(EXIT_FAILURE);
-            }
+            log_message(LOG_WARNING, "Unknown hash level '%s' in %s", level_field, path);
+            continue;
         }
 
-        strncpy((*entries)[*count].path, path, sizeof((*entries)[*count].path) - 1);
-        (*entries)[*count].path[sizeof((*entries)[*count].path) - 1] = '\0';
-
         switch (level_char)
         {
-            case 'd': (*entries)[*count].hash_level = HASH_DIR_LVL; break;
-            case 'f': (*entries)[*count].hash_level = HASH_FILE_LVL; break;
-            case 'l': (*entries)[*count].hash_level = HASH_LINE_LVL; break;
+            case 'd': level = HASH_DIR_LVL; break;
+            case 'f': level = HASH_FILE_LVL; break;
+            case 'l': level = HASH_LINE_LVL; break;
             default:
                 log_message(LOG_WARNING, "Unknown hash level '%c' in %s", level_char, path);
                 continue;
@@ -108,32 +196,96 @@ static void load_user_config(config_entry_t **entries, size_t *count, size_t *ca
 
         switch (alert_char)
         {
-            case 'r': (*entries)[*count].alert_level = ALERT_RED; break;
-            case 'y': (*entries)[*count].alert_level = ALERT_YELLOW; break;
-            case 'g': (*entries)[*count].alert_level = ALERT_GREEN; break;
+            case 'r': alert = ALERT_RED; break;
+            case 'y': alert = ALERT_YELLOW; break;
+            case 'g': alert = ALERT_GREEN; break;
             default:
                 log_message(LOG_WARNING, "Unknown alert level '%c' in %s", alert_char, path);
                 continue;
         }
 
-        (*count)++;
+        plan_add(plan, path, level, alert, interval, tree, multiset, append);
     }
 
     fclose(fp);
 }
 
-config_entry_t *parse_config(size_t *count_out)
+static void free_plan(config_plan_t *plan)
+{
+    pathmap_free(plan->files, NULL);
+    pathmap_free(plan->dirs, NULL);
+    free(plan->entries);
+    memset(plan, 0, sizeof(config_plan_t));
+}
+
+static bool same_config_stat(void)
+{
+    struct stat st;
+    bool        present = stat(CONFIG_PATH, &st) == 0;
+
+    if (present != config_present)
+        return false;
+
+    return !present || (st.st_dev == config_st.st_dev && st.st_ino == config_st.st_ino && st.st_size == config_st.st_size &&
+                        st.st_mtim.tv_sec == config_st.st_mtim.tv_sec && st.st_mtim.tv_nsec == config_st.st_mtim.tv_nsec &&
+                        st.st_ctim.tv_sec == config_st.st_ctim.tv_sec && st.st_ctim.tv_nsec == config_st.st_ctim.tv_nsec);
+}
+
+static void load_plan(void)
 {
-    size_t count = 0;
-    size_t capacity = 8;
+    free_plan(&current_plan);
+    current_plan.files = pathmap_new();
+    current_plan.dirs = pathmap_new();
 
-    config_entry_t *entries = safe_malloc(capacity * sizeof(config_entry_t));
+    // Stat before reading, so an edit racing the parse is picked up by the next refresh.
+    config_present = stat(CONFIG_PATH, &config_st) == 0;
 
-    add_default_entries(&entries, &count, &capacity);
-    load_user_config(&entries, &count, &capacity);
+    exclude_clear();
+    add_default_excludes();
+    add_default_entries(&current_plan);
+    load_user_config(&current_plan);
+    exclude_compile();
 
-    *count_out = count;
-    log_message(LOG_INFO, "Loaded %zu total monitored paths (including defaults).", count);
+    loaded = true;
+    log_message(LOG_INFO, "Loaded %zu total monitored paths (including defaults, %zu overlapping entries merged).",
+                current_plan.count, current_plan.merged);
+}
 
-    return entries;
+const config_plan_t *config_plan(void)
+{
+    if (!loaded)
+        load_plan();
+
+    return &current_plan;
+}
+
+// Reloads on SIGHUP or when the config file's stat tuple changed; returns true when the plan was rebuilt.
+bool config_refresh(void)
+{
+    if (!loaded)
+    {
+        load_plan();
+        return true;
+    }
+
+    if (!reload_requested && same_config_stat())
+        return false;
+
+    reload_requested = 0;
+    log_message(LOG_INFO, "Reloading %s", CONFIG_PATH);
+    load_plan();
+
+    return true;
+}
+
+void config_request_reload(void)
+{
+    reload_requested = 1;
+}
+
+void config_release(void)
+{
+    free_plan(&current_plan);
+    exclude_clear();
+    loaded = false;
 }
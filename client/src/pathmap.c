@@ -0,0 +1,174 @@
+#include "pathmap.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATHMAP_INITIAL_BUCKETS 1024
+
+typedef struct pathmap_node
+{
+    char                *key;
+    void                *value;
+    struct pathmap_node *next;
+} pathmap_node_t;
+
+struct pathmap
+{
+    pathmap_node_t **buckets;
+    size_t           bucket_count;
+    size_t           size;
+};
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static void grow(pathmap_t *map)
+{
+    size_t           new_count = map->bucket_count * 2;
+    pathmap_node_t **new_buckets = safe_malloc(new_count * sizeof(pathmap_node_t *));
+
+    memset(new_buckets, 0, new_count * sizeof(pathmap_node_t *));
+
+    for (size_t i = 0; i < map->bucket_count; i++)
+    {
+        pathmap_node_t *node = map->buckets[i];
+        while (node)
+        {
+            pathmap_node_t *next = node->next;
+            size_t          slot = hash_key(node->key) & (new_count - 1);
+
+            node->next = new_buckets[slot];
+            new_buckets[slot] = node;
+            node = next;
+        }
+    }
+
+    free(map->buckets);
+    map->buckets = new_buckets;
+    map->bucket_count = new_count;
+}
+
+pathmap_t *pathmap_new(void)
+{
+    pathmap_t *map = safe_malloc(sizeof(pathmap_t));
+
+    map->bucket_count = PATHMAP_INITIAL_BUCKETS;
+    map->buckets = safe_malloc(map->bucket_count * sizeof(pathmap_node_t *));
+    memset(map->buckets, 0, map->bucket_count * sizeof(pathmap_node_t *));
+    map->size = 0;
+
+    return map;
+}
+
+void pathmap_free(pathmap_t *map, pathmap_free_fn free_value)
+{
+    if (!map)
+        return;
+
+    for (size_t i = 0; i < map->bucket_count; i++)
+    {
+        pathmap_node_t *node = map->buckets[i];
+        while (node)
+        {
+            pathmap_node_t *next = node->next;
+
+            if (free_value)
+                free_value(node->value);
+            free(node->key);
+            free(node);
+            node = next;
+        }
+    }
+
+    free(map->buckets);
+    free(map);
+}
+
+static pathmap_node_t *find_node(const pathmap_t *map, const char *key)
+{
+    pathmap_node_t *node = map->buckets[hash_key(key) & (map->bucket_count - 1)];
+
+    while (node && strcmp(node->key, key) != 0)
+        node = node->next;
+
+    return node;
+}
+
+void *pathmap_find(const pathmap_t *map, const char *key)
+{
+    pathmap_node_t *node = find_node(map, key);
+
+    return node ? node->value : NULL;
+}
+
+// Returns the map's own copy of the key, which stays valid until the entry is removed.
+const char *pathmap_put(pathmap_t *map, const char *key, void *value)
+{
+    pathmap_node_t *node = find_node(map, key);
+
+    if (node)
+    {
+        node->value = value;
+        return node->key;
+    }
+
+    if (map->size >= map->bucket_count)
+        grow(map);
+
+    size_t slot = hash_key(key) & (map->bucket_count - 1);
+
+    node = safe_malloc(sizeof(pathmap_node_t));
+    node->key = safe_strdup(key);
+    node->value = value;
+    node->next = map->buckets[slot];
+    map->buckets[slot] = node;
+    map->size++;
+
+    return node->key;
+}
+
+void *pathmap_remove(pathmap_t *map, const char *key)
+{
+    pathmap_node_t **link = &map->buckets[hash_key(key) & (map->bucket_count - 1)];
+
+    while (*link && strcmp((*link)->key, key) != 0)
+        link = &(*link)->next;
+
+    if (!*link)
+        return NULL;
+
+    pathmap_node_t *node = *link;
+    void           *value = node->value;
+
+    *link = node->next;
+    free(node->key);
+    free(node);
+    map->size--;
+
+    return value;
+}
+
+size_t pathmap_size(const pathmap_t *map)
+{
+    return map->size;
+}
+
+void pathmap_foreach(const pathmap_t *map, pathmap_visit_fn visit, void *arg)
+{
+    for (size_t i = 0; i < map->bucket_count; i++)
+    {
+        for (const pathmap_node_t *node = map->buckets[i]; node; node = node->next)
+            visit(node->key, node->value, arg);
+    }
+}
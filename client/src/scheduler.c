@@ -0,0 +1,246 @@
+#include "scheduler.h"
+#include "config.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4 // one-second ticks; the top level reaches 64^4 s, about 194 days
+
+typedef struct sched_timer
+{
+    struct sched_timer *next;
+    int64_t             expires;
+    unsigned int        period;
+} sched_timer_t;
+
+// Hierarchical timer wheel: level L buckets timers by bits [6L, 6L + 6) of their expiry tick, and a level's slot is
+// cascaded into the levels below when the tick reaches it. One timer per entry, plus one for the baseline cycle.
+static struct
+{
+    sched_timer_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+    sched_timer_t *timers;
+    size_t         count;
+    int64_t        current; // next tick to be processed
+} wheel = {0};
+
+static int64_t now_tick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec;
+}
+
+static unsigned int entry_period(const config_entry_t *entry, unsigned int scale)
+{
+    unsigned int period = entry->interval;
+
+    if (period == 0)
+    {
+        switch (entry->alert_level)
+        {
+            case ALERT_RED: period = FIM_RED_INTERVAL_SEC; break;
+            case ALERT_YELLOW: period = FIM_YELLOW_INTERVAL_SEC; break;
+            case ALERT_GREEN: period = FIM_GREEN_INTERVAL_SEC; break;
+            default: period = FIM_GREEN_INTERVAL_SEC; break;
+        }
+    }
+
+    return period * scale > 0 ? period * scale : 1;
+}
+
+static void insert(sched_timer_t *timer)
+{
+    int64_t delta = timer->expires - wheel.current;
+    int     level = 0;
+
+    if (delta < 0)
+    {
+        timer->expires = wheel.current;
+        delta = 0;
+    }
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (int64_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    size_t slot = (size_t)(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    timer->next = wheel.slots[level][slot];
+    wheel.slots[level][slot] = timer;
+}
+
+// Re-files every timer of the level's current slot; they now sit close enough for a lower level.
+static void cascade(int level)
+{
+    size_t         slot = (size_t)(wheel.current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    sched_timer_t *timer = wheel.slots[level][slot];
+
+    wheel.slots[level][slot] = NULL;
+
+    while (timer)
+    {
+        sched_timer_t *next = timer->next;
+        insert(timer);
+        timer = next;
+    }
+}
+
+static void clear_slots(void)
+{
+    memset(wheel.slots, 0, sizeof(wheel.slots));
+}
+
+void scheduler_reset(const config_entry_t *entries, size_t count, unsigned int scale)
+{
+    free(wheel.timers);
+    clear_slots();
+
+    wheel.count = count;
+    wheel.current = now_tick();
+    wheel.timers = safe_malloc((count + 1) * sizeof(sched_timer_t));
+
+    for (size_t i = 0; i < count; i++)
+        wheel.timers[i].period = entry_period(&entries[i], scale);
+    wheel.timers[count].period = FIM_INTERVAL_SEC * scale > 0 ? FIM_INTERVAL_SEC * scale : 1;
+
+    // Everything is due at once, which doubles as the initial sweep.
+    for (size_t i = 0; i <= count; i++)
+    {
+        wheel.timers[i].expires = wheel.current;
+        insert(&wheel.timers[i]);
+    }
+}
+
+// Advances the wheel to the present, marks every entry that came due and re-arms it one period from now.
+size_t scheduler_collect(bool due[], size_t count, bool *cycle_due)
+{
+    int64_t        now = now_tick();
+    sched_timer_t *fired = NULL;
+    size_t         marked = 0;
+
+    *cycle_due = false;
+
+    while (wheel.current <= now)
+    {
+        if ((wheel.current & WHEEL_MASK) == 0)
+        {
+            for (int level = 1; level < WHEEL_LEVELS; level++)
+            {
+                cascade(level);
+                if (((wheel.current >> (WHEEL_BITS * level)) & WHEEL_MASK) != 0)
+                    break;
+            }
+        }
+
+        sched_timer_t **slot = &wheel.slots[0][wheel.current & WHEEL_MASK];
+
+        while (*slot)
+        {
+            sched_timer_t *timer = *slot;
+
+            *slot = timer->next;
+            timer->next = fired;
+            fired = timer;
+        }
+
+        wheel.current++;
+    }
+
+    while (fired)
+    {
+        sched_timer_t *timer = fired;
+        size_t         index = (size_t)(timer - wheel.timers);
+
+        fired = timer->next;
+
+        if (index == wheel.count)
+            *cycle_due = true;
+        else if (index < count && !due[index])
+        {
+            due[index] = true;
+            marked++;
+        }
+
+        timer->expires = now + timer->period;
+        insert(timer);
+    }
+
+    return marked;
+}
+
+// For full sweeps: every entry is checked now, so each period restarts from this moment.
+void scheduler_rearm_all(bool due[], size_t count)
+{
+    int64_t now = now_tick();
+
+    clear_slots();
+
+    for (size_t i = 0; i <= wheel.count; i++)
+    {
+        if (i < wheel.count && i < count)
+            due[i] = true;
+
+        // The cycle timer keeps its own phase.
+        if (i < wheel.count)
+            wheel.timers[i].expires = now + wheel.timers[i].period;
+        insert(&wheel.timers[i]);
+    }
+}
+
+// Milliseconds until the earliest timer expires, so the daemon sleeps exactly until then.
+int scheduler_timeout_ms(void)
+{
+    int64_t         next = INT64_MAX;
+    struct timespec ts;
+
+    if (!wheel.timers)
+        return -1;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        size_t base = (size_t)(wheel.current >> (WHEEL_BITS * level));
+
+        // The current slot holds either the block still awaiting its cascade or the one 64 slots ahead; the first
+        // busy slot after it holds the earliest of the rest.
+        for (size_t i = 0; i < WHEEL_SIZE; i++)
+        {
+            const sched_timer_t *timer = wheel.slots[level][(base + i) & WHEEL_MASK];
+
+            if (!timer)
+                continue;
+
+            for (; timer; timer = timer->next)
+            {
+                if (timer->expires < next)
+                    next = timer->expires;
+            }
+
+            if (i > 0)
+                break;
+        }
+    }
+
+    if (next == INT64_MAX)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    int64_t wait = (next - (int64_t)ts.tv_sec) * 1000 - ts.tv_nsec / 1000000;
+
+    if (wait <= 0)
+        return 0;
+
+    return wait > INT32_MAX ? INT32_MAX : (int)wait;
+}
+
+void scheduler_close(void)
+{
+    free(wheel.timers);
+    memset(&wheel, 0, sizeof(wheel));
+}
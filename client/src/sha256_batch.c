@@ -0,0 +1,227 @@
+#include "sha256_batch.h"
+#include "config.h"
+#include "digest.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct
+{
+    const unsigned char *data;
+    size_t               full_blocks;
+    size_t               blocks;
+    unsigned char        tail[2 * SHA256_BLOCK_SIZE]; // last partial block, 0x80 padding and bit length
+} sha256_lane_t;
+
+static sha256_batch_impl_t selected = SHA256_BATCH_AUTO;
+static pthread_once_t      select_once = PTHREAD_ONCE_INIT;
+
+static void select_impl(void)
+{
+    selected = SHA256_BATCH_EVP;
+
+    if (SHA256_BATCH_FORCE != SHA256_BATCH_AUTO)
+    {
+        selected = SHA256_BATCH_FORCE;
+        return;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    // One SHA-NI stream through OpenSSL outruns eight or sixteen software lanes.
+    if (__builtin_cpu_supports("sha"))
+        selected = SHA256_BATCH_EVP;
+    else if (__builtin_cpu_supports("avx512f"))
+        selected = SHA256_BATCH_AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+        selected = SHA256_BATCH_AVX2;
+#endif
+}
+
+sha256_batch_impl_t sha256_batch_impl(void)
+{
+    pthread_once(&select_once, select_impl);
+
+    return selected;
+}
+
+const char *sha256_batch_impl_name(sha256_batch_impl_t impl)
+{
+    switch (impl)
+    {
+        case SHA256_BATCH_AUTO: return "auto";
+        case SHA256_BATCH_EVP: return "evp";
+        case SHA256_BATCH_AVX2: return "avx2";
+        case SHA256_BATCH_AVX512: return "avx512";
+        default: return "unknown";
+    }
+}
+
+static void batch_evp(const unsigned char *const data[], const size_t len[], size_t count,
+                      unsigned char digests[][SHA256_DIGEST_LENGTH])
+{
+    for (size_t i = 0; i < count; i++)
+        digest_sha256_buffer(data[i], len[i], digests[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const unsigned char zero_block[SHA256_BLOCK_SIZE] = {0};
+
+typedef uint32_t lanes8_t __attribute__((vector_size(32)));
+typedef uint32_t lanes16_t __attribute__((vector_size(64)));
+
+static inline uint32_t load_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void store_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void lane_init(sha256_lane_t *lane, const unsigned char *data, size_t len)
+{
+    size_t   rest = len % SHA256_BLOCK_SIZE;
+    size_t   tail_blocks = rest < SHA256_BLOCK_SIZE - 8 ? 1 : 2;
+    uint64_t bits = (uint64_t)len * 8;
+
+    lane->data = data;
+    lane->full_blocks = len / SHA256_BLOCK_SIZE;
+    lane->blocks = lane->full_blocks + tail_blocks;
+
+    memset(lane->tail, 0, sizeof(lane->tail));
+    if (rest > 0)
+        memcpy(lane->tail, data + len - rest, rest);
+    lane->tail[rest] = 0x80;
+
+    for (size_t i = 0; i < 8; i++)
+        lane->tail[tail_blocks * SHA256_BLOCK_SIZE - 1 - i] = (unsigned char)(bits >> (8 * i));
+}
+
+static inline const unsigned char *lane_block(const sha256_lane_t *lane, size_t n)
+{
+    if (n < lane->full_blocks)
+        return lane->data + n * SHA256_BLOCK_SIZE;
+
+    return lane->tail + (n - lane->full_blocks) * SHA256_BLOCK_SIZE;
+}
+
+#define LANE_VEC    lanes8_t
+#define LANE_COUNT  8
+#define LANE_KERNEL sha256_lanes_avx2
+#define LANE_TARGET "avx2"
+#include "sha256_lanes.inc"
+#undef LANE_VEC
+#undef LANE_COUNT
+#undef LANE_KERNEL
+#undef LANE_TARGET
+
+#define LANE_VEC    lanes16_t
+#define LANE_COUNT  16
+#define LANE_KERNEL sha256_lanes_avx512
+#define LANE_TARGET "avx512f"
+#include "sha256_lanes.inc"
+#undef LANE_VEC
+#undef LANE_COUNT
+#undef LANE_KERNEL
+#undef LANE_TARGET
+
+typedef struct
+{
+    size_t len;
+    size_t index;
+} lane_order_t;
+
+static int compare_lengths(const void *a, const void *b)
+{
+    const lane_order_t *x = a;
+    const lane_order_t *y = b;
+
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+// Buffers are hashed one vector's worth of lanes at a time, grouped by length so short lanes idle as little as possible.
+static void batch_lanes(const unsigned char *const data[], const size_t len[], size_t count,
+                        unsigned char digests[][SHA256_DIGEST_LENGTH], size_t width)
+{
+    sha256_lane_t  lanes[16];
+    unsigned char  out[16][SHA256_DIGEST_LENGTH];
+    lane_order_t  *order = safe_malloc(count * sizeof(lane_order_t));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        order[i].len = len[i];
+        order[i].index = i;
+    }
+
+    qsort(order, count, sizeof(lane_order_t), compare_lengths);
+
+    for (size_t base = 0; base < count; base += width)
+    {
+        size_t group = count - base < width ? count - base : width;
+
+        for (size_t l = 0; l < group; l++)
+            lane_init(&lanes[l], data[order[base + l].index], order[base + l].len);
+
+        if (width == 16)
+            sha256_lanes_avx512(lanes, group, out);
+        else
+            sha256_lanes_avx2(lanes, group, out);
+
+        for (size_t l = 0; l < group; l++)
+            memcpy(digests[order[base + l].index], out[l], SHA256_DIGEST_LENGTH);
+    }
+
+    free(order);
+}
+
+#endif
+
+void sha256_batch(const unsigned char *const data[], const size_t len[], size_t count,
+                  unsigned char digests[][SHA256_DIGEST_LENGTH])
+{
+    switch (sha256_batch_impl())
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        case SHA256_BATCH_AVX2:
+            batch_lanes(data, len, count, digests, 8);
+            break;
+        case SHA256_BATCH_AVX512:
+            batch_lanes(data, len, count, digests, 16);
+            break;
+#else
+        case SHA256_BATCH_AVX2:
+        case SHA256_BATCH_AVX512:
+#endif
+        case SHA256_BATCH_AUTO:
+        case SHA256_BATCH_EVP:
+        default:
+            batch_evp(data, len, count, digests);
+            break;
+    }
+}
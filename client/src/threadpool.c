@@ -0,0 +1,356 @@
+#include "threadpool.h"
+#include "config.h"
+#include "governor.h"
+#include "logging.h"
+#include "metrics.h"
+#include "utils.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+#define HELP_WAIT_NSEC 1000000L
+
+typedef struct
+{
+    task_fn_t        fn;
+    void            *arg;
+    metrics_scope_t *scope; // the submitter's, so nested work is charged to the same config entry
+    uint64_t         queued_ns;
+} task_t;
+
+// Owner pushes and pops at the bottom (LIFO, cache-warm); thieves take from the top (FIFO, oldest and largest work).
+typedef struct
+{
+    pthread_mutex_t mutex;
+    task_t         *tasks;
+    size_t          capacity;
+    size_t          top;
+    size_t          bottom;
+} deque_t;
+
+typedef struct
+{
+    pthread_t thread;
+    deque_t   deque;
+    size_t    index;
+} worker_t;
+
+static worker_t       *workers = NULL;
+static size_t          worker_count = 0;
+static atomic_size_t   queued = 0;
+static atomic_size_t   next_victim = 0;
+static bool            stopping = false;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  init_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local worker_t *current_worker = NULL;
+
+static void deque_init(deque_t *dq)
+{
+    pthread_mutex_init(&dq->mutex, NULL);
+    dq->capacity = DEQUE_INITIAL_CAPACITY;
+    dq->tasks = safe_malloc(dq->capacity * sizeof(task_t));
+    dq->top = 0;
+    dq->bottom = 0;
+}
+
+static void deque_destroy(deque_t *dq)
+{
+    pthread_mutex_destroy(&dq->mutex);
+    free(dq->tasks);
+}
+
+static void deque_push(deque_t *dq, task_t task)
+{
+    pthread_mutex_lock(&dq->mutex);
+
+    if (dq->bottom - dq->top == dq->capacity)
+    {
+        size_t  new_capacity = dq->capacity * 2;
+        task_t *grown = safe_malloc(new_capacity * sizeof(task_t));
+
+        for (size_t i = dq->top; i < dq->bottom; i++)
+            grown[i % new_capacity] = dq->tasks[i % dq->capacity];
+
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->capacity = new_capacity;
+    }
+
+    dq->tasks[dq->bottom % dq->capacity] = task;
+    dq->bottom++;
+
+    pthread_mutex_unlock(&dq->mutex);
+}
+
+static bool deque_pop(deque_t *dq, task_t *out)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&dq->mutex);
+
+    if (dq->bottom != dq->top)
+    {
+        dq->bottom--;
+        *out = dq->tasks[dq->bottom % dq->capacity];
+        found = true;
+    }
+
+    pthread_mutex_unlock(&dq->mutex);
+
+    return found;
+}
+
+static bool deque_steal(deque_t *dq, task_t *out)
+{
+    bool found = false;
+
+    if (pthread_mutex_trylock(&dq->mutex) != 0)
+        return false;
+
+    if (dq->bottom != dq->top)
+    {
+        *out = dq->tasks[dq->top % dq->capacity];
+        dq->top++;
+        found = true;
+    }
+
+    pthread_mutex_unlock(&dq->mutex);
+
+    return found;
+}
+
+static bool find_task(worker_t *self, task_t *out)
+{
+    bool   found = self && deque_pop(&self->deque, out);
+    size_t start = self ? self->index + 1 : atomic_fetch_add(&next_victim, 1);
+
+    for (size_t i = 0; !found && i < worker_count; i++)
+    {
+        worker_t *victim = &workers[(start + i) % worker_count];
+
+        found = victim != self && deque_steal(&victim->deque, out);
+    }
+
+    if (found)
+        atomic_fetch_sub(&queued, 1);
+
+    return found;
+}
+
+static void run_task(const task_t *task)
+{
+    metrics_scope_t *saved = metrics_enter(task->scope);
+
+    metrics_record(METRIC_QUEUE_WAIT, governor_clock_ns() - task->queued_ns);
+    task->fn(task->arg);
+    metrics_leave(saved);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *self = arg;
+    task_t    task;
+
+    current_worker = self;
+    governor_enter_worker();
+
+    for (;;)
+    {
+        if (find_task(self, &task))
+        {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_mutex);
+        while (atomic_load(&queued) == 0 && !stopping)
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        bool done = stopping && atomic_load(&queued) == 0;
+        pthread_mutex_unlock(&idle_mutex);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+int threadpool_init(size_t thread_count)
+{
+    if (workers)
+        return 0;
+
+    if (thread_count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = online > 0 ? (size_t)online : 1;
+    }
+
+    workers = safe_malloc(thread_count * sizeof(worker_t));
+    memset(workers, 0, thread_count * sizeof(worker_t));
+    stopping = false;
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        workers[i].index = i;
+        deque_init(&workers[i].deque);
+    }
+
+    worker_count = thread_count;
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        int rc = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (rc != 0)
+        {
+            log_message(LOG_ERR, "Failed to start hashing worker %zu: %s", i, strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    log_message(LOG_INFO, "Started %zu hashing worker threads", thread_count);
+
+    return 0;
+}
+
+static void init_default(void)
+{
+    threadpool_init(FIM_HASH_THREADS);
+}
+
+void threadpool_shutdown(void)
+{
+    if (!workers)
+        return;
+
+    pthread_mutex_lock(&idle_mutex);
+    stopping = true;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+
+    for (size_t i = 0; i < worker_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (size_t i = 0; i < worker_count; i++)
+        deque_destroy(&workers[i].deque);
+
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+void threadpool_submit(task_fn_t fn, void *arg)
+{
+    task_t task = {fn, arg, metrics_current(), governor_clock_ns()};
+
+    pthread_once(&init_once, init_default);
+
+    // Count before pushing so a thief never observes more tasks than the counter admits.
+    atomic_fetch_add(&queued, 1);
+
+    if (current_worker)
+        deque_push(&current_worker->deque, task);
+    else
+        deque_push(&workers[atomic_fetch_add(&next_victim, 1) % worker_count].deque, task);
+
+    pthread_mutex_lock(&idle_mutex);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+bool threadpool_is_worker(void)
+{
+    return current_worker != NULL;
+}
+
+size_t threadpool_size(void)
+{
+    pthread_once(&init_once, init_default);
+
+    return worker_count;
+}
+
+void task_group_init(task_group_t *group)
+{
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->cond, NULL);
+    group->pending = 0;
+}
+
+void task_group_destroy(task_group_t *group)
+{
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond);
+}
+
+void task_group_add(task_group_t *group, size_t count)
+{
+    pthread_mutex_lock(&group->mutex);
+    group->pending += count;
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void task_group_done(task_group_t *group)
+{
+    pthread_mutex_lock(&group->mutex);
+    // Throttled producers wait for the count to drop, not just to reach zero.
+    group->pending--;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+// Workers that wait keep executing queued tasks so nested waits cannot starve the pool.
+static void wait_for_pending(task_group_t *group, size_t limit)
+{
+    task_t task;
+
+    pthread_mutex_lock(&group->mutex);
+
+    while (group->pending > limit)
+    {
+        if (current_worker)
+        {
+            pthread_mutex_unlock(&group->mutex);
+
+            if (find_task(current_worker, &task))
+            {
+                run_task(&task);
+                pthread_mutex_lock(&group->mutex);
+                continue;
+            }
+
+            pthread_mutex_lock(&group->mutex);
+            if (group->pending <= limit)
+                break;
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long nsec = deadline.tv_nsec + HELP_WAIT_NSEC;
+            deadline.tv_sec += nsec / 1000000000L;
+            deadline.tv_nsec = nsec % 1000000000L;
+            pthread_cond_timedwait(&group->cond, &group->mutex, &deadline);
+        }
+        else
+        {
+            pthread_cond_wait(&group->cond, &group->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void task_group_wait(task_group_t *group)
+{
+    wait_for_pending(group, 0);
+}
+
+// Returns once at most limit tasks of the group are outstanding, so a producer can bound its backlog.
+void task_group_throttle(task_group_t *group, size_t limit)
+{
+    wait_for_pending(group, limit);
+}
@@ -0,0 +1,367 @@
+#include "uring.h"
+#include "metrics.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_IGNORE UINT64_MAX // user_data of operations whose results are not reported
+
+struct uring
+{
+    int                  fd;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             queued; // prepared but not yet submitted
+    bool                 fixed;  // the buffer is registered, so reads into it skip the per-call page pinning
+    unsigned char       *buffer;
+    size_t               buffer_size;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, const void *arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Kernels from before 5.6 set up a ring but know none of the file operations, so each one is probed for.
+static bool ring_supports_ops(int fd)
+{
+    static const unsigned char needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_READ_FIXED,
+                                           IORING_OP_CLOSE, IORING_OP_FADVISE};
+    size_t                     size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe     *probe = safe_malloc(size);
+    bool                       ok;
+
+    memset(probe, 0, size);
+    ok = ring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; ok && i < sizeof(needed); i++)
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+
+    return ok;
+}
+
+static void ring_unmap(uring_t *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+// Returns NULL with errno set when the kernel has no usable io_uring. The buffer is registered when the kernel allows
+// it; reads land in it either way.
+uring_t *uring_create(unsigned entries, void *buffer, size_t buffer_size)
+{
+    struct io_uring_params params;
+    uring_t               *ring;
+    struct iovec           iov = {buffer, buffer_size};
+    int                    saved;
+
+    memset(&params, 0, sizeof(params));
+
+    ring = safe_malloc(sizeof(uring_t));
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->fd = ring_setup(entries, &params);
+    if (ring->fd == -1)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    if (!ring_supports_ops(ring->fd))
+    {
+        close(ring->fd);
+        free(ring);
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        saved = errno;
+        ring_unmap(ring);
+        close(ring->fd);
+        free(ring);
+        errno = saved;
+        return NULL;
+    }
+
+    unsigned char *sq = ring->sq_ring;
+    unsigned char *cq = ring->cq_ring;
+
+    ring->sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+
+    ring->buffer = buffer;
+    ring->buffer_size = buffer_size;
+    ring->fixed = buffer && ring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    return ring;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    if (!ring)
+        return;
+
+    ring_unmap(ring);
+    close(ring->fd);
+    free(ring);
+}
+
+// Callers queue at most the entries the ring was created with between runs; the kernel only reads the queue during
+// uring_run(), so the tail is ours.
+static struct io_uring_sqe *next_sqe(uring_t *ring)
+{
+    unsigned             tail = *ring->sq_tail + ring->queued;
+    unsigned             index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+
+    return sqe;
+}
+
+void uring_prep_openat(uring_t *ring, int dir_fd, const char *name, int flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->open_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_statx(uring_t *ring, int dir_fd, const char *name, struct statx *out, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t)(uintptr_t)out;
+    sqe->statx_flags = 0;
+    sqe->user_data = user_data;
+}
+
+// Operations asked for by flags follow the read as a hard-linked chain, which runs whether or not the read succeeded;
+// their completions are consumed by uring_run() without being reported.
+void uring_prep_read(uring_t *ring, int fd, void *buf, unsigned len, uint64_t offset, unsigned flags,
+                     uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    unsigned char       *at = buf;
+    bool                 fixed = ring->fixed && at >= ring->buffer && at + len <= ring->buffer + ring->buffer_size;
+
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->rw_flags = flags & URING_READ_NOWAIT ? RWF_NOWAIT : 0;
+    sqe->user_data = user_data;
+
+    if (flags & URING_READ_DROP)
+    {
+        sqe->flags |= IOSQE_IO_HARDLINK;
+
+        sqe = next_sqe(ring);
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->fd = fd;
+        sqe->off = offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+        sqe->len = 0; // to the end of the file
+        sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+        sqe->user_data = URING_IGNORE;
+    }
+
+    if (flags & URING_READ_CLOSE)
+    {
+        sqe->flags |= IOSQE_IO_HARDLINK;
+        uring_prep_close(ring, fd);
+    }
+}
+
+void uring_prep_close(uring_t *ring, int fd)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = URING_IGNORE;
+}
+
+// Submits everything prepared and waits until all of it has completed, usually in a single io_uring_enter. Returns -1
+// with errno set if the ring itself failed; per-operation errors arrive as negative results.
+int uring_run(uring_t *ring, uring_complete_fn complete, void *arg)
+{
+    unsigned to_submit = ring->queued;
+    unsigned outstanding = ring->queued;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    while (outstanding > 0)
+    {
+        int submitted = ring_enter(ring->fd, to_submit, outstanding, IORING_ENTER_GETEVENTS);
+
+        metrics_count(METRIC_URING_ENTER_CALLS, 1);
+        if (submitted == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -1;
+        }
+        to_submit -= (unsigned)submitted;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            if (cqe->user_data != URING_IGNORE)
+                complete(cqe->user_data, cqe->res, arg);
+            metrics_count(METRIC_URING_OPS, 1);
+            outstanding--;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+#else
+
+uring_t *uring_create(unsigned entries, void *buffer, size_t buffer_size)
+{
+    (void)entries;
+    (void)buffer;
+    (void)buffer_size;
+
+    errno = ENOSYS;
+
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    (void)ring;
+}
+
+void uring_prep_openat(uring_t *ring, int dir_fd, const char *name, int flags, uint64_t user_data)
+{
+    (void)ring;
+    (void)dir_fd;
+    (void)name;
+    (void)flags;
+    (void)user_data;
+}
+
+void uring_prep_statx(uring_t *ring, int dir_fd, const char *name, struct statx *out, uint64_t user_data)
+{
+    (void)ring;
+    (void)dir_fd;
+    (void)name;
+    (void)out;
+    (void)user_data;
+}
+
+void uring_prep_read(uring_t *ring, int fd, void *buf, unsigned len, uint64_t offset, unsigned flags,
+                     uint64_t user_data)
+{
+    (void)ring;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)offset;
+    (void)flags;
+    (void)user_data;
+}
+
+void uring_prep_close(uring_t *ring, int fd)
+{
+    (void)ring;
+    (void)fd;
+}
+
+int uring_run(uring_t *ring, uring_complete_fn complete, void *arg)
+{
+    (void)ring;
+    (void)complete;
+    (void)arg;
+
+    errno = ENOSYS;
+
+    return -1;
+}
+
+#endif
@@ -1,18 +1,9 @@
 #include "../include/utils.h"
 #include "../include/logging.h"
-
-DIR *open_directory(const char *directory_path)
-{
-    DIR *dir = opendir(directory_path);
-
-    if (!dir)
-    {
-        log_message(LOG_ERR, "Error opening directory %s: %s", directory_path, strerror(errno));
-        return NULL;
-    }
-
-    return dir;
-}
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 FILE *open_file(const char *filename)
 {
@@ -67,29 +58,73 @@ char *safe_strdup(const char *s)
     return copy;
 }
 
-char **get_all_entries(const char *dir_path, size_t *entry_count)
+// Opens a temporary sibling of path for writing, creating missing parent directories.
+FILE *open_atomic(const char *path, char *tmp_path, size_t tmp_size)
 {
-    DIR           *dir;
-    struct dirent *entry;
-    char         **entries;
+    char  dir_path[PATH_MAX];
+    char *slash;
+    int   fd;
+    FILE *fp;
+
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    slash = strrchr(dir_path, '/');
+    if (slash && slash != dir_path)
+    {
+        *slash = '\0';
+
+        for (char *p = dir_path + 1;; p++)
+        {
+            if (*p != '/' && *p != '\0')
+                continue;
+
+            char saved = *p;
+            *p = '\0';
+            if (mkdir(dir_path, 0700) == -1 && errno != EEXIST)
+            {
+                log_message(LOG_ERR, "Failed to create %s: %s", dir_path, strerror(errno));
+                return NULL;
+            }
+            *p = saved;
+
+            if (saved == '\0')
+                break;
+        }
+    }
 
-    dir = open_directory(dir_path);
-    if (!dir)
+    snprintf(tmp_path, tmp_size, "%s.tmp", path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!fp)
+    {
+        log_message(LOG_ERR, "Failed to write %s: %s", tmp_path, strerror(errno));
+        if (fd != -1)
+            close(fd);
         return NULL;
+    }
 
-    entries = NULL;
-    *entry_count = 0;
+    return fp;
+}
 
-    while ((entry = readdir(dir)) != NULL)
+// Flushes and fsyncs the temporary file, then renames it over path.
+int commit_atomic(FILE *fp, const char *tmp_path, const char *path)
+{
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+        log_message(LOG_ERR, "Failed to flush %s: %s", tmp_path, strerror(errno));
+        fclose(fp);
+        unlink(tmp_path);
+        return -1;
+    }
 
-        entries = safe_realloc(entries, (*entry_count + 1) * sizeof(char *));
-        entries[*entry_count] = safe_strdup(entry->d_name);
-        (*entry_count)++;
+    fclose(fp);
+
+    if (rename(tmp_path, path) == -1)
+    {
+        log_message(LOG_ERR, "Failed to replace %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
     }
 
-    closedir(dir);
-    return entries;
+    return 0;
 }
@@ -0,0 +1,321 @@
+#include "watcher.h"
+#include "dirscan.h"
+#include "exclude.h"
+#include "hashing.h"
+#include "logging.h"
+#include "merkle.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_MAX_DEPTH 64
+#define EVENT_BUF_SIZE 65536
+
+typedef struct
+{
+    size_t entry;
+    char  *name; // basename filter for file entries, NULL when the whole directory belongs to the entry
+    bool   root; // name is a directory entry's root, re-watched recursively when it reappears
+} watch_target_t;
+
+typedef struct
+{
+    char           *path;
+    watch_target_t *targets;
+    size_t          target_count;
+} watch_t;
+
+static int       inotify_fd = -1;
+static watch_t **watches = NULL;
+static size_t    watch_capacity = 0;
+static size_t    entry_total = 0;
+
+static void add_target(watch_t *watch, size_t entry, const char *name, bool root)
+{
+    for (size_t i = 0; i < watch->target_count; i++)
+    {
+        const watch_target_t *t = &watch->targets[i];
+
+        if (t->entry == entry && ((!t->name && !name) || (t->name && name && strcmp(t->name, name) == 0)))
+            return;
+    }
+
+    watch->targets = safe_realloc(watch->targets, (watch->target_count + 1) * sizeof(watch_target_t));
+    watch->targets[watch->target_count].entry = entry;
+    watch->targets[watch->target_count].name = name ? safe_strdup(name) : NULL;
+    watch->targets[watch->target_count].root = root;
+    watch->target_count++;
+}
+
+static void add_watch(const char *path, size_t entry, const char *name, bool root)
+{
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd == -1)
+    {
+        log_message(LOG_WARNING, "Failed to watch %s: %s", path, strerror(errno));
+        return;
+    }
+
+    if ((size_t)wd >= watch_capacity)
+    {
+        size_t new_capacity = watch_capacity ? watch_capacity : 64;
+        while (new_capacity <= (size_t)wd)
+            new_capacity *= 2;
+
+        watches = safe_realloc(watches, new_capacity * sizeof(watch_t *));
+        memset(watches + watch_capacity, 0, (new_capacity - watch_capacity) * sizeof(watch_t *));
+        watch_capacity = new_capacity;
+    }
+
+    if (!watches[wd])
+    {
+        watches[wd] = safe_malloc(sizeof(watch_t));
+        memset(watches[wd], 0, sizeof(watch_t));
+        watches[wd]->path = safe_strdup(path);
+    }
+
+    add_target(watches[wd], entry, name, root);
+}
+
+static void add_tree(const char *dir_path, size_t entry, int depth)
+{
+    dir_listing_t listing;
+    int           fd;
+
+    add_watch(dir_path, entry, NULL, false);
+
+    if (depth >= WATCH_MAX_DEPTH || subtree_excluded(dir_path))
+        return;
+
+    fd = dir_open_at(AT_FDCWD, dir_path);
+    if (fd == -1)
+        return;
+
+    if (dir_list(fd, &listing) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    for (size_t i = 0; i < listing.count; i++)
+    {
+        const dir_entry_t *child = &listing.entries[i];
+        char               fullpath[PATH_MAX];
+        struct stat        st;
+
+        // Only symlinks and entries of unknown type need a stat to tell whether they lead to a directory.
+        if (child->type != DT_DIR && child->type != DT_LNK && child->type != DT_UNKNOWN)
+            continue;
+
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dir_path, child->name);
+
+        if (path_excluded(fullpath))
+            continue;
+
+        if (child->type != DT_DIR && (fstatat(fd, child->name, &st, 0) == -1 || !S_ISDIR(st.st_mode)))
+            continue;
+
+        add_tree(fullpath, entry, depth + 1);
+    }
+
+    dir_listing_free(&listing);
+    close(fd);
+}
+
+static void free_watch(watch_t *watch)
+{
+    for (size_t i = 0; i < watch->target_count; i++)
+        free(watch->targets[i].name);
+
+    free(watch->targets);
+    free(watch->path);
+    free(watch);
+}
+
+// Watch the parent so a path replaced via rename, or a directory root that is deleted and recreated, is still seen.
+static void add_parent_watch(const char *path, size_t entry, bool root)
+{
+    char        parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash || slash[1] == '\0')
+        return;
+
+    if (slash == path)
+        strcpy(parent, "/");
+    else
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+
+    add_watch(parent, entry, slash + 1, root);
+}
+
+int watcher_init(const config_entry_t *entries, size_t count)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        log_message(LOG_ERR, "inotify unavailable, falling back to periodic scans: %s", strerror(errno));
+        return -1;
+    }
+
+    entry_total = count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        bool directory = entries[i].hash_level == HASH_DIR_LVL;
+
+        if (directory)
+            add_tree(entries[i].path, i, 0);
+
+        add_parent_watch(entries[i].path, i, directory);
+    }
+
+    log_message(LOG_INFO, "Watching %zu monitored paths for changes", count);
+
+    return 0;
+}
+
+int watcher_fd(void)
+{
+    return inotify_fd;
+}
+
+static size_t mark(bool dirty[], size_t entry)
+{
+    if (entry >= entry_total || dirty[entry])
+        return 0;
+
+    dirty[entry] = true;
+
+    return 1;
+}
+
+static size_t handle_event(const struct inotify_event *ev, bool dirty[])
+{
+    size_t marked = 0;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        log_message(LOG_WARNING, "inotify queue overflowed; re-hashing every monitored path");
+        merkle_invalidate_all();
+        for (size_t i = 0; i < entry_total; i++)
+            marked += mark(dirty, i);
+        return marked;
+    }
+
+    if (ev->wd < 0 || (size_t)ev->wd >= watch_capacity || !watches[ev->wd])
+        return 0;
+
+    watch_t *watch = watches[ev->wd];
+
+    for (size_t i = 0; i < watch->target_count; i++)
+    {
+        const watch_target_t *t = &watch->targets[i];
+
+        if (t->name)
+        {
+            if (ev->len == 0 || strcmp(ev->name, t->name) != 0)
+                continue;
+
+            marked += mark(dirty, t->entry);
+
+            // The root's own watch died with it (IN_IGNORED); start over on the directory that took its place.
+            if (t->root && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                char root[PATH_MAX];
+                snprintf(root, sizeof(root), "%s/%s", strcmp(watch->path, "/") == 0 ? "" : watch->path, ev->name);
+
+                merkle_invalidate(root);
+                add_tree(root, t->entry, 0);
+
+                watch = watches[ev->wd];
+            }
+            continue;
+        }
+
+        marked += mark(dirty, t->entry);
+
+        if (ev->len > 0)
+        {
+            char changed[PATH_MAX];
+            snprintf(changed, sizeof(changed), "%s/%s", watch->path, ev->name);
+            merkle_invalidate(changed);
+        }
+        else
+        {
+            merkle_invalidate(watch->path);
+        }
+
+        if (ev->len > 0 && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+        {
+            char fullpath[PATH_MAX];
+            snprintf(fullpath, sizeof(fullpath), "%s/%s", watch->path, ev->name);
+
+            if (!path_excluded(fullpath))
+                add_tree(fullpath, t->entry, 0);
+
+            watch = watches[ev->wd];
+        }
+    }
+
+    if (ev->mask & IN_IGNORED)
+    {
+        free_watch(watches[ev->wd]);
+        watches[ev->wd] = NULL;
+    }
+
+    return marked;
+}
+
+size_t watcher_drain(bool dirty[], size_t count)
+{
+    char    buf[EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    size_t  marked = 0;
+
+    if (inotify_fd == -1 || count < entry_total)
+        return 0;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+
+            marked += handle_event(ev, dirty);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (n == -1 && errno != EAGAIN && errno != EINTR)
+        log_message(LOG_ERR, "Failed to read inotify events: %s", strerror(errno));
+
+    return marked;
+}
+
+void watcher_close(void)
+{
+    for (size_t i = 0; i < watch_capacity; i++)
+    {
+        if (watches[i])
+            free_watch(watches[i]);
+    }
+
+    free(watches);
+    watches = NULL;
+    watch_capacity = 0;
+    entry_total = 0;
+
+    if (inotify_fd != -1)
+        close(inotify_fd);
+    inotify_fd = -1;
+}